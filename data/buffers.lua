@@ -0,0 +1,53 @@
+-- materials
+require('materials')
+
+-- Scene root
+scene = gr.node('scene')
+
+length = 30
+
+-- A rippled surface generated in the script. The vertices and triangles are written into buffers
+-- which the mesh uses directly, rather than building tables of tables
+n = 400
+verts = gr.vec3_buffer()
+for j = 0, n do
+  for i = 0, n do
+    local x = 2.0 * i / n - 1.0
+    local z = 2.0 * j / n - 1.0
+    local r = math.sqrt(x*x + z*z)
+    verts:push(x, 0.1 * math.cos(12.0 * r) * math.exp(-2.0 * r), z)
+  end
+end
+
+indices = gr.index_buffer()
+for j = 0, n-1 do
+  for i = 0, n-1 do
+    local a = j * (n+1) + i
+    local b = a + 1
+    local c = a + n + 1
+    local d = c + 1
+    indices:push(a, c, b, b, c, d)
+  end
+end
+
+ripple = gr.tri_mesh('ripple', verts, indices)
+scene:add_child(ripple)
+ripple:set_material(turquoise)
+ripple:scale(3, 3, 3)
+ripple:translate(0, 0.5, 0)
+
+floor = gr.plane('floor')
+scene:add_child(floor)
+floor:set_material(white_cornell)
+floor:scale(length, 1.0, length)
+
+-- lights
+light_color = {0.780131, 0.780409, 0.775833}
+
+light1 = gr.disc_light({5, 10, -10}, light_color, {1, 0, 0}, {-5, -10, 10}, 2)
+
+gr.render(scene,
+	  'buffers.png', 512, 512,
+	  {0, 4, -8}, {0, -4, 8}, {0, 1, 0}, 50,
+	  {0.2,0.2,0.2}, {light1},
+    4, 1, 2, 4)
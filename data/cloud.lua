@@ -0,0 +1,39 @@
+-- materials
+require('materials')
+
+-- Scene root
+scene = gr.node('scene')
+
+length = 30
+
+-- A galaxy shaped cloud of small spheres. The whole cloud is a single node
+math.randomseed(488)
+centers = {}
+for i = 1, 50000 do
+  local r = 4.0 * math.sqrt(math.random())
+  local theta = 2.0 * math.pi * math.random() + 1.5 * r
+  local y = 0.2 * (math.random() - 0.5) * (4.0 - r)
+  table.insert(centers, {r * math.cos(theta), y, r * math.sin(theta)})
+end
+
+cloud = gr.sphere_cloud('cloud', centers, 0.02)
+scene:add_child(cloud)
+cloud:set_material(gold)
+cloud:rotate('x', 20)
+cloud:translate(0, 2, 0)
+
+floor = gr.plane('floor')
+scene:add_child(floor)
+floor:set_material(white_cornell)
+floor:scale(length, 1.0, length)
+
+-- lights
+light_color = {0.780131, 0.780409, 0.775833}
+
+light1 = gr.disc_light({5, 10, -10}, light_color, {1, 0, 0}, {-5, -10, 10}, 2)
+
+gr.render(scene,
+	  'cloud.png', 512, 512,
+	  {0, 4, -10}, {0, -2, 10}, {0, 1, 0}, 50,
+	  {0.2,0.2,0.2}, {light1},
+    4, 1, 2, 4)
@@ -2,9 +2,6 @@
 -- materials
 require('materials')
 
--- need this to read obj files
-require('readobj')
-
 -- Scene root
 scene = gr.node('scene')
 
@@ -13,7 +10,7 @@ length = 10
 
 white = gr.material({1.0, 1.0, 1.0}, {0, 0, 0}, 5)
 
-teapot = gr.tri_mesh('teapot', readobj('objs/teapot_n.obj'))
+teapot = gr.load_obj('teapot', 'objs/teapot_n.obj')
 scene:add_child(teapot)
 teapot:set_material(white)
 teapot:translate(-0.05, 0, -3.1)
@@ -0,0 +1,23 @@
+-- materials
+require('materials')
+
+-- Scene root
+scene = gr.node('scene')
+
+-- The heightfield spans [-0.5, 0.5] along x and z with heights in [0, 1], scale it up to the size of the terrain
+terrain = gr.heightfield('terrain', 'bumps/marsbump1k.png')
+scene:add_child(terrain)
+terrain:set_material(white_cornell)
+terrain:set_texture('textures/marsmap1k.png')
+terrain:scale(20, 1.5, 10)
+
+-- lights
+light_color = {0.780131, 0.780409, 0.775833}
+
+light1 = gr.disc_light({-10, 10, 10}, light_color, {1, 0, 0}, {10, -10, -10}, 2)
+
+gr.render(scene,
+	  'terrain.png', 1024, 512,
+	  {0, 4, -9}, {0, -3, 9}, {0, 1, 0}, 50,
+	  {0.2,0.2,0.2}, {light1},
+    4, 1, 2, 4)
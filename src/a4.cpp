@@ -1,21 +1,74 @@
 #include "a4.hpp"
 #include "image.hpp"
 #include "perlin.hpp"
+#include "checkpoint.hpp"
+#include "meshcache.hpp"
 
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <cmath>
 #include <algorithm>
 #include <chrono>
-#include <random>
 #include <functional>
 #include <thread>
 #include <utility>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <csignal>
+#include <sstream>
 
 unsigned int progress = 0;
+uint64_t progress_pixels = 0;
+uint64_t progress_total = 0;
 std::mutex progress_mut;
 std::condition_variable progress_cond;
 
+// Rays cast by a thread, added to the totals for the render when it finishes
+struct RayCounts {
+  uint64_t primary;
+  uint64_t secondary; // Reflected and refracted
+  uint64_t shadow;
+};
+thread_local RayCounts ray_counts;
+RayCounts total_rays;
+
+// For adaptive shadows, whether the first hit of a pixel next to the one being traced was in a penumbra, and whether
+// this pixel's has been
+thread_local bool penumbra_nearby = false;
+thread_local bool penumbra_seen = false;
+
+// Set by SIGTERM while a render that keeps checkpoints is running
+volatile std::sig_atomic_t terminated = 0;
+
+void a4_terminate(int)
+{
+  terminated = 1;
+}
+
+const unsigned int TILE_SIZE = 16;
+
+struct Tile {
+  unsigned int x0, y0, x1, y1;
+};
+
+// A light to shade at a hit, with the bound on what it adds there, the weight Russian roulette gave it and the first
+// of its dimensions of the sample
+struct ShadedLight {
+  double bound;
+  double weight;
+  uint32_t dimension;
+  const std::shared_ptr<Light>* light;
+};
+
+// A pass of a progressive render, in which every pixel adds a sample from the given stratum to its sums and shows
+// their mean
+struct Pass {
+  unsigned int stratum;
+  std::vector<Colour>* sums;
+  std::vector<Colour>* squares;
+};
+
 Matrix4x4 a4_get_unproject_matrix(int width, int height, double fov, double d, Point3D eye, Vector3D view, Vector3D up)
 {
   double fov_r = fov * M_PI / 180.0;
@@ -85,9 +138,12 @@ Colour a4_lighting(const Ray& ray, const Intersection& i, const std::shared_ptr<
 Colour a4_shadow_ray(const Ray& ray, const std::shared_ptr<SceneNode> root, const std::shared_ptr<Light> light, const Point3D& light_pos, const Point3D& hit, const Intersection& i)
 {
   // Cast shadow rays to the light source. If the ray intersects an object before reaching the light
-  // source then don't count that light sources contribution since it is being blocked
-  Ray shadow(hit, light_pos-hit);
+  // source then don't count that light sources contribution since it is being blocked. The shadow ray is as
+  // wide as the incoming ray was at the hit
+  Ray shadow(hit, light_pos-hit, ray.footprint((i.q-ray.origin()).length()));
+  shadow.set_surface(i.surface);
   Intersection u;
+  ray_counts.shadow++;
   
   // Make sure to check if intersection point is before light source
   if(root->intersect(shadow, u) && (u.q-shadow.origin()).length() < (light_pos-shadow.origin()).length()) return Colour(0.0, 0.0, 0.0);
@@ -97,37 +153,37 @@ Colour a4_shadow_ray(const Ray& ray, const std::shared_ptr<SceneNode> root, cons
   return a4_lighting(ray, i, light, light_pos);
 }
 
-Ray a4_reflect(const Point3D& origin, const Vector3D& direction, const Vector3D& normal)
+Ray a4_reflect(const Point3D& origin, const Vector3D& direction, const Vector3D& normal, double width, double spread)
 {
-  return Ray(origin, direction - 2*direction.dot(normal)*normal);
+  return Ray(origin, direction - 2*direction.dot(normal)*normal, width, spread);
 }
 
-std::tuple<bool, Ray> a4_reflect_perturbed(const Ray& reflected, const Vector3D& normal, double glossiness, const std::function<double()>& uniform)
+// Reflects in a direction picked by (e1, e2) in the unit square from the Phong lobe cos^n around the mirror direction.
+// Directions are picked in proportion to the lobe so every ray has the same weight. The exponent is n = 12/g^2 for
+// glossiness g, for which the lobe spreads rays as widely as an even spread over a square of side g would. Also returns
+// whether the direction is below the surface
+std::tuple<bool, Ray> a4_reflect_perturbed(const Ray& reflected, const Vector3D& normal, double glossiness, double e1, double e2)
 {
   Vector3D r = reflected.direction();
-  Vector3D na = -r;
-  Vector3D U, V;
-
-  // Get the basis vectors for the square of size <glossiness>x<glossiness>
-  if(na[2] > na[0] && na[2] > na[1]) U = Vector3D(-na[1], na[0], 0.0);
-  else if(na[1] > na[0]) U = Vector3D(-na[2], 0.0, na[0]);
-  else U = Vector3D(0.0, -na[2], na[1]);
-  U.normalized();
-
-  V = na.cross(U).normalized();
-
-  // Randomly generate a 2D point on the square
-  double u = -(glossiness * 0.5) + uniform() * glossiness;
-  double v = -(glossiness * 0.5) + uniform() * glossiness;
-
-  // Use the 2D point and the basis vectors for the square to perturb the reflection ray to point to a location on the square
-  Point3D rp = Point3D(r[0], r[1], r[2]) + u * U + v * V;
 
-  // Set the new perturbed direction vector for the ray
-  r = Vector3D(rp[0], rp[1], rp[2]);
-
-  // Check if the perturbed ray is below the surface
-  return std::tuple<bool, Ray>(normal.dot(r) < 0, Ray(reflected.origin(), r)); 
+  // Get the basis vectors perpendicular to the mirror direction
+  Vector3D U = (std::fabs(r[0]) > std::fabs(r[2])) ? Vector3D(-r[1], r[0], 0.0) : Vector3D(0.0, -r[2], r[1]);
+  U.normalize();
+  Vector3D V = r.cross(U);
+
+  // The angle a from the mirror direction has cos(a) = e1^(1/(n+1)). Mirrors have exponents in the billions, so sin(a)
+  // is worked out from the log to keep its precision
+  double exponent = 12.0 / (glossiness * glossiness);
+  double log_cos = std::log(std::max(e1, 1e-300)) / (exponent + 1.0);
+  double cos_a = std::exp(log_cos);
+  double sin_a = std::sqrt(-std::expm1(2.0 * log_cos));
+  double phi = 2.0 * M_PI * e2;
+  Vector3D direction = cos_a * r + (sin_a * std::cos(phi)) * U + (sin_a * std::sin(phi)) * V;
+
+  // The ray's cone widens by the width of the lobe
+  Ray perturbed(reflected.origin(), direction, reflected.width(), reflected.spread() + glossiness);
+  perturbed.set_surface(reflected.surface());
+  return std::tuple<bool, Ray>(direction.dot(normal) < 0.0, perturbed);
 }
 
 std::tuple<bool, double, Ray>   a4_refract(const Point3D& hit, const Vector3D& direction, const Vector3D& n, double ni)
@@ -173,8 +229,22 @@ std::tuple<bool, double, Ray>   a4_refract(const Point3D& hit, const Vector3D& d
   return std::tuple<bool, double, Ray>(cosT < 0, R, refracted_ray);
 }
 
-Colour a4_trace_ray(const Ray& ray, const std::shared_ptr<SceneNode> root, const std::list<std::shared_ptr<Light>>& lights, const Colour& ambient, const Colour& bg, const std::function<double()>& uniform, int recurse_level, unsigned int shadow_samples, unsigned int glossy_samples)
+// Russian roulette for a ray with the given throughput. Returns the weight of its colour, which is 0 if it isn't traced.
+// The random number comes from dimension d of the sample if it is given, otherwise from a new one
+double a4_roulette(const Colour& throughput, double threshold, Sampler& sampler, int64_t d = -1)
 {
+  double largest = std::max(throughput.R(), std::max(throughput.G(), throughput.B()));
+  if(!(largest < threshold)) return 1.0;
+  double e = (d < 0) ? sampler.uniform() : sampler.get(d);
+  if(largest <= 0.0 || e >= largest / threshold) return 0.0;
+  return threshold / largest;
+}
+
+Colour a4_trace_ray(const Ray& ray, const std::shared_ptr<SceneNode> root, const std::list<std::shared_ptr<Light>>& lights, const Colour& ambient, const Colour& bg, Sampler& sampler, int recurse_level, unsigned int shadow_samples, unsigned int glossy_samples, const RenderOptions& options, const Colour& throughput, unsigned int bounce)
+{
+  if(bounce == 0) ray_counts.primary++;
+  else ray_counts.secondary++;
+
   // Test intersection of ray with scene for each light source
   Colour colour = bg;
   Intersection i;
@@ -187,6 +257,9 @@ Colour a4_trace_ray(const Ray& ray, const std::shared_ptr<SceneNode> root, const
     Vector3D n = i.n.normalized();
     Point3D hit = i.q + (1e-9)*n;
 
+    // Reflected and refracted rays start as wide as this ray's cone is at the hit
+    double width = ray.footprint((i.q-ray.origin()).length());
+
     // Get the material and the diffuse colour
     std::shared_ptr<const PhongMaterial> material = std::dynamic_pointer_cast<const PhongMaterial>(i.m);
     Colour diffuse = material->use_perlin() ? material->diffuse(i.q[0], i.q[1], i.q[2]) : material->diffuse(i.u, i.v);
@@ -196,57 +269,150 @@ Colour a4_trace_ray(const Ray& ray, const std::shared_ptr<SceneNode> root, const
 
     if(material->diffuse() != Colour(0.0, 0.0, 0.0))
     {
-      for(auto light : lights)
+      // Bound what each light could add if nothing blocked it: its attenuation at its nearest point times the diffuse
+      // colour at the largest cosine any point of it makes with the normal, plus the specular colour. Lights behind the
+      // surface add nothing, and dim lights are kept by Russian roulette. Each light has its own dimensions whichever
+      // are kept, and the rest are shaded brightest first
+      Vector3D normal = material->bump(i.n, i.pu, i.pv, i.u, i.v);
+      uint32_t light_dimensions = (options.adaptive_shadows ? 4 : 2) + 2;
+      uint32_t d = sampler.dimensions(light_dimensions * lights.size());
+      std::vector<ShadedLight> shaded;
+      for(auto& light : lights)
       {
-        // Cast shadow rays to each light source (multiple times if area light for soft shadows)
+        uint32_t light_d = d;
+        d += light_dimensions;
+
+        double max_cos, min_distance;
+        light->getBounds(hit, normal, max_cos, min_distance);
+        if(max_cos <= 0.0) continue;
+
+        Colour bound = light->getAttenuation(min_distance) * ((max_cos * diffuse + material->specular()) * light->getColour());
+        double weight = a4_roulette(throughput * bound, options.light_threshold, sampler, light_d + light_dimensions - 2);
+        if(weight == 0.0) continue;
+
+        ShadedLight entry = { std::max(bound.R(), std::max(bound.G(), bound.B())), weight, light_d, &light };
+        shaded.push_back(entry);
+      }
+      std::sort(shaded.begin(), shaded.end(), [](const ShadedLight& a, const ShadedLight& b) { return a.bound > b.bound; });
+
+      for(auto& entry : shaded)
+      {
+        const std::shared_ptr<Light>& light = *entry.light;
+        uint32_t light_d = entry.dimension;
+
+        // Cast shadow rays to each light source (multiple times if area light for soft shadows). The samples of an
+        // area light are weighted by solid angle, so the parts of the light nearer the hit and facing it count for more,
+        // and normalised so the light is as bright overall as a point light
         Colour shade_colour(0.0, 0.0, 0.0);
+        double total_weight = 0.0;
         unsigned int num_shadow_rays = (light->isPointLight()) ? 1 : shadow_samples;
-        for(unsigned int j = 0; j < num_shadow_rays; j++)
+        unsigned int lit = 0;
+        auto cast = [&](uint32_t d, unsigned int count) {
+          for(unsigned int j = 0; j < count; j++)
+          {
+            Point3D light_pos = (light->isPointLight()) ? light->getPosition() :
+              light->getPosition(sampler.get(d, j, count), sampler.get(d+1, j, count));
+            double weight = light->getSolidAngle(light_pos, hit);
+            total_weight += weight;
+            Colour shade = a4_shadow_ray(ray, root, light, light_pos, hit, i);
+            if(shade == Colour(0.0, 0.0, 0.0)) continue;
+            shade_colour = shade_colour + weight * shade;
+            lit++;
+          }
+        };
+
+        // Adaptive shadows cast the probes as a set of their own and the rest as another, so both are spread over the
+        // light. The rest are only cast if the probes disagree, or straight away next to a penumbra
+        if(options.adaptive_shadows && num_shadow_rays > 1)
+        {
+          unsigned int num_probes = (bounce == 0 && penumbra_nearby) ? num_shadow_rays : std::min(options.shadow_probes, num_shadow_rays);
+          cast(light_d, num_probes);
+          if(lit > 0 && lit < num_probes)
+          {
+            cast(light_d+2, num_shadow_rays - num_probes);
+            if(bounce == 0) penumbra_seen = true;
+          }
+        }
+        else
         {
-          Point3D light_pos = (num_shadow_rays == 1) ? light->getPosition() : light->getPosition(uniform);
-          shade_colour = shade_colour + a4_shadow_ray(ray, root, light, light_pos, hit, i);
+          cast(light_d, num_shadow_rays);
         }
-        if(shade_colour == Colour(0.0, 0.0, 0.0)) continue;
-        colour = colour + Colour(shade_colour.R() / num_shadow_rays, shade_colour.G() / num_shadow_rays, shade_colour.B() / num_shadow_rays);
+
+        if(lit == 0 || total_weight <= 0.0) continue;
+        colour = colour + (entry.weight / total_weight) * shade_colour;
       }
     }
 
+    Colour specular = material->specular();
+    if(specular == Colour(0.0, 0.0, 0.0) || recurse_level <= 0) return colour;
+
+    // The reflection and refraction are scaled by the Fresnel coefficient
+    double R = 1.0;
+    Ray refracted_ray(Point3D(0.0, 0.0, 0.0), Vector3D(0.0, 0.0, 0.0));
+    bool refracts = false;
+    if(material->ni() > 0)
+    {
+      std::tuple<bool, double, Ray> ret = a4_refract(i.q, ray.direction(), n, material->ni());
+      R = std::get<1>(ret);
+      refracts = !std::get<0>(ret);
+      if(refracts) refracted_ray = Ray(std::get<2>(ret).origin(), std::get<2>(ret).direction(), width, ray.spread());
+      refracted_ray.set_surface(i.surface);
+    }
+
+    // Past the bounces that branch the path follows either the reflection or the refraction. Choosing the reflection
+    // with probability R makes up for its weight R, and the refraction's 1 - R
+    bool branch = bounce < options.branch_bounces;
+    double reflect_weight = R, refract_weight = refracts ? 1.0 - R : 0.0;
+    if(!branch && refracts)
+    {
+      bool reflect = sampler.uniform() < R;
+      reflect_weight = reflect ? 1.0 : 0.0;
+      refract_weight = reflect ? 0.0 : 1.0;
+    }
+
     // Cast reflection rays and add the colour returned to render reflections on object
-    Colour reflected_colour(0.0, 0.0, 0.0);
-    if(material->specular() != Colour(0.0, 0.0, 0.0) && recurse_level > 0) 
+    if(reflect_weight > 0.0)
     {
+      Colour reflected_colour(0.0, 0.0, 0.0);
+      unsigned int num_rays = branch ? glossy_samples : 1;
+      Colour ray_throughput = reflect_weight * (throughput * specular);
       double glossiness = 1.0 / (material->shininess() + 1.0);
-      Ray reflected = a4_reflect(hit, ray.direction(), n);
-      for(unsigned int refl = 0; refl < glossy_samples; refl++)
+
+      // Rays reflected inside a refractive object stay on the inside of its surface
+      Vector3D facing = (ray.direction().dot(n) > 0.0) ? -n : n;
+      Ray reflected = a4_reflect(i.q + (1e-9)*facing, ray.direction(), facing, width, ray.spread());
+      reflected.set_surface(i.surface);
+      uint32_t d = sampler.dimensions(2);
+      for(unsigned int refl = 0; refl < num_rays; refl++)
       {
-        std::tuple<bool, Ray> ret = a4_reflect_perturbed(reflected, n, glossiness, uniform);
+        double weight = a4_roulette(ray_throughput, options.roulette_threshold, sampler);
+        if(weight == 0.0) continue;
+
+        // A direction below the surface contributes nothing but still counts as a sample. Mirroring it back up would
+        // bias the lobe toward the surface
+        std::tuple<bool, Ray> ret = a4_reflect_perturbed(reflected, facing, glossiness, sampler.get(d, refl, num_rays), sampler.get(d+1, refl, num_rays));
         bool below_surface = std::get<0>(ret);
-        if(!below_surface)
-        {
-          Ray reflected_ray = std::get<1>(ret);
-          reflected_colour = reflected_colour + a4_trace_ray(reflected_ray, root, lights, ambient, reflected_colour, uniform, recurse_level-1, shadow_samples, glossy_samples);
-        }
+        if(below_surface) continue;
+
+        Ray reflected_ray = std::get<1>(ret);
+        // Misses are black like the refracted ray's, the running sum isn't a background
+        Colour sample_colour = a4_trace_ray(reflected_ray, root, lights, ambient, Colour(0.0, 0.0, 0.0), sampler, recurse_level-1, shadow_samples, glossy_samples, options, weight * ray_throughput, bounce+1);
+        reflected_colour = reflected_colour + weight * sample_colour;
       }
-      reflected_colour = (1.0 / glossy_samples) * reflected_colour;
+      colour = colour + (reflect_weight / num_rays) * (specular * reflected_colour);
     }
 
-    // Cast refracted rays and add the colour returned
-    double R = 1.0;
-    Colour refracted_colour(0.0, 0.0, 0.0);
-    if(material->ni() > 0 && recurse_level > 0)
+    // Cast the refracted ray and add the colour returned
+    if(refract_weight > 0.0)
     {
-      std::tuple<bool, double, Ray> ret = a4_refract(i.q, ray.direction(), n, material->ni());
-      bool total_internal_reflection = std::get<0>(ret);
-      R = std::get<1>(ret);
-      if(!total_internal_reflection)
+      Colour ray_throughput = refract_weight * (throughput * specular);
+      double weight = a4_roulette(ray_throughput, options.roulette_threshold, sampler);
+      if(weight > 0.0)
       {
-        Ray refracted_ray = std::get<2>(ret);
-        refracted_colour = a4_trace_ray(refracted_ray, root, lights, ambient, refracted_colour, uniform, recurse_level-1, shadow_samples, glossy_samples);
+        Colour refracted_colour = a4_trace_ray(refracted_ray, root, lights, ambient, Colour(0.0, 0.0, 0.0), sampler, recurse_level-1, shadow_samples, glossy_samples, options, weight * ray_throughput, bounce+1);
+        colour = colour + (refract_weight * weight) * (specular * refracted_colour);
       }
     }
-
-    // Add the reflection and refraction components and scale them with the Fresnel coefficient
-    colour = colour + material->specular() * ((R * reflected_colour) + ((1 - R) * refracted_colour));
   }
 
   return colour;
@@ -279,65 +445,298 @@ Colour a4_get_background_colour(Image& img, int x, int y, int width, int height)
     (up)*(vp)*Colour(img(i1, j1, 0), img(i1, j1, 1), img(i1, j1, 2));
 }
 
-void a4_render_thread(Image* img, unsigned int ystart, unsigned int yskip, unsigned int width, unsigned int height, std::shared_ptr<SceneNode> root, const Matrix4x4 unproject, const Point3D eye, const Colour ambient, const std::list<std::shared_ptr<Light>> lights, unsigned int recurse_level, unsigned int aa_samples, unsigned int shadow_samples, unsigned int glossy_samples, Image* bgimg)
+// Square tiles of the image in Morton (Z) order: consecutive tiles are next to each other, and so are the tiles
+// threads take at about the same time. Rays from neighbouring tiles tend to hit the same geometry which keeps caches
+// such as the clusters of a paged mesh warm
+std::vector<Tile> a4_get_tiles(unsigned int width, unsigned int height)
 {
-  // Seed the rng and set the uniform distribution object
-  std::mt19937 gen(std::chrono::system_clock::now().time_since_epoch().count());
-  std::uniform_real_distribution<double> uniform_distribution(0, 1);
-  std::function<double()> uniform = std::bind(uniform_distribution, std::ref(gen));
+  auto spread = [](unsigned int v) {
+    uint64_t x = v;
+    x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+    x = (x | (x << 8)) & 0x00FF00FF00FF00FFULL;
+    x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    x = (x | (x << 2)) & 0x3333333333333333ULL;
+    x = (x | (x << 1)) & 0x5555555555555555ULL;
+    return x;
+  };
+
+  std::vector<std::pair<uint64_t, Tile>> tiles;
+  for(unsigned int j = 0; j * TILE_SIZE < height; j++)
+  {
+    for(unsigned int i = 0; i * TILE_SIZE < width; i++)
+    {
+      Tile tile = { i * TILE_SIZE, j * TILE_SIZE, std::min(width, (i+1) * TILE_SIZE), std::min(height, (j+1) * TILE_SIZE) };
+      tiles.push_back(std::make_pair(spread(i) | (spread(j) << 1), tile));
+    }
+  }
 
-  int one_percent = width * height * 0.01;
-  int pixel_count = 0;
+  std::sort(tiles.begin(), tiles.end(), [](const std::pair<uint64_t, Tile>& a, const std::pair<uint64_t, Tile>& b) { return a.first < b.first; });
 
-  glossy_samples = (glossy_samples == 0) ? 1 : glossy_samples;
-  shadow_samples = (shadow_samples == 0) ? 1 : shadow_samples;
-  aa_samples = (aa_samples == 0) ? 1 : aa_samples;
-  for (unsigned int y = ystart; y < height; y += yskip) {
-    for (unsigned int x = 0; x < width; x++) {
-      // Background colour. a4_trace_ray returns this if no intersections
-      Colour bg = bgimg->empty() ? ((x+y) & 0x10) ? (double)y/height * Colour(1.0, 1.0, 1.0) : Colour(0.0, 0.0, 0.0) :
-        a4_get_background_colour(*bgimg, x, y, img->width(), img->height());
+  std::vector<Tile> order;
+  for(auto& tile : tiles) order.push_back(tile.second);
+  return order;
+}
 
-      // Cast a ray into the scene and get the colour returned
-      Colour colour(0.0, 0.0, 0.0);
+// The strata of an n by n grid over a pixel in the order to sample them. Adaptive sampling may stop part way, so then
+// every prefix should be spread over the pixel: the strata are sorted by the bits of their row and column interleaved
+// and reversed, which takes one from each quarter of the pixel first, then one from each sixteenth and so on
+std::vector<std::pair<unsigned int, unsigned int>> a4_get_strata(unsigned int n, bool spread)
+{
+  std::vector<std::pair<uint32_t, std::pair<unsigned int, unsigned int>>> strata;
+  for(unsigned int p = 0; p < n; p++)
+  {
+    for(unsigned int q = 0; q < n; q++)
+    {
+      uint32_t key = 0;
+      for(int b = 0; b < 16; b++) key |= (((p >> b) & 1) << (31 - 2*b)) | (((q >> b) & 1) << (30 - 2*b));
+      strata.push_back(std::make_pair(spread ? key : 0, std::make_pair(p, q)));
+    }
+  }
 
-      // For antialiasing, divide the "pixel" into a n by n grid and cast rays from a random point within each grid box
-      for(unsigned int p = 0; p < aa_samples; p++)
-      {
-        for(unsigned int q = 0; q < aa_samples; q++)
-        {
-          // Unproject the pixel to the projection plane
-          double e = uniform();
-          Point3D pixel ((double)x + ((double)p + e) / (double)aa_samples, (double)y - ((double)q + e) / (double)aa_samples, 0.0);
-          Point3D p = unproject * pixel;
+  std::stable_sort(strata.begin(), strata.end(), [](const std::pair<uint32_t, std::pair<unsigned int, unsigned int>>& a, const std::pair<uint32_t, std::pair<unsigned int, unsigned int>>& b) { return a.first < b.first; });
 
-          // Create the ray with origin at the eye point
-          Ray ray(eye, p-eye);
+  std::vector<std::pair<unsigned int, unsigned int>> order;
+  for(auto& stratum : strata) order.push_back(stratum.second);
+  return order;
+}
 
-          colour = colour + a4_trace_ray(ray, root, lights, ambient, bg, uniform, recurse_level, shadow_samples, glossy_samples);
-        }
-      }
+// The average colour over the square of the projection plane from (x, y) to (x+size, y-size), given the colours at its
+// corners (x, y), (x+size, y), (x, y-size) and (x+size, y-size). While the corners differ by more than the contrast the
+// square is split into quarters, sharing the corners and the points on the edges between them, depth times at most.
+// rays counts the rays traced
+Colour a4_subdivide(const std::function<Colour(double, double, double)>& trace, double x, double y, double size, const Colour corners[4], unsigned int depth, double contrast, unsigned int& rays)
+{
+  double lo[3] = { corners[0].R(), corners[0].G(), corners[0].B() };
+  double hi[3] = { lo[0], lo[1], lo[2] };
+  for(int i = 1; i < 4; i++)
+  {
+    double c[3] = { corners[i].R(), corners[i].G(), corners[i].B() };
+    for(int k = 0; k < 3; k++)
+    {
+      lo[k] = std::min(lo[k], c[k]);
+      hi[k] = std::max(hi[k], c[k]);
+    }
+  }
+
+  if(depth == 0 || std::max(hi[0] - lo[0], std::max(hi[1] - lo[1], hi[2] - lo[2])) <= contrast)
+  {
+    return 0.25 * (corners[0] + corners[1] + corners[2] + corners[3]);
+  }
 
-      // Of course, have to divide the colour by the number of samples taken
-      double n = aa_samples * aa_samples;
-      colour = Colour(colour.R() / n, colour.G() / n, colour.B() / n);
+  double half = size / 2.0;
+  Colour y0 = trace(x + half, y, half);
+  Colour x0 = trace(x, y - half, half);
+  Colour centre = trace(x + half, y - half, half);
+  Colour x1 = trace(x + size, y - half, half);
+  Colour y1 = trace(x + half, y - size, half);
+  rays += 5;
+
+  Colour quarters[4][4] = {
+    { corners[0], y0, x0, centre },
+    { y0, corners[1], centre, x1 },
+    { x0, centre, corners[2], y1 },
+    { centre, x1, y1, corners[3] }
+  };
+  return 0.25 * (a4_subdivide(trace, x, y, half, quarters[0], depth - 1, contrast, rays) +
+                 a4_subdivide(trace, x + half, y, half, quarters[1], depth - 1, contrast, rays) +
+                 a4_subdivide(trace, x, y - half, half, quarters[2], depth - 1, contrast, rays) +
+                 a4_subdivide(trace, x + half, y - half, half, quarters[3], depth - 1, contrast, rays));
+}
 
-      (*img)(x, y, 0) = colour.R();
-      (*img)(x, y, 1) = colour.G();
-      (*img)(x, y, 2) = colour.B();
+void a4_render_thread(Image* img, const std::vector<Tile>* tiles, std::atomic<unsigned int>* next_tile, unsigned int width, unsigned int height, std::shared_ptr<SceneNode> root, const Matrix4x4 unproject, const Point3D eye, const Colour ambient, const std::list<std::shared_ptr<Light>> lights, unsigned int recurse_level, unsigned int aa_samples, unsigned int shadow_samples, unsigned int glossy_samples, Image* bgimg, double pixel_spread, const RenderOptions* options, std::vector<unsigned int>* sample_counts, const Pass* pass, const std::atomic<bool>* halt, uint64_t seed)
+{
+  glossy_samples = (glossy_samples == 0) ? 1 : glossy_samples;
+  ray_counts = RayCounts();
+  shadow_samples = (shadow_samples == 0) ? 1 : shadow_samples;
+  aa_samples = (aa_samples == 0) ? 1 : aa_samples;
 
-      if(++pixel_count >= one_percent)
-      {
-        {
-          std::lock_guard<std::mutex> lock(progress_mut);
-          progress++;
+  // Each sample stands for a cone of the part of the pixel it covers
+  double spread = pixel_spread / aa_samples;
+
+  // For antialiasing, divide the "pixel" into a n by n grid and cast rays from a random point within each grid box.
+  // In adaptive mode the pixel takes a few samples, then more a round at a time until the standard error of their mean
+  // is below the threshold in every channel or all the strata have been sampled
+  std::vector<std::pair<unsigned int, unsigned int>> strata = a4_get_strata(aa_samples, options->adaptive || pass != nullptr);
+  unsigned int max_samples = strata.size();
+  unsigned int round = options->adaptive ? std::max(1u, std::min(options->aa_base_samples, max_samples)) : max_samples;
+
+  // Background colour of a pixel. a4_trace_ray returns this if no intersections
+  auto background = [&](unsigned int x, unsigned int y) {
+    return bgimg->empty() ? ((x+y) & 0x10) ? (double)y/height * Colour(1.0, 1.0, 1.0) : Colour(0.0, 0.0, 0.0) :
+      a4_get_background_colour(*bgimg, x, y, img->width(), img->height());
+  };
+
+  // Samples are numbered in the spread order of their strata whichever order they are taken in, so that in the
+  // adaptive and progressive modes the samples a pixel has taken are the first points of a low discrepancy sequence
+  std::vector<std::pair<unsigned int, unsigned int>> spread_order = a4_get_strata(aa_samples, true);
+  std::vector<unsigned int> rank(max_samples);
+  for(unsigned int i = 0; i < max_samples; i++) rank[spread_order[i].first * aa_samples + spread_order[i].second] = i;
+
+  // Colour seen through a random point in stratum (p, q) of pixel (x, y)
+  auto jittered = [&](unsigned int x, unsigned int y, unsigned int p, unsigned int q, const Colour& bg) {
+    Sampler sampler(options->sampler, seed, x, y, rank[p * aa_samples + q], max_samples);
+
+    // Random points are jittered within the stratum, low discrepancy points are spread over the pixel already
+    uint32_t d = sampler.dimensions(2);
+    double u = sampler.get(d), v = sampler.get(d+1);
+    if(sampler.type() == SamplerType::RANDOM)
+    {
+      u = (p + u) / (double)aa_samples;
+      v = (q + v) / (double)aa_samples;
+    }
+
+    // Unproject the pixel to the projection plane
+    Point3D pixel ((double)x + u, (double)y - v, 0.0);
+    Point3D point = unproject * pixel;
+
+    // Create the ray with origin at the eye point
+    Ray ray(eye, point-eye, 0.0, spread);
+
+    return a4_trace_ray(ray, root, lights, ambient, bg, sampler, recurse_level, shadow_samples, glossy_samples, *options, Colour(1.0, 1.0, 1.0), 0);
+  };
+
+  // In subdivision mode rays go through exact points of the projection plane, where pixel (x, y) is the square from
+  // (x, y) to (x+1, y-1). A ray covering a square of the given size stands for a cone of that part of a pixel. The
+  // points lie on a lattice of 2^depth points per pixel, whose index keys their random numbers
+  unsigned int depth = 0;
+  while((1u << depth) < aa_samples) depth++;
+  std::function<Colour(double, double, double)> trace = [&](double px, double py, double size) {
+    unsigned int x = std::min((unsigned int)std::max(0.0, px), width - 1);
+    unsigned int y = std::min((unsigned int)std::max(0.0, std::ceil(py)), height - 1);
+    Sampler sampler(options->sampler, seed, std::llround(px * (1 << depth)), std::llround((py + 1.0) * (1 << depth)), 0, 1);
+    Point3D point = unproject * Point3D(px, py, 0.0);
+    Ray ray(eye, point-eye, 0.0, pixel_spread * size);
+    return a4_trace_ray(ray, root, lights, ambient, background(x, y), sampler, recurse_level, shadow_samples, glossy_samples, *options, Colour(1.0, 1.0, 1.0), 0);
+  };
+
+  // Adaptive shadows keep which pixels of the tile had their first hit in a penumbra, so that the pixels after them
+  // cast all their shadow rays. Only pixels already traced in the tile are looked at, so the image doesn't depend on
+  // which thread renders which tile
+  std::vector<bool> penumbrae(TILE_SIZE * TILE_SIZE, false);
+  auto begin_pixel = [&](const Tile& tile, unsigned int x, unsigned int y) {
+    unsigned int i = x - tile.x0, j = y - tile.y0, w = tile.x1 - tile.x0;
+    penumbra_seen = false;
+    penumbra_nearby = (i > 0 && penumbrae[j * TILE_SIZE + i - 1]) ||
+      (j > 0 && ((i > 0 && penumbrae[(j - 1) * TILE_SIZE + i - 1]) || penumbrae[(j - 1) * TILE_SIZE + i] ||
+                 (i + 1 < w && penumbrae[(j - 1) * TILE_SIZE + i + 1])));
+  };
+  auto end_pixel = [&](const Tile& tile, unsigned int x, unsigned int y) {
+    penumbrae[(y - tile.y0) * TILE_SIZE + x - tile.x0] = penumbra_seen;
+  };
+
+  // Corners traced outside of any pixel get no hint, rather than whatever the thread's last pixel left behind
+  auto trace_corner = [&](double px, double py) {
+    penumbra_nearby = penumbra_seen = false;
+    return trace(px, py, 1.0);
+  };
+
+  // Threads take the next tile from the shared queue until there are none left, or until they are halted. Every tile
+  // that has been taken is finished, so the tiles before next_tile are done
+  while (!*halt) {
+    unsigned int t = (*next_tile)++;
+    if (t >= tiles->size()) break;
+    const Tile& tile = (*tiles)[t];
+
+    if(pass)
+    {
+      unsigned int p = strata[pass->stratum].first, q = strata[pass->stratum].second;
+      for (unsigned int y = tile.y0; y < tile.y1; y++) {
+        for (unsigned int x = tile.x0; x < tile.x1; x++) {
+          size_t k = (size_t)y * width + x;
+          begin_pixel(tile, x, y);
+          Colour sample = jittered(x, y, p, q, background(x, y));
+          end_pixel(tile, x, y);
+          Colour& sum = (*pass->sums)[k];
+          sum = sum + sample;
+          (*pass->squares)[k] = (*pass->squares)[k] + sample * sample;
+          double n = ++(*sample_counts)[k];
+
+          (*img)(x, y, 0) = sum.R() / n;
+          (*img)(x, y, 1) = sum.G() / n;
+          (*img)(x, y, 2) = sum.B() / n;
+        }
+      }
+    }
+    else if(options->subdivide)
+    {
+      // A row of pixels shares its corners at y-1 with the row before it, kept from when that row traced them, so
+      // only the corners at y are traced. Each pixel traces its corner at (x+1, y) and takes the rest from its
+      // neighbours
+      std::vector<Colour> previous(tile.x1 - tile.x0 + 1, Colour(0.0, 0.0, 0.0)), current(previous);
+      for(unsigned int x = tile.x0; x <= tile.x1; x++) previous[x - tile.x0] = trace_corner(x, tile.y0 - 1.0);
+
+      for (unsigned int y = tile.y0; y < tile.y1; y++) {
+        current[0] = trace_corner(tile.x0, y);
+        for (unsigned int x = tile.x0; x < tile.x1; x++) {
+          size_t i = x - tile.x0;
+          begin_pixel(tile, x, y);
+          current[i+1] = trace(x + 1.0, y, 1.0);
+          unsigned int rays = 1 + (x == tile.x0 ? 1 : 0) + (y == tile.y0 ? (x == tile.x0 ? 2 : 1) : 0);
+
+          Colour corners[4] = { current[i], current[i+1], previous[i], previous[i+1] };
+          Colour colour = a4_subdivide(trace, x, y, 1.0, corners, depth, options->aa_contrast, rays);
+          end_pixel(tile, x, y);
+
+          (*img)(x, y, 0) = colour.R();
+          (*img)(x, y, 1) = colour.G();
+          (*img)(x, y, 2) = colour.B();
+          (*sample_counts)[(size_t)y * width + x] = rays;
         }
-        progress_cond.notify_one();
-        
-        pixel_count = 0;
+        std::swap(previous, current);
       }
     }
+    else
+    {
+      for (unsigned int y = tile.y0; y < tile.y1; y++) {
+        for (unsigned int x = tile.x0; x < tile.x1; x++) {
+          Colour bg = background(x, y);
+          begin_pixel(tile, x, y);
+
+          // Cast rays into the scene and sum the colours returned, and their squares for the variance
+          Colour colour(0.0, 0.0, 0.0), squares(0.0, 0.0, 0.0);
+          unsigned int n = 0;
+          while(n < max_samples)
+          {
+            for(unsigned int end = std::min(max_samples, n + round); n < end; n++)
+            {
+              Colour sample = jittered(x, y, strata[n].first, strata[n].second, bg);
+              colour = colour + sample;
+              squares = squares + sample * sample;
+            }
+
+            if(n < 2 || n >= max_samples) continue;
+            double sums[3] = { colour.R(), colour.G(), colour.B() };
+            double sums_of_squares[3] = { squares.R(), squares.G(), squares.B() };
+            double variance = 0.0;
+            for(int c = 0; c < 3; c++) variance = std::max(variance, (sums_of_squares[c] - sums[c] * sums[c] / n) / (n - 1));
+            if(variance <= options->aa_threshold * options->aa_threshold * n) break;
+          }
+
+          end_pixel(tile, x, y);
+
+          // Of course, have to divide the colour by the number of samples taken
+          colour = Colour(colour.R() / n, colour.G() / n, colour.B() / n);
+
+          (*img)(x, y, 0) = colour.R();
+          (*img)(x, y, 1) = colour.G();
+          (*img)(x, y, 2) = colour.B();
+          (*sample_counts)[(size_t)y * width + x] = n;
+        }
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(progress_mut);
+      progress_pixels += (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+      progress = progress_pixels * 100 / progress_total;
+    }
+    progress_cond.notify_one();
   }
+
+  std::lock_guard<std::mutex> lock(progress_mut);
+  total_rays.primary += ray_counts.primary;
+  total_rays.secondary += ray_counts.secondary;
+  total_rays.shadow += ray_counts.shadow;
 }
 
 void a4_render(// What to render
@@ -358,7 +757,8 @@ void a4_render(// What to render
                unsigned int aa_samples,
                unsigned int shadow_samples,
                unsigned int glossy_samples,
-               const std::string& bgfilename
+               const std::string& bgfilename,
+               const RenderOptions& options
                )
 {
   // Fill in raytracing code here.
@@ -374,7 +774,24 @@ void a4_render(// What to render
     std::cerr << *I->get();
   }
   std::cerr << ", " << num_threads << ", " << recurse_level << ", " << aa_samples << ", " << shadow_samples << ", " << glossy_samples;
-  std::cerr << ", " << bgfilename << "});" << std::endl;
+  std::cerr << ", " << bgfilename;
+  if(options.progressive) std::cerr << ", progressive " << options.time_budget << " " << options.snapshot_interval << " " << options.noise_target;
+  else if(options.subdivide) std::cerr << ", subdivide " << options.aa_contrast;
+  else if(options.adaptive) std::cerr << ", adaptive " << options.aa_base_samples << " " << options.aa_threshold;
+  std::cerr << "});" << std::endl;
+
+  // Checkpoints are keyed by the parameters of the render that change the image
+  std::ostringstream params;
+  params << options.scene_fingerprint << " " << width << " " << height << " " << eye << " " << view << " " << up << " " << fov << " " << ambient;
+  for (auto& light : lights) params << " " << *light;
+  params << " " << recurse_level << " " << aa_samples << " " << shadow_samples << " " << glossy_samples << " " << bgfilename;
+  params << " " << options.seed << " " << (int)options.sampler << " " << options.roulette_threshold << " " << options.branch_bounces;
+  if(options.adaptive_shadows) params << " adaptive_shadows " << options.shadow_probes;
+  params << " " << options.light_threshold;
+  if(options.progressive) params << " progressive";
+  else if(options.subdivide) params << " subdivide " << options.aa_contrast;
+  else if(options.adaptive) params << " adaptive " << options.aa_base_samples << " " << options.aa_threshold;
+  uint64_t key = mesh_cache_hash(params.str().data(), params.str().size());
 
   // Initialize Perlin noise hash table
   Perlin::init();
@@ -386,6 +803,9 @@ void a4_render(// What to render
   // Get pixel unprojection matrix
   double d = view.length();
   Matrix4x4 unproject = a4_get_unproject_matrix(width, height, fov, d, eye, view, up);
+
+  // Angle subtended by a pixel, the height of the projection plane over its distance split between the rows
+  double pixel_spread = 2.0 * tan(fov * M_PI / 360.0) / height;
     
   Image img(width, height, 3);
 
@@ -396,39 +816,235 @@ void a4_render(// What to render
 
   std::cout << "Hardware threads: " << std::thread::hardware_concurrency() << ", Threads requested: " << num_threads << std::endl;
 
-  std::vector<std::thread> threads(num_threads);
-  for(unsigned int i = 0; i < num_threads; i++)
+  std::vector<Tile> tiles = a4_get_tiles(width, height);
+  std::vector<unsigned int> sample_counts((size_t)width * height, 0);
+  std::atomic<unsigned int> next_tile(0);
+  std::atomic<bool> halt(false);
+  uint64_t seed = options.seed;
+
+  // A progressive render is aa by aa passes, or fewer if it runs out of time or gets below the noise target first
+  std::vector<Colour> sums, squares;
+  Pass pass = { 0, &sums, &squares };
+  unsigned int num_passes = 1;
+  if(options.progressive)
+  {
+    num_passes = std::max(1u, aa_samples * aa_samples);
+    sums.assign(sample_counts.size(), Colour(0.0, 0.0, 0.0));
+    squares.assign(sample_counts.size(), Colour(0.0, 0.0, 0.0));
+  }
+
+  // Carry on from a checkpoint of the same render if there is one
+  unsigned int first_tile = 0;
+  if(options.resume && !options.checkpoint.empty())
   {
-    threads[i] = std::thread(a4_render_thread, &img, i, num_threads, width, height, root, unproject, eye, ambient, lights, recurse_level, aa_samples, shadow_samples, glossy_samples, &bg);
-    if(threads[i].get_id() == std::thread::id())
+    Checkpoint checkpoint;
+    if(load_checkpoint(options.checkpoint, key, checkpoint) && checkpoint.width == width && checkpoint.height == height &&
+       checkpoint.sums.size() == sums.size() && checkpoint.pass < num_passes && checkpoint.next_tile <= tiles.size())
     {
-      std::cerr << "Abort: Failed to create thread " << i << std::endl;
-      exit(EXIT_FAILURE);
+      seed = checkpoint.seed;
+      pass.stratum = checkpoint.pass;
+      first_tile = checkpoint.next_tile;
+      sample_counts = checkpoint.counts;
+      sums = checkpoint.sums;
+      squares = checkpoint.squares;
+      for(unsigned int y = 0; y < height; y++)
+      {
+        for(unsigned int x = 0; x < width; x++)
+        {
+          const Colour& colour = checkpoint.colours[(size_t)y * width + x];
+          img(x, y, 0) = colour.R();
+          img(x, y, 1) = colour.G();
+          img(x, y, 2) = colour.B();
+        }
+      }
+      std::cout << "Resuming from " << options.checkpoint << " at pass " << pass.stratum << ", tile " << first_tile << std::endl;
+    }
+    else
+    {
+      std::cerr << "No checkpoint of this render in " << options.checkpoint << ", starting from the beginning" << std::endl;
+    }
+  }
+
+  auto save = [&]() {
+    Checkpoint checkpoint;
+    checkpoint.key = key;
+    checkpoint.width = width;
+    checkpoint.height = height;
+    checkpoint.seed = seed;
+    checkpoint.pass = (next_tile >= tiles.size()) ? pass.stratum + 1 : pass.stratum;
+    checkpoint.next_tile = (next_tile >= tiles.size()) ? 0 : (unsigned int)next_tile;
+    checkpoint.counts = sample_counts;
+    checkpoint.colours.resize(sample_counts.size());
+    for(unsigned int y = 0; y < height; y++)
+    {
+      for(unsigned int x = 0; x < width; x++)
+      {
+        checkpoint.colours[(size_t)y * width + x] = Colour(img(x, y, 0), img(x, y, 1), img(x, y, 2));
+      }
+    }
+    checkpoint.sums = sums;
+    checkpoint.squares = squares;
+    if(!save_checkpoint(options.checkpoint, checkpoint))
+    {
+      std::cerr << "Could not write checkpoint to " << options.checkpoint << std::endl;
     }
+  };
+
+  // Flush a checkpoint before going down if the render is terminated
+  void (*previous_handler)(int) = SIG_DFL;
+  if(!options.checkpoint.empty())
+  {
+    terminated = 0;
+    previous_handler = std::signal(SIGTERM, a4_terminate);
   }
 
+  progress = 0;
+  total_rays = RayCounts();
+  progress_pixels = (uint64_t)width * height * pass.stratum;
+  for(unsigned int t = 0; t < first_tile; t++) progress_pixels += (tiles[t].x1 - tiles[t].x0) * (tiles[t].y1 - tiles[t].y0);
+  progress_total = (uint64_t)width * height * num_passes;
+
+  std::chrono::time_point<std::chrono::system_clock> last_snapshot = start;
+  std::chrono::time_point<std::chrono::system_clock> last_checkpoint = start;
+  bool stop = false, out_of_time = false;
+
   // Get dimensions of terminal
   struct winsize ws;
   ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws);
 
-  std::unique_lock<std::mutex> lock(progress_mut);
-  while(progress != 100)
+  for(; pass.stratum < num_passes && !stop; pass.stratum++, first_tile = 0)
   {
-    progress_cond.wait(lock);
-    std::chrono::duration<double> duration = std::chrono::system_clock::now() - start;
-    int w = ws.ws_col-35;
-    int c = (float)progress/100.0 * w;
-    int min = duration.count() / 60.0;
-    int hours = (double)min / 60.0;
-    std::cout << "Progress: " << progress << "% [";
-    for(int i = 0; i < c; i++) std::cout << "=";
-    for(int i = c; i < w; i++) std::cout << " ";
-    std::cout << "] " << hours << "h" << min - (hours*60.0) << "m" << duration.count() - (min*60.0) << "s" << "\r" << std::flush;
+    next_tile = first_tile;
+
+    // The threads are halted to take a checkpoint between the tiles, then the pass carries on
+    while(next_tile < tiles.size() && !stop)
+    {
+      halt = false;
+      std::vector<std::thread> threads(num_threads);
+      for(unsigned int i = 0; i < num_threads; i++)
+      {
+        threads[i] = std::thread(a4_render_thread, &img, &tiles, &next_tile, width, height, root, unproject, eye, ambient, lights, recurse_level, aa_samples, shadow_samples, glossy_samples, &bg, pixel_spread, &options, &sample_counts, options.progressive ? &pass : nullptr, &halt, seed);
+        if(threads[i].get_id() == std::thread::id())
+        {
+          std::cerr << "Abort: Failed to create thread " << i << std::endl;
+          exit(EXIT_FAILURE);
+        }
+      }
+
+      // Wake up at least every tenth of a second to check the time budget, checkpoints and termination
+      bool checkpoint = false;
+      {
+        std::unique_lock<std::mutex> lock(progress_mut);
+        uint64_t pass_pixels = (uint64_t)width * height * (pass.stratum + 1);
+        while(progress_pixels < pass_pixels && !halt)
+        {
+          progress_cond.wait_for(lock, std::chrono::milliseconds(100));
+          std::chrono::time_point<std::chrono::system_clock> now = std::chrono::system_clock::now();
+          std::chrono::duration<double> duration = now - start;
+          if(options.progressive && options.time_budget > 0.0 && duration.count() >= options.time_budget) stop = out_of_time = true;
+          if(!options.checkpoint.empty() && options.checkpoint_interval > 0.0 &&
+             std::chrono::duration<double>(now - last_checkpoint).count() >= options.checkpoint_interval) checkpoint = true;
+          if(terminated) stop = checkpoint = true;
+          if(stop || checkpoint) halt = true;
+
+          int w = ws.ws_col-35;
+          int c = (float)progress/100.0 * w;
+          int min = duration.count() / 60.0;
+          int hours = (double)min / 60.0;
+          std::cout << "Progress: " << progress << "% [";
+          for(int i = 0; i < c; i++) std::cout << "=";
+          for(int i = c; i < w; i++) std::cout << " ";
+          std::cout << "] " << hours << "h" << min - (hours*60.0) << "m" << duration.count() - (min*60.0) << "s" << "\r" << std::flush;
+        }
+      }
+
+      for(unsigned int i = 0; i < num_threads; i++) threads[i].join();
+
+      if(checkpoint)
+      {
+        save();
+        last_checkpoint = std::chrono::system_clock::now();
+      }
+    }
+
+    // A render that ran out of time can be resumed with more
+    if(out_of_time && !options.checkpoint.empty()) save();
+
+    if(terminated)
+    {
+      std::cout << std::endl << "Terminated, checkpoint written to " << options.checkpoint << std::endl;
+      img.savePng(filename);
+      std::signal(SIGTERM, SIG_DFL);
+      std::raise(SIGTERM);
+    }
+
+    // A pass cut short by the time budget isn't done, so leave before it is counted
+    if(stop && next_tile < tiles.size()) break;
+    if(!options.progressive || stop) continue;
+
+    // Root mean square of the standard error of each pixel's mean, in its worst channel
+    if(options.noise_target > 0.0 && pass.stratum >= 1)
+    {
+      double total = 0.0;
+      for(size_t k = 0; k < sums.size(); k++)
+      {
+        double n = sample_counts[k];
+        double s[3] = { sums[k].R(), sums[k].G(), sums[k].B() };
+        double ss[3] = { squares[k].R(), squares[k].G(), squares[k].B() };
+        double variance = 0.0;
+        for(int c = 0; c < 3; c++) variance = std::max(variance, (ss[c] - s[c] * s[c] / n) / (n - 1));
+        total += variance / n;
+      }
+      if(std::sqrt(total / sums.size()) <= options.noise_target) stop = true;
+    }
+
+    // Write to a temporary file first so that the image is whole if the render is killed while saving
+    std::chrono::time_point<std::chrono::system_clock> now = std::chrono::system_clock::now();
+    if(options.snapshot_interval > 0.0 && !stop && pass.stratum + 1 < num_passes &&
+       std::chrono::duration<double>(now - last_snapshot).count() >= options.snapshot_interval)
+    {
+      std::string temp = filename + ".tmp";
+      if(img.savePng(temp) && std::rename(temp.c_str(), filename.c_str()) != 0)
+      {
+        std::cerr << "Could not write snapshot to " << filename << std::endl;
+      }
+      last_snapshot = now;
+    }
   }
   std::cout << std::endl;
 
-  for(unsigned int i = 0; i < num_threads; i++) threads[i].join();
+  if(!options.checkpoint.empty())
+  {
+    std::signal(SIGTERM, previous_handler);
+    if(!out_of_time) std::remove(options.checkpoint.c_str());
+  }
+
+  if(options.progressive)
+  {
+    std::cout << "Passes: " << pass.stratum << " of " << num_passes << std::endl;
+  }
 
   img.savePng(filename);
-  
+
+  // Report how many samples the pixels took, and map them from black for one to white for aa by aa or more
+  unsigned int max_samples = std::max(1u, aa_samples * aa_samples);
+  uint64_t total_samples = 0;
+  for(auto count : sample_counts) total_samples += count;
+  std::cout << "Samples per pixel: " << (double)total_samples / sample_counts.size() << " of " << max_samples << std::endl;
+  std::cout << "Rays: " << total_rays.primary << " primary, " << total_rays.secondary << " reflected or refracted, "
+            << total_rays.shadow << " shadow" << std::endl;
+
+  if(!options.sample_map.empty())
+  {
+    Image map(width, height, 3);
+    for(unsigned int y = 0; y < height; y++)
+    {
+      for(unsigned int x = 0; x < width; x++)
+      {
+        double v = (max_samples > 1) ? std::min(1.0, (sample_counts[(size_t)y * width + x] - 1.0) / (max_samples - 1.0)) : 1.0;
+        for(int c = 0; c < 3; c++) map(x, y, c) = v;
+      }
+    }
+    map.savePng(options.sample_map);
+  }
 }
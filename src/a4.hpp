@@ -6,6 +6,81 @@
 #include "algebra.hpp"
 #include "scene.hpp"
 #include "light.hpp"
+#include "sampler.hpp"
+
+// Optional settings for a render
+struct RenderOptions {
+  RenderOptions()
+    : adaptive(false)
+    , aa_threshold(0.01)
+    , aa_base_samples(4)
+    , subdivide(false)
+    , aa_contrast(0.1)
+    , progressive(false)
+    , time_budget(0.0)
+    , snapshot_interval(0.0)
+    , noise_target(0.0)
+    , checkpoint_interval(600.0)
+    , resume(false)
+    , scene_fingerprint(0)
+    , seed(0)
+    , sampler(SamplerType::RANDOM)
+    , roulette_threshold(0.1)
+    , branch_bounces(1)
+    , adaptive_shadows(false)
+    , shadow_probes(4)
+    , light_threshold(0.01)
+  {
+  }
+
+  bool adaptive;                // Stop sampling a pixel once its error estimate falls to aa_threshold
+  double aa_threshold;          // Standard error of the mean of a pixel's samples, in the worst colour channel
+  unsigned int aa_base_samples; // Samples every pixel takes before its error is estimated, and how many more per round
+  bool subdivide;               // Sample the corners of each pixel, shared with its neighbours, and split it into quarters
+                                // while they differ by more than aa_contrast, down to an aa by aa grid. Takes precedence
+                                // over adaptive
+  double aa_contrast;           // Largest difference between corner colours in any channel that isn't refined
+  std::string sample_map;       // If not empty, where to save an image of the samples taken by each pixel
+
+  // A progressive render takes one sample per pixel over the whole image in each pass, up to aa by aa passes, so it
+  // can be stopped early with every pixel equally refined. Takes precedence over adaptive and subdivide
+  bool progressive;
+  double time_budget;           // Seconds after which to stop, part way through a pass if need be, or 0 for no limit
+  double snapshot_interval;     // Seconds between saving the image so far at the end of a pass, or 0 for only at the end
+  double noise_target;          // Stop once the root mean square over the pixels of the standard error of their mean,
+                                // in the worst channel, falls to this, or 0 for no target
+
+  // A render with a checkpoint file saves what it has done so far to it every so often and when it is sent SIGTERM,
+  // and removes it once finished. A render that runs out of time also leaves its checkpoint
+  std::string checkpoint;
+  double checkpoint_interval;   // Seconds between checkpoints, or 0 for only when the render is stopped
+  bool resume;                  // Carry on from the checkpoint file if it holds a checkpoint of the same render
+  uint64_t scene_fingerprint;   // Hash of the scene's script and the files it loaded, set by gr.render rather than the
+                                // options table. Part of what makes two renders the same
+
+  uint64_t seed;                // Of the random numbers. Renders with the same seed are the same, on any number of threads
+  SamplerType sampler;          // How the random numbers of a pixel's samples are spread
+
+  // Reflected and refracted rays carry their throughput, the product of the specular colours and Fresnel coefficients
+  // along their path. Splitting a path between glossy rays doesn't lower it. A ray whose throughput is below
+  // roulette_threshold in every channel is traced with probability its largest channel over the threshold and weighted
+  // up to make up for the rays that aren't, which keeps the image unbiased. 0 traces them all
+  double roulette_threshold;
+  unsigned int branch_bounces;  // Bounces that cast glossy_samples reflected rays and a refracted ray, below which a
+                                // path follows a single ray, chosen between reflection and refraction by the Fresnel
+                                // coefficient
+
+  // Adaptive shadows cast shadow_probes of the shadow rays to an area light first, and the rest only if some of the
+  // probes reach the light and some don't. Pixels next to one whose first hit was in a penumbra cast all of them, so
+  // that narrow penumbrae the probes miss are filled in
+  bool adaptive_shadows;
+  unsigned int shadow_probes;
+
+  // Before casting shadow rays each light's contribution is bounded as if nothing blocked it. Lights behind the
+  // surface are skipped, and lights whose bound times the ray's throughput is below light_threshold in every channel
+  // are shaded by Russian roulette like dim rays. 0 shades every light in front of the surface
+  double light_threshold;
+};
 
 void a4_render(// What to render
                std::shared_ptr<SceneNode> root,
@@ -25,7 +100,8 @@ void a4_render(// What to render
                unsigned int aa_samples,
                unsigned int shadow_samples,
                unsigned int glossy_samples,
-               const std::string& bgfilename
+               const std::string& bgfilename,
+               const RenderOptions& options = RenderOptions()
                );
 
 #endif
@@ -26,6 +26,7 @@
 #endif
 
 class Material;
+class Primitive;
 
 class Point2D
 {
@@ -573,13 +574,19 @@ inline std::ostream& operator <<(std::ostream& os, const Colour& c)
 
 class Ray {
 public:
-  Ray(const Point3D& origin, const Vector3D& direction)
+  Ray(const Point3D& origin, const Vector3D& direction, double width = 0.0, double spread = 0.0)
     : origin_(origin)
     , direction_(direction.normalized())
+    , width_(width)
+    , spread_(spread)
+    , surface_(nullptr)
   {}
   Ray(const Ray& other)
     : origin_(other.origin())
     , direction_(other.direction().normalized())
+    , width_(other.width_)
+    , spread_(other.spread_)
+    , surface_(other.surface_)
   {}
 
   Point3D origin() const
@@ -591,11 +598,50 @@ public:
     return direction_;
   }
 
+  // A ray stands for a cone of space around it, e.g. the part of the scene seen through a pixel. The footprint is
+  // the cone's width at distance t from the origin, it is 0 for an infinitely thin ray
+  double footprint(double t) const
+  {
+    return width_ + spread_ * t;
+  }
+  double width() const
+  {
+    return width_;
+  }
+  double spread() const
+  {
+    return spread_;
+  }
+
+  // The primitive whose surface the ray leaves, if any. A primitive that only approximates its surface, e.g. a mesh
+  // traced at a simplified level of detail, ignores hits on itself near the origin of the rays that leave it
+  const Primitive* surface() const
+  {
+    return surface_;
+  }
+  void set_surface(const Primitive* surface)
+  {
+    surface_ = surface;
+  }
+
 private:
   Point3D origin_;
   Vector3D direction_;
+  double width_;
+  double spread_;
+  const Primitive* surface_;
 };
 
+// Transforms the ray into another coordinate system. Distances along the ray, and so the width of its cone, are
+// scaled by how much the transform stretches its direction
+inline Ray operator *(const Matrix4x4& M, const Ray& r)
+{
+  Vector3D d = M * r.direction();
+  Ray transformed(M * r.origin(), d, r.width() * d.length(), r.spread());
+  transformed.set_surface(r.surface());
+  return transformed;
+}
+
 class Intersection {
 public:
   Intersection() 
@@ -606,6 +652,7 @@ public:
     , lightColour(0.0, 0.0, 0.0)
     , u(0.0), v(0.0)
     , pu(0.0, 0.0, 0.0), pv(0.0, 0.0, 0.0)
+    , surface(nullptr)
     //, t(std::numeric_limits<double>::infinity())
   {}
   Intersection(const Intersection& other)
@@ -616,6 +663,7 @@ public:
     , lightColour(other.lightColour)
     , u(other.u), v(other.v)
     , pu(other.pu), pv(other.pv)
+    , surface(other.surface)
     //, t(other.t)
   {}
 
@@ -626,6 +674,7 @@ public:
   Colour lightColour; // If intersect with light, then this is the colour of the light
   double u, v; // Parametric coordinates
   Vector3D pu, pv; // Tangent vectors which form a orthogonal basis with the normal
+  const Primitive* surface; // Primitive that was hit, if known
   //double t; // Distance from ray's origin along ray's direction vector to intersection point: t*ray.direction + ray.origin
 };
 
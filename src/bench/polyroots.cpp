@@ -0,0 +1,170 @@
+// Times the polynomial root solvers on the rays of data/torus.lua, see the bench_polyroots target in the Makefile.
+//
+// The rays are the torus.lua camera rays at 512x512 and, from each point they hit on the torus, a shadow ray to the
+// light and a ray in a random direction. They are all put into the torus' model coordinates and traced twice:
+//   quarticRoots:  the torus' quartic solved in closed form over the whole ray, the nearest positive root kept
+//   intervalRoots: NonhierTorus::intersect, the ray clipped to the torus' bounding shell and the quartic solved in
+//                  each interval with intervalRoots
+// For each the time per ray, the number of hits and how far the hits are from the surface are printed, followed by
+// the rays on which the two disagree.
+
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include "../algebra.hpp"
+#include "../primitive.hpp"
+#include "../polyroots.hpp"
+#include "../scene.hpp"
+
+namespace {
+
+const double R = 1.0;  // Radii of the torus
+const double r = 0.5;
+const unsigned int SIZE = 512;
+const unsigned int REPEATS = 5;
+
+// Nearest positive distance where the ray meets the torus, from the closed form roots of its quartic
+bool quartic_intersect(const Ray& ray, double& t)
+{
+  Vector3D p = ray.origin() - Point3D(0.0, 0.0, 0.0);
+  Vector3D d = ray.direction();
+
+  double R2 = R*R, r2 = r*r;
+  double a = d.dot(d), b = 2.0*p.dot(d), y = p.dot(p) - r2 - R2;
+  double A = 1.0 / (a*a);
+  double B = 2.0*a*b;
+  double C = b*b + 2.0*a*y + 4.0*R2*d[2]*d[2];
+  double D = 2.0*b*y + 8.0*R2*p[2]*d[2];
+  double E = y*y + 4.0*R2*p[2]*p[2] - 4.0*R2*r2;
+
+  double roots[4];
+  size_t num_roots = quarticRoots(B*A, C*A, D*A, E*A, roots);
+
+  t = INFINITY;
+  for(size_t i = 0; i < num_roots; i++) if(roots[i] > 0.0 && roots[i] < t) t = roots[i];
+  return !std::isinf(t);
+}
+
+// Distance from q to the surface of the torus
+double residual(const Point3D& q)
+{
+  double rho = std::sqrt(q[0]*q[0] + q[1]*q[1]);
+  return std::fabs(std::sqrt((rho-R)*(rho-R) + q[2]*q[2]) - r);
+}
+
+struct Result {
+  std::vector<double> t; // Distance of the hit along each ray, infinity for a miss
+  double seconds;
+};
+
+template<typename Intersect>
+Result run(const std::vector<Ray>& rays, Intersect&& intersect)
+{
+  Result result;
+  result.t.resize(rays.size());
+
+  std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+  for(unsigned int k = 0; k < REPEATS; k++)
+  {
+    for(size_t i = 0; i < rays.size(); i++)
+    {
+      double t;
+      result.t[i] = intersect(rays[i], t) ? t : INFINITY;
+    }
+  }
+  result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / REPEATS;
+
+  return result;
+}
+
+void report(const char* name, const std::vector<Ray>& rays, const Result& result)
+{
+  size_t hits = 0;
+  double sum = 0.0, largest = 0.0;
+  for(size_t i = 0; i < rays.size(); i++)
+  {
+    if(std::isinf(result.t[i])) continue;
+    double e = residual(rays[i].origin() + result.t[i]*rays[i].direction());
+    hits++;
+    sum += e;
+    largest = std::max(largest, e);
+  }
+
+  std::cout << name << ": " << result.seconds * 1e9 / rays.size() << " ns/ray, " << hits << " hits, distance to surface mean "
+            << (hits ? sum / hits : 0.0) << " max " << largest << std::endl;
+}
+
+}
+
+int main()
+{
+  // The torus node and camera of data/torus.lua
+  GeometryNode node("torus", std::make_shared<Torus>());
+  node.scale(Vector3D(0.7, 0.7, 0.7));
+  node.rotate('y', -20.0);
+  node.rotate('x', 70.0);
+  node.translate(Vector3D(0.5, -1.0, -1.0));
+  const Matrix4x4& inverse = node.get_inverse();
+
+  Point3D eye(0.0, 2.0, -5.0);
+  Vector3D view(0.0, -3.011505, 5.56155), up(0.0, 1.0, 0.0);
+  double fov = 50.0;
+  view.normalize();
+  Vector3D right = view.cross(up);
+  right.normalize();
+  Vector3D down = view.cross(right);
+  double h = std::tan(fov * M_PI / 360.0);
+
+  std::vector<Ray> rays;
+  for(unsigned int y = 0; y < SIZE; y++)
+  {
+    for(unsigned int x = 0; x < SIZE; x++)
+    {
+      Vector3D direction = view + (h * (2.0 * (x + 0.5) / SIZE - 1.0)) * right + (h * (2.0 * (y + 0.5) / SIZE - 1.0)) * down;
+      rays.push_back(inverse * Ray(eye, direction));
+    }
+  }
+  size_t num_camera = rays.size();
+
+  // Secondary rays leave the surface a little above it, as the renderer's do
+  NonhierTorus torus(Point3D(0.0, 0.0, 0.0), R, r);
+  Point3D light = inverse * Point3D(10.0, 10.0, 0.0);
+  std::mt19937 rng(1);
+  std::normal_distribution<double> normal;
+  for(size_t i = 0; i < num_camera; i++)
+  {
+    Intersection j;
+    if(!torus.intersect(rays[i], j)) continue;
+    Point3D q = j.q + 1e-9 * j.n.normalized();
+    rays.push_back(Ray(q, light - q));
+    rays.push_back(Ray(q, Vector3D(normal(rng), normal(rng), normal(rng))));
+  }
+
+  std::cout << rays.size() << " rays: " << num_camera << " camera rays and " << rays.size() - num_camera << " secondary rays" << std::endl;
+
+  Result quartic = run(rays, quartic_intersect);
+  Result interval = run(rays, [&](const Ray& ray, double& t) {
+    Intersection j;
+    if(!torus.intersect(ray, j)) return false;
+    t = (j.q - ray.origin()).dot(ray.direction());
+    return true;
+  });
+
+  report("quarticRoots", rays, quartic);
+  report("intervalRoots", rays, interval);
+
+  size_t only_quartic = 0, only_interval = 0, apart = 0;
+  for(size_t i = 0; i < rays.size(); i++)
+  {
+    bool a = !std::isinf(quartic.t[i]), b = !std::isinf(interval.t[i]);
+    if(a && !b) only_quartic++;
+    if(b && !a) only_interval++;
+    if(a && b && std::fabs(quartic.t[i] - interval.t[i]) > 1e-6) apart++;
+  }
+  std::cout << "Hit only by quarticRoots: " << only_quartic << ", only by intervalRoots: " << only_interval
+            << ", hits more than 1e-6 apart: " << apart << std::endl;
+
+  return 0;
+}
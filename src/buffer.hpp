@@ -0,0 +1,79 @@
+#ifndef CS488_BUFFER_HPP
+#define CS488_BUFFER_HPP
+
+#include <vector>
+#include <memory>
+
+// A read only array that either owns its elements or views memory owned by something else, such as a memory
+// mapped file. Copies share the same elements and the owner is kept alive for as long as any copy exists.
+template<typename T>
+class Buffer {
+public:
+  Buffer()
+    : m_data(nullptr)
+    , m_size(0)
+  {
+  }
+
+  // Takes the contents of the vector
+  Buffer(std::vector<T> elements)
+  {
+    std::shared_ptr< std::vector<T> > owned = std::make_shared< std::vector<T> >(std::move(elements));
+    m_data = owned->data();
+    m_size = owned->size();
+    m_owner = owned;
+  }
+
+  // Shares a vector that has to stay unmodified for as long as the buffer exists
+  Buffer(const std::shared_ptr< std::vector<T> >& elements)
+    : m_owner(elements)
+    , m_data(elements->data())
+    , m_size(elements->size())
+  {
+  }
+
+  // Views memory kept alive by owner
+  Buffer(const T* data, size_t size, const std::shared_ptr<const void>& owner)
+    : m_owner(owner)
+    , m_data(data)
+    , m_size(size)
+  {
+  }
+
+  const T* data() const
+  {
+    return m_data;
+  }
+
+  size_t size() const
+  {
+    return m_size;
+  }
+
+  bool empty() const
+  {
+    return m_size == 0;
+  }
+
+  const T& operator[](size_t i) const
+  {
+    return m_data[i];
+  }
+
+  const T* begin() const
+  {
+    return m_data;
+  }
+
+  const T* end() const
+  {
+    return m_data + m_size;
+  }
+
+private:
+  std::shared_ptr<const void> m_owner;
+  const T* m_data;
+  size_t m_size;
+};
+
+#endif
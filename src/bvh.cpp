@@ -0,0 +1,158 @@
+#include "bvh.hpp"
+#include <algorithm>
+#include <cstdint>
+
+BVH::BVH()
+{
+}
+
+BVH::BVH(Buffer<Node> nodes, Buffer<unsigned int> indices)
+  : m_nodes(nodes)
+  , m_indices(indices)
+{
+}
+
+bool BVH::valid(size_t num_items) const
+{
+  // Children come after their parent so a node's depth is known by the time it is reached
+  std::vector<unsigned char> depth(m_nodes.size(), 0);
+  for(size_t i = 0; i < m_nodes.size(); i++)
+  {
+    const Node& node = m_nodes[i];
+    if(node.count > 0)
+    {
+      if((uint64_t)node.offset + node.count > num_items) return false;
+      continue;
+    }
+
+    if(node.axis > 2 || node.offset <= i + 1 || node.offset >= m_nodes.size() || depth[i] + 1u >= MAX_DEPTH) return false;
+    depth[i+1] = std::max<unsigned char>(depth[i+1], depth[i] + 1);
+    depth[node.offset] = std::max<unsigned char>(depth[node.offset], depth[i] + 1);
+  }
+
+  return true;
+}
+
+BVH::BVH(const std::vector<BoundingBox>& items, unsigned int leaf_size)
+{
+  if(items.empty()) return;
+
+  std::vector<BuildItem> build_items(items.size());
+  for(size_t i = 0; i < items.size(); i++)
+  {
+    build_items[i].bounds = items[i];
+    build_items[i].centroid = items[i].centroid();
+    build_items[i].index = i;
+  }
+
+  // A binary tree with n leaves has 2n-1 nodes
+  std::vector<Node> nodes;
+  nodes.reserve(2 * (items.size() / std::max(1u, leaf_size) + 1));
+  build(nodes, build_items, 0, build_items.size(), std::max(1u, leaf_size), 0);
+
+  std::vector<unsigned int> indices(build_items.size());
+  for(size_t i = 0; i < build_items.size(); i++) indices[i] = build_items[i].index;
+
+  m_nodes = Buffer<Node>(std::move(nodes));
+  m_indices = Buffer<unsigned int>(std::move(indices));
+}
+
+unsigned int BVH::build(std::vector<Node>& nodes, std::vector<BuildItem>& items, unsigned int first, unsigned int last, unsigned int leaf_size, unsigned int depth)
+{
+  unsigned int index = nodes.size();
+  nodes.push_back(Node());
+
+  BoundingBox bounds, centroid_bounds;
+  for(unsigned int i = first; i < last; i++)
+  {
+    bounds.extend(items[i].bounds);
+    centroid_bounds.extend(items[i].centroid);
+  }
+
+  nodes[index].bounds = bounds;
+  nodes[index].offset = first;
+  nodes[index].count = last - first;
+  nodes[index].axis = 0;
+
+  unsigned int count = last - first;
+  int axis = centroid_bounds.longest_axis();
+  double cmin = centroid_bounds.min()[axis];
+  double cmax = centroid_bounds.max()[axis];
+
+  // Small enough to be a leaf, or all the centroids are on top of each other so there is no way to split them
+  if(count <= leaf_size || cmax <= cmin || depth+1 >= MAX_DEPTH) return index;
+
+  // Bin the centroids along the longest axis and pick the split with the lowest surface area heuristic cost:
+  // cost(split) = SA(left) * N(left) + SA(right) * N(right)
+  const int NUM_BINS = 16;
+  BoundingBox bin_bounds[NUM_BINS];
+  unsigned int bin_count[NUM_BINS] = {0};
+  double scale = NUM_BINS / (cmax - cmin);
+
+  auto bin_of = [&](const BuildItem& item) -> int {
+    int b = (int)((item.centroid[axis] - cmin) * scale);
+    return std::min(b, NUM_BINS-1);
+  };
+
+  for(unsigned int i = first; i < last; i++)
+  {
+    int b = bin_of(items[i]);
+    bin_bounds[b].extend(items[i].bounds);
+    bin_count[b]++;
+  }
+
+  // Sweep from the right to get the cost of every right hand side, then from the left to find the best split
+  double right_cost[NUM_BINS];
+  BoundingBox right_bounds;
+  unsigned int right_count = 0;
+  for(int b = NUM_BINS-1; b > 0; b--)
+  {
+    right_bounds.extend(bin_bounds[b]);
+    right_count += bin_count[b];
+    right_cost[b] = right_bounds.surface_area() * right_count;
+  }
+
+  int best_split = -1;
+  double best_cost = bounds.surface_area() * count;
+  BoundingBox left_bounds;
+  unsigned int left_count = 0;
+  for(int b = 0; b < NUM_BINS-1; b++)
+  {
+    left_bounds.extend(bin_bounds[b]);
+    left_count += bin_count[b];
+    if(left_count == 0 || left_count == count) continue;
+
+    double cost = left_bounds.surface_area() * left_count + right_cost[b+1];
+    if(cost < best_cost)
+    {
+      best_cost = cost;
+      best_split = b;
+    }
+  }
+
+  unsigned int mid;
+  if(best_split >= 0)
+  {
+    mid = std::partition(items.begin()+first, items.begin()+last, [&](const BuildItem& item) { return bin_of(item) <= best_split; }) - items.begin();
+  }
+  else if(count > 4*leaf_size)
+  {
+    // Splitting doesn't pay off according to the heuristic but the leaf would be too large, so fall back to a median split
+    mid = first + count / 2;
+    std::nth_element(items.begin()+first, items.begin()+mid, items.begin()+last,
+                     [axis](const BuildItem& a, const BuildItem& b) { return a.centroid[axis] < b.centroid[axis]; });
+  }
+  else
+  {
+    return index;
+  }
+
+  build(nodes, items, first, mid, leaf_size, depth+1);
+  unsigned int right = build(nodes, items, mid, last, leaf_size, depth+1);
+
+  nodes[index].offset = right;
+  nodes[index].count = 0;
+  nodes[index].axis = axis;
+
+  return index;
+}
@@ -0,0 +1,208 @@
+#ifndef CS488_BVH_HPP
+#define CS488_BVH_HPP
+
+#include <vector>
+#include <limits>
+#include "algebra.hpp"
+#include "buffer.hpp"
+
+// An axis aligned bounding box
+class BoundingBox {
+public:
+  // Constructs an empty box which can be grown with extend
+  BoundingBox()
+    : m_min(std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity())
+    , m_max(-std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity())
+  {
+  }
+  BoundingBox(const Point3D& min, const Point3D& max)
+    : m_min(min)
+    , m_max(max)
+  {
+  }
+
+  const Point3D& min() const
+  {
+    return m_min;
+  }
+  const Point3D& max() const
+  {
+    return m_max;
+  }
+
+  bool empty() const
+  {
+    return (m_min[0] > m_max[0] || m_min[1] > m_max[1] || m_min[2] > m_max[2]);
+  }
+
+  Point3D centroid() const
+  {
+    return Point3D(0.5*(m_min[0]+m_max[0]), 0.5*(m_min[1]+m_max[1]), 0.5*(m_min[2]+m_max[2]));
+  }
+
+  void extend(const Point3D& p)
+  {
+    for(int i = 0; i < 3; i++)
+    {
+      m_min[i] = std::min(m_min[i], p[i]);
+      m_max[i] = std::max(m_max[i], p[i]);
+    }
+  }
+
+  void extend(const BoundingBox& b)
+  {
+    for(int i = 0; i < 3; i++)
+    {
+      m_min[i] = std::min(m_min[i], b.m_min[i]);
+      m_max[i] = std::max(m_max[i], b.m_max[i]);
+    }
+  }
+
+  int longest_axis() const
+  {
+    Vector3D d = m_max - m_min;
+    return (d[0] > d[1] && d[0] > d[2]) ? 0 : ((d[1] > d[2]) ? 1 : 2);
+  }
+
+  double surface_area() const
+  {
+    if(empty()) return 0.0;
+    Vector3D d = m_max - m_min;
+    return 2.0 * (d[0]*d[1] + d[1]*d[2] + d[2]*d[0]);
+  }
+
+  // Slab test against the ray. inv_dir holds the reciprocal of each component of the ray direction so it
+  // only has to be computed once per traversal. On a hit [tmin, tmax] is clipped to the box's interval
+  bool intersect(const Point3D& origin, const Vector3D& inv_dir, double& tmin, double& tmax) const
+  {
+    for(int i = 0; i < 3; i++)
+    {
+      double t0 = (m_min[i] - origin[i]) * inv_dir[i];
+      double t1 = (m_max[i] - origin[i]) * inv_dir[i];
+      if(t0 > t1) std::swap(t0, t1);
+
+      // Written so that a NaN (0 * inf when the origin lies on a slab) keeps the old interval
+      tmin = (t0 > tmin) ? t0 : tmin;
+      tmax = (t1 < tmax) ? t1 : tmax;
+      if(tmin > tmax) return false;
+    }
+    return true;
+  }
+
+private:
+  Point3D m_min;
+  Point3D m_max;
+};
+
+// A bounding volume hierarchy over a set of items (spheres, triangles...) which are only known by their bounding boxes.
+// The hierarchy is stored as a flat array of nodes in depth first order so the left child of an interior node always
+// directly follows its parent. Items are referenced by leaves as contiguous ranges of indices(); owners will usually
+// reorder their own item arrays into this order once so leaves can address items directly, after which the indices
+// are no longer needed. The node array has no pointers so it can be written to disk and mapped back in as is.
+class BVH {
+public:
+  struct Node {
+    BoundingBox bounds;
+    unsigned int offset; // First item of a leaf, or the index of the right child for an interior node
+    unsigned int count;  // Number of items in a leaf, 0 for interior nodes
+    unsigned int axis;   // Axis the items of an interior node were split along
+  };
+
+  BVH();
+  BVH(const std::vector<BoundingBox>& items, unsigned int leaf_size = 4);
+  BVH(Buffer<Node> nodes, Buffer<unsigned int> indices = Buffer<unsigned int>());
+
+  bool empty() const
+  {
+    return m_nodes.empty();
+  }
+
+  // A hierarchy over no items, e.g. of a mesh without faces, has empty bounds
+  BoundingBox bounds() const
+  {
+    return m_nodes.empty() ? BoundingBox() : m_nodes[0].bounds;
+  }
+
+  const Buffer<Node>& nodes() const
+  {
+    return m_nodes;
+  }
+
+  const Buffer<unsigned int>& indices() const
+  {
+    return m_indices;
+  }
+
+  // Whether traverse can walk the nodes safely over num_items items: children follow their parent, leaves stay within
+  // the items and the tree is no deeper than the traversal stack. For hierarchies read back from files
+  bool valid(size_t num_items) const;
+
+  // Walks the leaves hit by the ray front to back. The visitor is called as visit(offset, count, tmax) with a leaf's
+  // range of items and must return true if it found an intersection closer than tmax, in which case it should also
+  // lower tmax to the distance of that intersection. Subtrees beyond tmax are skipped.
+  template<typename Visitor>
+  bool traverse(const Ray& ray, double tmax, Visitor&& visit) const
+  {
+    if(m_nodes.empty()) return false;
+
+    Point3D origin = ray.origin();
+    Vector3D d = ray.direction();
+    Vector3D inv_dir(1.0 / d[0], 1.0 / d[1], 1.0 / d[2]);
+    bool dir_neg[3] = { inv_dir[0] < 0, inv_dir[1] < 0, inv_dir[2] < 0 };
+
+    bool intersected = false;
+    unsigned int stack[MAX_DEPTH];
+    unsigned int stack_size = 0;
+    unsigned int current = 0;
+
+    for(;;)
+    {
+      const Node& node = m_nodes[current];
+      double t0 = 0.0, t1 = tmax;
+      if(node.bounds.intersect(origin, inv_dir, t0, t1))
+      {
+        if(node.count > 0)
+        {
+          intersected = visit(node.offset, node.count, tmax) || intersected;
+        }
+        else
+        {
+          // Visit the child closest to the ray's origin first, this makes it more likely that the far child
+          // will be culled by a closer intersection
+          if(dir_neg[node.axis])
+          {
+            stack[stack_size++] = current+1;
+            current = node.offset;
+          }
+          else
+          {
+            stack[stack_size++] = node.offset;
+            current = current+1;
+          }
+          continue;
+        }
+      }
+
+      if(stack_size == 0) break;
+      current = stack[--stack_size];
+    }
+
+    return intersected;
+  }
+
+private:
+  static const unsigned int MAX_DEPTH = 64;
+
+  struct BuildItem {
+    BoundingBox bounds;
+    Point3D centroid;
+    unsigned int index;
+  };
+
+  static unsigned int build(std::vector<Node>& nodes, std::vector<BuildItem>& items, unsigned int first, unsigned int last, unsigned int leaf_size, unsigned int depth);
+
+  Buffer<Node> m_nodes;
+  Buffer<unsigned int> m_indices;
+};
+
+#endif
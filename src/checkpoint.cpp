@@ -0,0 +1,97 @@
+#include "checkpoint.hpp"
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+namespace {
+
+const char MAGIC[8] = { 'R', 'T', 'C', 'H', 'E', 'C', 'K', 0 };
+const uint32_t VERSION = 1;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t colour_size; // Guards against a build with a different layout of Colour reading the file
+  uint64_t key;
+  uint64_t seed;
+  uint32_t width, height;
+  uint32_t pass;
+  uint32_t next_tile;
+  uint64_t num_sums; // Either 0 or a sum and a square for every pixel
+};
+
+}
+
+bool save_checkpoint(const std::string& filename, const Checkpoint& checkpoint)
+{
+  size_t num_pixels = (size_t)checkpoint.width * checkpoint.height;
+  if(checkpoint.counts.size() != num_pixels || checkpoint.colours.size() != num_pixels) return false;
+  if(checkpoint.sums.size() != checkpoint.squares.size()) return false;
+
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.colour_size = sizeof(Colour);
+  header.key = checkpoint.key;
+  header.seed = checkpoint.seed;
+  header.width = checkpoint.width;
+  header.height = checkpoint.height;
+  header.pass = checkpoint.pass;
+  header.next_tile = checkpoint.next_tile;
+  header.num_sums = checkpoint.sums.size();
+
+  std::ostringstream tmp;
+  tmp << filename << ".tmp." << getpid();
+
+  std::ofstream out(tmp.str().c_str(), std::ios::binary);
+  if(!out) return false;
+
+  out.write((const char*)&header, sizeof(Header));
+  out.write((const char*)checkpoint.counts.data(), num_pixels * sizeof(unsigned int));
+  out.write((const char*)checkpoint.colours.data(), num_pixels * sizeof(Colour));
+  out.write((const char*)checkpoint.sums.data(), header.num_sums * sizeof(Colour));
+  out.write((const char*)checkpoint.squares.data(), header.num_sums * sizeof(Colour));
+  out.close();
+
+  if(!out || rename(tmp.str().c_str(), filename.c_str()) != 0)
+  {
+    remove(tmp.str().c_str());
+    return false;
+  }
+
+  return true;
+}
+
+bool load_checkpoint(const std::string& filename, uint64_t key, Checkpoint& checkpoint)
+{
+  std::ifstream in(filename.c_str(), std::ios::binary);
+  if(!in) return false;
+
+  Header header;
+  in.read((char*)&header, sizeof(Header));
+  if(!in || memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION) return false;
+  if(header.colour_size != sizeof(Colour) || header.key != key) return false;
+
+  size_t num_pixels = (size_t)header.width * header.height;
+  if(header.num_sums != 0 && header.num_sums != num_pixels) return false;
+
+  checkpoint.key = header.key;
+  checkpoint.seed = header.seed;
+  checkpoint.width = header.width;
+  checkpoint.height = header.height;
+  checkpoint.pass = header.pass;
+  checkpoint.next_tile = header.next_tile;
+  checkpoint.counts.resize(num_pixels);
+  checkpoint.colours.resize(num_pixels);
+  checkpoint.sums.resize(header.num_sums);
+  checkpoint.squares.resize(header.num_sums);
+
+  in.read((char*)checkpoint.counts.data(), num_pixels * sizeof(unsigned int));
+  in.read((char*)checkpoint.colours.data(), num_pixels * sizeof(Colour));
+  in.read((char*)checkpoint.sums.data(), header.num_sums * sizeof(Colour));
+  in.read((char*)checkpoint.squares.data(), header.num_sums * sizeof(Colour));
+  return (bool)in;
+}
@@ -0,0 +1,46 @@
+#ifndef CS488_CHECKPOINT_HPP
+#define CS488_CHECKPOINT_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "algebra.hpp"
+
+// The state of an unfinished render, saved so that it can carry on where it left off. Tiles are rendered in a fixed
+// order and the random numbers a sample uses depend only on the seed, its pixel and its index, so a resumed render
+// takes the same samples as one that was never interrupted.
+//
+// Files carry a format version and a key made from the render's parameters, a file that doesn't match both is
+// ignored. Like the mesh cache the format depends on the layout of doubles, checkpoints are not portable across
+// machines.
+struct Checkpoint {
+  Checkpoint()
+    : key(0)
+    , width(0)
+    , height(0)
+    , seed(0)
+    , pass(0)
+    , next_tile(0)
+  {
+  }
+
+  uint64_t key;
+  uint32_t width, height;
+  uint64_t seed;
+  uint32_t pass;                    // Pass in progress, always 0 if the render isn't progressive
+  uint32_t next_tile;               // Tiles of the pass before this one in render order are finished
+  std::vector<unsigned int> counts; // Samples taken by each pixel
+  std::vector<Colour> colours;      // Of each pixel, black where no samples have been taken
+  std::vector<Colour> sums;         // Of each pixel's samples and their squares, empty if the render isn't progressive
+  std::vector<Colour> squares;
+};
+
+// Writes a checkpoint under a temporary name and renames it into place, so an interrupted write leaves the previous
+// checkpoint. Returns false if the file can't be written
+bool save_checkpoint(const std::string& filename, const Checkpoint& checkpoint);
+
+// Returns false if the file doesn't exist, is from another version of the format, is for a render with a different
+// key or is truncated
+bool load_checkpoint(const std::string& filename, uint64_t key, Checkpoint& checkpoint);
+
+#endif
@@ -0,0 +1,287 @@
+#include "decimate.hpp"
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <queue>
+#include <unordered_map>
+#include <iterator>
+#include <cstdint>
+
+namespace {
+
+// Moving a boundary edge costs this much more than moving a vertex off the surface by the same distance
+const double BOUNDARY_WEIGHT = 1000.0;
+
+// Sum of squared distances to a set of planes, as a symmetric 4x4 matrix
+struct Quadric {
+  double xx, xy, xz, xw, yy, yz, yw, zz, zw, ww;
+
+  Quadric()
+    : xx(0.0), xy(0.0), xz(0.0), xw(0.0), yy(0.0), yz(0.0), yw(0.0), zz(0.0), zw(0.0), ww(0.0)
+  {
+  }
+
+  // The plane n.p + d = 0 where n is a unit normal
+  Quadric(const Vector3D& n, double d, double weight)
+    : xx(weight*n[0]*n[0]), xy(weight*n[0]*n[1]), xz(weight*n[0]*n[2]), xw(weight*n[0]*d)
+    , yy(weight*n[1]*n[1]), yz(weight*n[1]*n[2]), yw(weight*n[1]*d)
+    , zz(weight*n[2]*n[2]), zw(weight*n[2]*d)
+    , ww(weight*d*d)
+  {
+  }
+
+  void add(const Quadric& q)
+  {
+    xx += q.xx; xy += q.xy; xz += q.xz; xw += q.xw;
+    yy += q.yy; yz += q.yz; yw += q.yw;
+    zz += q.zz; zw += q.zw;
+    ww += q.ww;
+  }
+
+  double error(const Point3D& p) const
+  {
+    double x = p[0], y = p[1], z = p[2];
+    return std::max(0.0, x*x*xx + 2*x*y*xy + 2*x*z*xz + 2*x*xw + y*y*yy + 2*y*z*yz + 2*y*yw + z*z*zz + 2*z*zw + ww);
+  }
+};
+
+// Collapsing vertex from into vertex to. The versions of the vertices when it was queued tell whether it is stale
+struct Collapse {
+  double cost;
+  unsigned int from, to;
+  unsigned int from_version, to_version;
+
+  // Orders the priority queue cheapest first
+  bool operator<(const Collapse& other) const
+  {
+    return cost > other.cost;
+  }
+};
+
+struct PositionHash {
+  size_t operator()(const Point3D& p) const
+  {
+    uint64_t h = 0;
+    for(int i = 0; i < 3; i++)
+    {
+      uint64_t bits;
+      double c = p[i] + 0.0; // -0 and 0 are the same position
+      memcpy(&bits, &c, sizeof(bits));
+      h = (h ^ bits) * 0x9E3779B97F4A7C15ULL;
+    }
+    return h ^ (h >> 32);
+  }
+};
+
+struct PositionEqual {
+  bool operator()(const Point3D& a, const Point3D& b) const
+  {
+    return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+  }
+};
+
+}
+
+std::vector<unsigned int> decimate(const Buffer<Point3D>& verts, const Buffer<unsigned int>& indices, size_t target_triangles, double& error)
+{
+  error = 0.0;
+
+  // Work on the distinct positions, remembering a vertex at each to reference when a corner moves there
+  std::unordered_map<Point3D, unsigned int, PositionHash, PositionEqual> ids;
+  std::vector<unsigned int> position_of(verts.size());
+  std::vector<Point3D> positions;
+  std::vector<unsigned int> representative;
+  for(size_t v = 0; v < verts.size(); v++)
+  {
+    auto inserted = ids.insert(std::make_pair(verts[v], (unsigned int)positions.size()));
+    if(inserted.second)
+    {
+      positions.push_back(verts[v]);
+      representative.push_back(v);
+    }
+    position_of[v] = inserted.first->second;
+  }
+
+  size_t num_faces = indices.size() / 3;
+  std::vector<unsigned int> corners(indices.begin(), indices.end());
+  std::vector<unsigned int> corner_positions(indices.size());
+  for(size_t i = 0; i < indices.size(); i++) corner_positions[i] = position_of[indices[i]];
+
+  auto position = [&](size_t f, int k) -> unsigned int { return corner_positions[3*f+k]; };
+  auto normal = [&](const Point3D& a, const Point3D& b, const Point3D& c) { return (b-a).cross(c-a); };
+
+  // Faces around each position, dead faces are dropped lazily
+  std::vector<bool> alive(num_faces, true);
+  std::vector<std::vector<unsigned int>> faces(positions.size());
+  std::vector<Quadric> quadrics(positions.size());
+  std::vector<Quadric> surface(positions.size()); // Without the boundary planes, to measure the error
+  size_t live = 0;
+  for(size_t f = 0; f < num_faces; f++)
+  {
+    unsigned int a = position(f, 0), b = position(f, 1), c = position(f, 2);
+    if(a == b || b == c || c == a)
+    {
+      alive[f] = false;
+      continue;
+    }
+
+    live++;
+    for(int k = 0; k < 3; k++) faces[position(f, k)].push_back(f);
+
+    Vector3D n = normal(positions[a], positions[b], positions[c]);
+    double length = n.length();
+    if(length == 0.0) continue;
+    n = (1.0 / length) * n;
+    Quadric q(n, -n.dot(positions[a] - Point3D()), 1.0);
+    for(int k = 0; k < 3; k++)
+    {
+      quadrics[position(f, k)].add(q);
+      surface[position(f, k)].add(q);
+    }
+  }
+
+  // Edges used by a single face are on the boundary. Constrain them with a plane through the edge at right angles
+  // to the face
+  std::unordered_map<uint64_t, unsigned int> edge_count;
+  auto edge_key = [](unsigned int a, unsigned int b) { return ((uint64_t)std::min(a, b) << 32) | std::max(a, b); };
+  for(size_t f = 0; f < num_faces; f++)
+  {
+    if(!alive[f]) continue;
+    for(int k = 0; k < 3; k++) edge_count[edge_key(position(f, k), position(f, (k+1)%3))]++;
+  }
+  for(size_t f = 0; f < num_faces; f++)
+  {
+    if(!alive[f]) continue;
+    Vector3D n = normal(positions[position(f, 0)], positions[position(f, 1)], positions[position(f, 2)]);
+    for(int k = 0; k < 3; k++)
+    {
+      unsigned int a = position(f, k), b = position(f, (k+1)%3);
+      if(edge_count[edge_key(a, b)] != 1) continue;
+
+      Vector3D m = (positions[b] - positions[a]).cross(n);
+      double length = m.length();
+      if(length == 0.0) continue;
+      m = (1.0 / length) * m;
+      Quadric q(m, -m.dot(positions[a] - Point3D()), BOUNDARY_WEIGHT);
+      quadrics[a].add(q);
+      quadrics[b].add(q);
+    }
+  }
+
+  std::vector<unsigned int> versions(positions.size(), 0);
+  std::vector<bool> removed(positions.size(), false);
+  std::priority_queue<Collapse> queue;
+
+  // Queue the cheaper direction to collapse an edge
+  auto push = [&](unsigned int u, unsigned int v) {
+    Quadric q = quadrics[u];
+    q.add(quadrics[v]);
+    double into_v = q.error(positions[v]);
+    double into_u = q.error(positions[u]);
+    if(into_v <= into_u) queue.push(Collapse{ into_v, u, v, versions[u], versions[v] });
+    else queue.push(Collapse{ into_u, v, u, versions[v], versions[u] });
+  };
+
+  auto neighbours = [&](unsigned int v) {
+    std::vector<unsigned int> result;
+    for(auto f : faces[v])
+    {
+      if(!alive[f]) continue;
+      for(int k = 0; k < 3; k++) if(position(f, k) != v) result.push_back(position(f, k));
+    }
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+  };
+
+  for(size_t f = 0; f < num_faces; f++)
+  {
+    if(!alive[f]) continue;
+    for(int k = 0; k < 3; k++) if(position(f, k) < position(f, (k+1)%3)) push(position(f, k), position(f, (k+1)%3));
+  }
+
+  while(live > target_triangles && !queue.empty())
+  {
+    Collapse collapse = queue.top();
+    queue.pop();
+
+    unsigned int u = collapse.from, v = collapse.to;
+    if(removed[u] || removed[v] || versions[u] != collapse.from_version || versions[v] != collapse.to_version) continue;
+
+    // Only collapse edges with one or two faces whose end points share no other neighbours, otherwise the mesh
+    // pinches into something that isn't a surface
+    std::vector<unsigned int> around_u = neighbours(u);
+    std::vector<unsigned int> around_v = neighbours(v);
+    if(!std::binary_search(around_u.begin(), around_u.end(), v)) continue;
+
+    std::vector<unsigned int> common;
+    std::set_intersection(around_u.begin(), around_u.end(), around_v.begin(), around_v.end(), std::back_inserter(common));
+
+    size_t shared = 0;
+    bool folds = false;
+    for(auto f : faces[u])
+    {
+      if(!alive[f]) continue;
+
+      Point3D p[3];
+      bool has_v = false;
+      for(int k = 0; k < 3; k++)
+      {
+        has_v = has_v || position(f, k) == v;
+        p[k] = positions[position(f, k)];
+      }
+      if(has_v)
+      {
+        shared++;
+        continue;
+      }
+
+      // Faces that stay must not turn over or become slivers
+      Vector3D before = normal(p[0], p[1], p[2]);
+      for(int k = 0; k < 3; k++) if(position(f, k) == u) p[k] = positions[v];
+      Vector3D after = normal(p[0], p[1], p[2]);
+      folds = folds || after.dot(before) < 0.1 * after.length() * before.length();
+    }
+    if(folds || shared == 0 || shared > 2 || common.size() != shared) continue;
+
+    for(auto f : faces[u])
+    {
+      if(!alive[f]) continue;
+
+      bool has_v = false;
+      for(int k = 0; k < 3; k++) has_v = has_v || position(f, k) == v;
+      if(has_v)
+      {
+        alive[f] = false;
+        live--;
+        continue;
+      }
+
+      for(int k = 0; k < 3; k++)
+      {
+        if(position(f, k) != u) continue;
+        corner_positions[3*f+k] = v;
+        corners[3*f+k] = representative[v];
+      }
+      faces[v].push_back(f);
+    }
+
+    faces[u].clear();
+    faces[v].erase(std::remove_if(faces[v].begin(), faces[v].end(), [&](unsigned int f) { return !alive[f]; }), faces[v].end());
+    quadrics[v].add(quadrics[u]);
+    surface[v].add(surface[u]);
+    error = std::max(error, std::sqrt(surface[v].error(positions[v])));
+    removed[u] = true;
+    versions[v]++;
+
+    for(auto w : neighbours(v)) push(v, w);
+  }
+
+  std::vector<unsigned int> result;
+  result.reserve(3*live);
+  for(size_t f = 0; f < num_faces; f++)
+  {
+    if(alive[f]) result.insert(result.end(), corners.begin() + 3*f, corners.begin() + 3*f + 3);
+  }
+  return result;
+}
@@ -0,0 +1,16 @@
+#ifndef CS488_DECIMATE_HPP
+#define CS488_DECIMATE_HPP
+
+#include <vector>
+#include "algebra.hpp"
+#include "buffer.hpp"
+
+// Simplifies a triangle mesh to about target_triangles by collapsing edges, cheapest first according to the quadric
+// error metric of Garland & Heckbert. Each edge collapses into one of its end points so no vertices are made, the
+// returned index buffer references the same vertices as the original. Vertices at the same position are treated as one
+// so seams in the normals or texture coordinates don't open up, and edges on the boundary of the mesh are expensive to
+// move. Collapses that would fold a triangle over are skipped. error is set to a rough bound on how far the result
+// strays from the original surface.
+std::vector<unsigned int> decimate(const Buffer<Point3D>& verts, const Buffer<unsigned int>& indices, size_t target_triangles, double& error);
+
+#endif
@@ -0,0 +1,249 @@
+#include "heightfield.hpp"
+#include "bvh.hpp"
+#include <cmath>
+#include <limits>
+
+Heightfield::Heightfield(const Image& image)
+  : m_width(std::max(image.width(), 2))
+  , m_height(std::max(image.height(), 2))
+  , m_heights(m_width * m_height, 0.0f)
+{
+  // Grayscale images have one element per pixel, for colour images use the average of the channels. An alpha channel,
+  // the second element of gray+alpha images and the fourth of RGBA ones, isn't part of the height
+  int channels = (image.elements() == 2) ? 1 : std::min(image.elements(), 3);
+  for(int z = 0; z < image.height(); z++)
+  {
+    for(int x = 0; x < image.width(); x++)
+    {
+      double h = 0.0;
+      for(int c = 0; c < channels; c++) h += image(x, z, c);
+      m_heights[z * m_width + x] = (channels > 0) ? h / channels : 0.0;
+    }
+  }
+
+  // Build the min/max pyramid. Each cell of a level covers the 2x2 cells below it, the last level is a single cell
+  int w = m_width-1, h = m_height-1;
+  for(int level = 1; w > 1 || h > 1; level++)
+  {
+    Level next;
+    next.width = (w + 1) / 2;
+    next.height = (h + 1) / 2;
+    next.min.resize(next.width * next.height);
+    next.max.resize(next.width * next.height);
+
+    for(int j = 0; j < next.height; j++)
+    {
+      for(int i = 0; i < next.width; i++)
+      {
+        float lo = std::numeric_limits<float>::infinity();
+        float hi = -std::numeric_limits<float>::infinity();
+        for(int cj = 2*j; cj < std::min(2*j+2, h); cj++)
+        {
+          for(int ci = 2*i; ci < std::min(2*i+2, w); ci++)
+          {
+            float clo, chi;
+            range(level-1, ci, cj, clo, chi);
+            lo = std::min(lo, clo);
+            hi = std::max(hi, chi);
+          }
+        }
+        next.min[j * next.width + i] = lo;
+        next.max[j * next.width + i] = hi;
+      }
+    }
+
+    m_levels.push_back(next);
+    w = next.width;
+    h = next.height;
+  }
+}
+
+Heightfield::~Heightfield()
+{
+}
+
+void Heightfield::range(int level, int i, int j, float& min, float& max) const
+{
+  if(level == 0)
+  {
+    // The range of a grid cell is the range of its four corner samples
+    float h00 = height(i, j), h10 = height(i+1, j), h01 = height(i, j+1), h11 = height(i+1, j+1);
+    min = std::min(std::min(h00, h10), std::min(h01, h11));
+    max = std::max(std::max(h00, h10), std::max(h01, h11));
+  }
+  else
+  {
+    const Level& l = m_levels[level-1];
+    min = l.min[j * l.width + i];
+    max = l.max[j * l.width + i];
+  }
+}
+
+Vector3D Heightfield::normal(int x, int z) const
+{
+  // Central differences of the heights (one sided at the borders) give the slope of the surface at a sample.
+  // The grid spacing is 1/(m_width-1) along x and 1/(m_height-1) along z
+  int x0 = std::max(x-1, 0), x1 = std::min(x+1, m_width-1);
+  int z0 = std::max(z-1, 0), z1 = std::min(z+1, m_height-1);
+  double dhdx = (height(x1, z) - height(x0, z)) * (m_width-1) / (x1 - x0);
+  double dhdz = (height(x, z1) - height(x, z0)) * (m_height-1) / (z1 - z0);
+
+  return Vector3D(-dhdx, 1.0, -dhdz);
+}
+
+BoundingBox Heightfield::bounds() const
+{
+  return BoundingBox(Point3D(-0.5, 0.0, -0.5), Point3D(0.5, 1.0, 0.5));
+}
+
+bool Heightfield::intersect(const Ray& ray, Intersection& j) const
+{
+  // Do all the work in grid space where cells are unit squares, x E [0, m_width-1] and z E [0, m_height-1]
+  // This is a scale and translation along x and z only so t is the same in both spaces
+  int w = m_width-1, h = m_height-1;
+  Point3D o((ray.origin()[0] + 0.5) * w, ray.origin()[1], (ray.origin()[2] + 0.5) * h);
+  Vector3D d(ray.direction()[0] * w, ray.direction()[1], ray.direction()[2] * h);
+
+  // Clip the ray to the bounds of the terrain
+  int top = m_levels.size();
+  float lo, hi;
+  range(top, 0, 0, lo, hi);
+
+  BoundingBox bounds(Point3D(0.0, lo, 0.0), Point3D(w, hi, h));
+  double t0 = 0.0, t1 = std::numeric_limits<double>::infinity();
+  if(!bounds.intersect(o, Vector3D(1.0 / d[0], 1.0 / d[1], 1.0 / d[2]), t0, t1)) return false;
+
+  double t;
+  return traverse(top, 0, 0, o, d, t0, t1, j, t);
+}
+
+bool Heightfield::traverse(int level, int i, int j, const Point3D& o, const Vector3D& d, double t0, double t1, Intersection& k, double& t) const
+{
+  // Skip the cell if the ray's heights over [t0, t1] are completely above or below the heights in the cell
+  float lo, hi;
+  range(level, i, j, lo, hi);
+  double y0 = o[1] + t0*d[1];
+  double y1 = o[1] + t1*d[1];
+  if(std::max(y0, y1) < lo || std::min(y0, y1) > hi) return false;
+
+  if(level == 0) return intersect_cell(i, j, o, d, t0, t1, k, t);
+
+  // Find the lines splitting the cell into its children. Cells on the far borders may only have one column or row
+  int size = 1 << level;
+  double xm = i*size + size/2;
+  double zm = j*size + size/2;
+  bool split_x = xm < m_width-1;
+  bool split_z = zm < m_height-1;
+
+  // The child containing the point the ray enters the cell
+  double px = o[0] + t0*d[0];
+  double pz = o[2] + t0*d[2];
+  int cx = (split_x && (px > xm || (px == xm && d[0] > 0))) ? 1 : 0;
+  int cz = (split_z && (pz > zm || (pz == zm && d[2] > 0))) ? 1 : 0;
+
+  // When the ray crosses each of the splitting lines
+  double inf = std::numeric_limits<double>::infinity();
+  double tx = (split_x && d[0] != 0.0) ? (xm - o[0]) / d[0] : inf;
+  double tz = (split_z && d[2] != 0.0) ? (zm - o[2]) / d[2] : inf;
+  if(!(tx > t0 && tx < t1)) tx = inf;
+  if(!(tz > t0 && tz < t1)) tz = inf;
+
+  // March through the children in the order the ray passes through them, stopping at the first hit
+  double start = t0;
+  for(;;)
+  {
+    double end = std::min(std::min(tx, tz), t1);
+    if(traverse(level-1, 2*i+cx, 2*j+cz, o, d, start, end, k, t)) return true;
+    if(end >= t1) return false;
+
+    start = end;
+    if(tx == tz)
+    {
+      cx ^= 1;
+      cz ^= 1;
+      tx = tz = inf;
+    }
+    else if(tx < tz)
+    {
+      cx ^= 1;
+      tx = inf;
+    }
+    else
+    {
+      cz ^= 1;
+      tz = inf;
+    }
+  }
+}
+
+bool Heightfield::intersect_cell(int x, int z, const Point3D& o, const Vector3D& d, double t0, double t1, Intersection& k, double& t) const
+{
+  // The corners of the cell and the two triangles they form
+  Point3D P[4] = {
+    Point3D(x, height(x, z), z),
+    Point3D(x+1, height(x+1, z), z),
+    Point3D(x+1, height(x+1, z+1), z+1),
+    Point3D(x, height(x, z+1), z+1)
+  };
+  int corners[4][2] = { {x, z}, {x+1, z}, {x+1, z+1}, {x, z+1} };
+  int tris[2][3] = { {0, 1, 2}, {0, 2, 3} };
+
+  // Allow a little slack around the interval so hits exactly on the edge of a cell aren't lost
+  double eps = 1e-9 * (1.0 + t1);
+  bool intersected = false;
+  double best = t1 + eps;
+  double bu = 0.0, bv = 0.0;
+  int btri = 0;
+
+  for(int tri = 0; tri < 2; tri++)
+  {
+    // Moller & Trumbore, as in TriMesh::intersect
+    const Point3D& A = P[tris[tri][0]];
+    Vector3D E1 = P[tris[tri][1]] - A;
+    Vector3D E2 = P[tris[tri][2]] - A;
+
+    Vector3D Pv = d.cross(E2);
+    double det = Pv.dot(E1);
+    if(fabs(det) < std::numeric_limits<double>::epsilon()) continue;
+
+    double inv_det = 1.0 / det;
+    Vector3D T = o - A;
+    double u = Pv.dot(T) * inv_det;
+    if(u < 0 || u > 1) continue;
+
+    Vector3D Q = T.cross(E1);
+    double v = Q.dot(d) * inv_det;
+    if(v < 0 || u + v > 1) continue;
+
+    double tt = Q.dot(E2) * inv_det;
+    if(tt <= 0 || tt < t0 - eps || tt > best) continue;
+
+    intersected = true;
+    best = tt;
+    bu = u;
+    bv = v;
+    btri = tri;
+  }
+
+  if(!intersected) return false;
+
+  // Interpolate the normals at the corners to get a smooth surface
+  const int* c = tris[btri];
+  Vector3D n = (1-bu-bv)*normal(corners[c[0]][0], corners[c[0]][1]) + bu*normal(corners[c[1]][0], corners[c[1]][1]) + bv*normal(corners[c[2]][0], corners[c[2]][1]);
+
+  // Back to the object's coordinates
+  Point3D q = o + best*d;
+  q = Point3D(q[0] / (m_width-1) - 0.5, q[1], q[2] / (m_height-1) - 0.5);
+
+  t = best;
+  k.q = q;
+  k.n = n;
+  k.u = q[0] + 0.5;
+  k.v = q[2] + 0.5;
+
+  // Tangents along the x and z directions of the surface
+  k.pu = Vector3D(1.0, -n[0] / n[1], 0.0);
+  k.pv = Vector3D(0.0, -n[2] / n[1], 1.0);
+
+  return true;
+}
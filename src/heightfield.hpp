@@ -0,0 +1,46 @@
+#ifndef CS488_HEIGHTFIELD_HPP
+#define CS488_HEIGHTFIELD_HPP
+
+#include <vector>
+#include "primitive.hpp"
+#include "image.hpp"
+
+// A terrain primitive defined by a grid of height samples taken from a grayscale image. The samples are the
+// vertices of the grid, which spans [-0.5, 0.5] along x and z (like Plane) with heights in [0, 1] along y.
+// Each grid cell is split into two triangles.
+//
+// Intersection descends a pyramid of min/max heights: a cell on level k covers 2^k x 2^k grid cells, and the
+// ray marches over the (up to) 2x2 children of a cell in the order it crosses them, only descending into
+// the children whose height range overlaps the ray. This is O(log n) in the resolution for most rays.
+class Heightfield : public Primitive {
+public:
+  Heightfield(const Image& image);
+  virtual ~Heightfield();
+
+  virtual bool intersect(const Ray& ray, Intersection& j) const;
+  virtual BoundingBox bounds() const;
+
+private:
+  // Min/max heights of the cells of one pyramid level
+  struct Level {
+    int width, height;
+    std::vector<float> min, max;
+  };
+
+  float height(int x, int z) const
+  {
+    return m_heights[z * m_width + x];
+  }
+
+  void range(int level, int i, int j, float& min, float& max) const;
+  Vector3D normal(int x, int z) const;
+
+  bool traverse(int level, int i, int j, const Point3D& o, const Vector3D& d, double t0, double t1, Intersection& k, double& t) const;
+  bool intersect_cell(int x, int z, const Point3D& o, const Vector3D& d, double t0, double t1, Intersection& k, double& t) const;
+
+  int m_width, m_height; // Number of samples, there are one fewer cells along each axis
+  std::vector<float> m_heights;
+  std::vector<Level> m_levels; // Levels 1 and up, level 0 ranges are computed from the samples directly
+};
+
+#endif
@@ -2,6 +2,7 @@
 #include <iostream>
 #include <limits>
 #include <cmath>
+#include <algorithm>
 
 Light::Light()
   : colour(0.0, 0.0, 0.0),
@@ -71,12 +72,50 @@ bool DiscLight::intersect(const Ray& ray, Intersection& j) const
   return true;
 }
 
-Point3D DiscLight::getPosition(const std::function<double()> uniform) const
+Point3D DiscLight::getPosition(double u, double v) const
 {
-  double e1 = uniform();
-  double e2 = uniform();
+  // Shirley and Chiu's concentric mapping of the square onto the disc, which keeps areas in proportion so points spread
+  // evenly over the square are spread evenly over the disc
+  double a = 2.0 * u - 1.0;
+  double b = 2.0 * v - 1.0;
+  if(a == 0.0 && b == 0.0) return position;
+
+  double r, phi;
+  if(a * a > b * b)
+  {
+    r = a;
+    phi = (M_PI / 4.0) * (b / a);
+  }
+  else
+  {
+    r = b;
+    phi = (M_PI / 2.0) - (M_PI / 4.0) * (a / b);
+  }
 
-  return Matrix4x4().rotate(e2*360.0, m_normal) * (position + (e1 * m_radius) * m_perp);
+  r *= m_radius;
+  return position + (r * cos(phi)) * m_perp + (r * sin(phi)) * m_binormal;
+}
+
+double DiscLight::getSolidAngle(const Point3D& light_pos, const Point3D& p) const
+{
+  Vector3D d = p - light_pos;
+  double distance2 = d.dot(d);
+  if(distance2 == 0.0) return 0.0;
+
+  // The disc is lit on both sides
+  return fabs(m_normal.dot(d)) / (distance2 * sqrt(distance2));
+}
+
+void DiscLight::getBounds(const Point3D& p, const Vector3D& n, double& max_cos, double& min_distance) const
+{
+  // Every point of the disc is within m_radius of its centre along directions in its plane, which are at most
+  // in_plane along n
+  Vector3D d = position - p;
+  double in_plane = sqrt(std::max(0.0, 1.0 - m_normal.dot(n) * m_normal.dot(n)));
+  double reach = n.dot(d) + m_radius * in_plane;
+  min_distance = std::max(0.0, d.length() - m_radius);
+  if(reach <= 0.0) max_cos = reach;
+  else max_cos = (min_distance > 0.0) ? std::min(1.0, reach / min_distance) : 1.0;
 }
 
 std::ostream& DiscLight::toOutput(std::ostream& out) const
@@ -4,7 +4,7 @@
 #include "scene.hpp"
 #include "algebra.hpp"
 #include <iosfwd>
-#include <functional>
+#include <cmath>
 
 // Represents a simple point light.
 class Light : public Primitive {
@@ -25,7 +25,8 @@ public:
     return colour;
   }
 
-  virtual Point3D getPosition(const std::function<double()> uniform) const
+  // The point on the light at (u, v) in the unit square
+  virtual Point3D getPosition(double u, double v) const
   {
     return position;
   }
@@ -35,6 +36,22 @@ public:
     return position;
   }
 
+  // Bounds on the light seen from p on a surface with normal n: the largest cosine between n and the direction to any
+  // point of the light, which is at most 0 if the light is behind the surface, and the least distance to one
+  virtual void getBounds(const Point3D& p, const Vector3D& n, double& max_cos, double& min_distance) const
+  {
+    Vector3D d = position - p;
+    min_distance = d.length();
+    max_cos = (min_distance > 0.0) ? n.dot(d) / min_distance : 1.0;
+  }
+
+  // Solid angle that a unit area of the light around light_pos takes up seen from p. Samples of an area light are
+  // weighted by it. A point light has no area and its samples are all weighted the same
+  virtual double getSolidAngle(const Point3D& light_pos, const Point3D& p) const
+  {
+    return 1.0;
+  }
+
   double getAttenuation(double r) const
   {
     return (1.0 / (falloff[0] + falloff[1]*r + falloff[2]*(r*r)));
@@ -61,23 +78,24 @@ public:
     , m_normal(normal.normalized())
     , m_radius(radius)
   {
-    // Find a perpendicular vector to the normal on the plane
-    // This technique is described by Hughes and Moller in their paper:
+    // Find a perpendicular vector to the normal on the plane by zeroing its smallest component, and the third vector
+    // of the frame that samples are placed in. This technique is described by Hughes and Moller in their paper:
     // “Building an Orthonormal Basis from a Unit Vector”
-    if(m_normal[2] <= m_normal[0] && m_normal[2] <= m_normal[1])
+    if(fabs(m_normal[0]) <= fabs(m_normal[1]) && fabs(m_normal[0]) <= fabs(m_normal[2]))
     {
-      m_perp = Vector3D(-m_normal[1], m_normal[0], 0.0);
+      m_perp = Vector3D(0.0, -m_normal[2], m_normal[1]);
     }
-    else if(m_normal[1] <= m_normal[0])
+    else if(fabs(m_normal[1]) <= fabs(m_normal[2]))
     {
       m_perp = Vector3D(-m_normal[2], 0.0, m_normal[0]);
     }
     else
     {
-      m_perp = Vector3D(0.0, -m_normal[2], m_normal[1]);
+      m_perp = Vector3D(-m_normal[1], m_normal[0], 0.0);
     }
 
     m_perp.normalize();
+    m_binormal = m_normal.cross(m_perp);
   }
   ~DiscLight();
 
@@ -86,13 +104,16 @@ public:
     return false;
   }
 
-  virtual Point3D getPosition(const std::function<double()> uniform) const; 
+  virtual Point3D getPosition(double u, double v) const;
+  virtual double getSolidAngle(const Point3D& light_pos, const Point3D& p) const;
+  virtual void getBounds(const Point3D& p, const Vector3D& n, double& max_cos, double& min_distance) const;
   virtual bool intersect(const Ray& ray, Intersection& j) const;
 
   virtual std::ostream& toOutput(std::ostream& out) const;
 private:
   Vector3D m_normal;
   Vector3D m_perp;
+  Vector3D m_binormal;
   double m_radius;
 };
 
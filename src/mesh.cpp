@@ -2,45 +2,176 @@
 #include <iostream>
 #include <cmath>
 #include <limits>
+#include <chrono>
 #include <unordered_map>
+#include <algorithm>
+#include "parallel.hpp"
+#include "decimate.hpp"
 
-Mesh::Mesh(const std::vector<Point3D>& verts,
-           const std::vector< std::vector<int> >& faces)
+Mesh::Mesh(Buffer<Point3D> verts,
+           std::vector< std::vector<int> > faces)
   : m_verts(verts)
-  , m_faces(faces)
-  , m_boundingBall(getBoundingBall(verts))
+  , m_faces(std::move(faces))
+  , m_boundingBall(getBoundingBall(m_verts))
 {
 }
 
-NonhierSphere Mesh::getBoundingBall(const std::vector<Point3D>& verts) const
+Mesh::Mesh(Buffer<Point3D> verts, Buffer<unsigned int> triangles)
+  : m_verts(verts)
+  , m_triangles(triangles)
+  , m_boundingBall(getBoundingBall(m_verts))
 {
-  Point3D C = verts[0] + 0.5*(verts[1]-verts[0]);
-  double radius = (verts[1] - verts[0]).length() / 2.0;
+}
 
-  // This is the bouncing ball algorithm. Take any two points and construct the sphere's center
-  // at the center point of the line between the two vertices and raidus half the distance
-  // between the two vertices
-  // Then loop through each vertex. If it is outside the sphere then move the sphere's center
-  // a little bit towards the point while growing the radius as well so that the point is now inside 
-  // the sphere. Keep doing this until there are no vertices outside the sphere
-  for(bool outsider = true; outsider == true;)
-  {
-    outsider = false;
-    for(auto v : verts)
+Mesh::Mesh(Buffer<Point3D> verts)
+  : m_verts(verts)
+  , m_boundingBall(Point3D(), 0.0)
+{
+}
+
+NonhierSphere Mesh::getBoundingBall(const Buffer<Point3D>& verts) const
+{
+  if(verts.empty()) return NonhierSphere(Point3D(), 0.0);
+
+  auto farthest = [&](const Point3D& p) {
+    const Point3D* best = &verts[0];
+    double best_length = 0.0;
+    for(auto& v : verts)
     {
-      double length = (v-C).length();
-      if(length > radius)
+      double length = (v-p).length2();
+      if(length > best_length)
       {
-        double diff = length - radius;
-        double delta = diff / length;
-        C = C + (0.5 * delta)*(v-C);
-        radius = radius + (0.5 * diff);
-        outsider = true;
+        best = &v;
+        best_length = length;
       }
     }
+    return *best;
+  };
+
+  // This is Ritter's bounding sphere. Start with the sphere whose diameter joins two vertices that are close to
+  // being the furthest apart: the vertex furthest from any vertex, and the vertex furthest from that one
+  Point3D A = farthest(verts[0]);
+  Point3D B = farthest(A);
+  Point3D C = A + 0.5*(B-A);
+  double radius = (B-A).length() / 2.0;
+
+  // Then loop through each vertex. If it is outside the sphere then move the sphere's center towards the point
+  // while growing the radius so the point is now on the sphere. The new sphere contains the old one, so every
+  // vertex is inside after a single pass
+  for(auto& v : verts)
+  {
+    double length = (v-C).length();
+    if(length > radius)
+    {
+      double diff = length - radius;
+      double delta = diff / length;
+      C = C + (0.5 * delta)*(v-C);
+      radius = radius + (0.5 * diff);
+    }
   }
 
-  return NonhierSphere(C, radius);
+  // Allow for rounding in the updates
+  return NonhierSphere(C, radius * (1.0 + 1e-9) + 1e-12);
+}
+
+BoundingBox Mesh::bounds() const
+{
+  return m_boundingBall.bounds();
+}
+
+namespace {
+
+// Tests the ray against the polygon with the given corners. A hit closer than prev_t is put in i and its distance in
+// prev_t
+template<typename Index>
+bool intersect_polygon(const Ray& ray, const Buffer<Point3D>& verts, const Index* face, size_t size, double& prev_t, Intersection& i)
+{
+  double epsilon = std::numeric_limits<double>::epsilon();
+
+  // Compute the normal for the face
+  Point3D P0 = verts[face[0]];
+  Point3D P1 = verts[face[1]];
+  Point3D P2 = verts[face[2]];
+
+  Vector3D n = (P1-P0).cross(P2-P0);
+
+  // Now check if the ray intersects the polygon containing the face
+  // If denom is 0 then the ray does not intersect the plane at all
+  double denom = n.dot(ray.direction());
+  if(fabs(denom) < epsilon) return false;
+
+  // If t is negative or a previous intersection has a smaller t (meaning it is closer to the
+  // ray's origin) then disregard this face
+  double t = n.dot(P0 - ray.origin()) / denom;
+  if(t < 0 || prev_t < t) return false;
+
+  // Calculate intersection point
+  Point3D Q = ray.origin() + t*ray.direction();
+
+  // It makes it easier to check if the intersection point is inside the face when both
+  // the face and the intersection point are projected on to the 2D plane. The 2D plane
+  // shall be the plane corresponding to dropping the largest coordinate of the normal vector
+  // This prevents the polygon being projected into a line on the 2D plane
+  int i1 = 0, i2 = 0;
+  if(fabs(n[2]) > fabs(n[0]) && fabs(n[2]) > fabs(n[1]))
+  {
+    i1 = 0;
+    i2 = 1;
+  }
+  else if(fabs(n[1]) > fabs(n[0]))
+  {
+    i1 = 0;
+    i2 = 2;
+  }
+  else
+  {
+    i1 = 1;
+    i2 = 2;
+  }
+
+  // Now for each edge, project the points to the 2D plane and translate the points such that the intersection point
+  // is centered on the origin. We then shoot a "ray" in the positive u (or x) axis and count the number of times
+  // this ray intersects with an edge. If even, then the intersection point is outside the face, otherwise it is inside
+  int edge_crossings = 0;
+  for(size_t j = 0; j < size; j++)
+  {
+    Point3D E0 = (j == 0) ? Point3D(verts[face[size-1]][i1]-Q[i1], verts[face[size-1]][i2]-Q[i2], 0.0) : Point3D(verts[face[j-1]][i1]-Q[i1], verts[face[j-1]][i2]-Q[i2], 0.0);
+    Point3D E1 = Point3D(verts[face[j]][i1]-Q[i1], verts[face[j]][i2]-Q[i2], 0.0);
+
+    // 1 if positive, 0 otherwise
+    int sign0 = (E0[1] >= 0) ? 1 : 0;
+    int sign1 = (E1[1] >= 0) ? 1 : 0;
+
+    // If both of the v coordinates have the same sign, then the edge definitely doesn't cross the positive u axis
+    if(sign0 == sign1) continue;
+
+    // If both the u coordinates is leq to 0, then the edge definitely doesn't cross the ray on the positive u axis
+    if(E0[0] <= 0 && E1[0] <= 0) continue;
+
+    // If both the u coordinates are greather than 0, then the edge definitely crosses the positive u axis
+    if(E0[0] > epsilon && E1[0] > epsilon) {
+      edge_crossings++;
+    }
+    else
+    {
+      // Otherwise the edge may or may not cross the positive u axis. We must calculate the intersection point
+      // We know that the v coordinate of the intersection point must be 0. We just have to check the u coordinate
+      // and see if it is greater than 0
+      double s = (-E0[1]) / (E1[1] - E0[1]);
+      double u = E0[0] + s * (E1[0] - E0[0]);
+      if(u > epsilon) edge_crossings++;
+    }
+  }
+
+  // If odd, it is within the bounds of the polygon
+  if(!(edge_crossings & 0x1)) return false;
+
+  prev_t = t;
+  i.q = Q;
+  i.n = n;
+  return true;
+}
+
 }
 
 bool Mesh::intersect(const Ray& ray, Intersection& j) const
@@ -54,244 +185,678 @@ bool Mesh::intersect(const Ray& ray, Intersection& j) const
   if(bball_intersected)
   {
     // Loop through each face and check if there is an intersection
-    double epsilon = std::numeric_limits<double>::epsilon();
     double prev_t = std::numeric_limits<double>::infinity();
-    for(auto face : m_faces)
+    for(auto& face : m_faces)
     {
-      // Compute the normal for the face
-      Point3D P0 = m_verts[face[0]];
-      Point3D P1 = m_verts[face[1]];
-      Point3D P2 = m_verts[face[2]];
-
-      Vector3D n = (P1-P0).cross(P2-P0);
-
-      // Now check if the ray intersects the polygon containing the face
-      // If denom is 0 then the ray does not intersect the plane at all
-      double denom = n.dot(ray.direction());
-      if(fabs(denom) < epsilon) continue;
-
-      // If t is negative or a previous intersection has a smaller t (meaning it is closer to the
-      // ray's origin) then disregard this face and continue
-      double t = n.dot(P0 - ray.origin()) / denom;
-      if(t < 0 || prev_t < t) continue;
-
-      // Calculate intersection point
-      Point3D Q = ray.origin() + t*ray.direction();
-
-      // It makes it easier to check if the intersection point is inside the face when both
-      // the face and the intersection point are projected on to the 2D plane. The 2D plane
-      // shall be the plane corresponding to dropping the largest coordinate of the normal vector
-      // This prevents the polygon being projected into a line on the 2D plane
-      int i1 = 0, i2 = 0;
-      if(fabs(n[2]) > fabs(n[0]) && fabs(n[2]) > fabs(n[1]))
-      {
-        i1 = 0;
-        i2 = 1;
-      }
-      else if(fabs(n[1]) > fabs(n[0]))
-      {
-        i1 = 0;
-        i2 = 2;
-      }
-      else
-      {
-        i1 = 1;
-        i2 = 2;
-      }
+      intersected = intersect_polygon(ray, m_verts, face.data(), face.size(), prev_t, j) || intersected;
+    }
+    for(size_t f = 0; f < m_triangles.size(); f += 3)
+    {
+      intersected = intersect_polygon(ray, m_verts, &m_triangles[f], 3, prev_t, j) || intersected;
+    }
+  }
 
-      // Now for each edge, project the points to the 2D plane and translate the points such that the intersection point
-      // is centered on the origin. We then shoot a "ray" in the positive u (or x) axis and count the number of times
-      // this ray intersects with an edge. If even, then the intersection point is outside the face, otherwise it is inside
-      int edge_crossings = 0;
-      for(size_t j = 0; j < face.size(); j++)
-      {
-        Point3D E0 = (j == 0) ? Point3D(m_verts[face.back()][i1]-Q[i1], m_verts[face.back()][i2]-Q[i2], 0.0) : Point3D(m_verts[face[j-1]][i1]-Q[i1], m_verts[face[j-1]][i2]-Q[i2], 0.0);
-        Point3D E1 = Point3D(m_verts[face[j]][i1]-Q[i1], m_verts[face[j]][i2]-Q[i2], 0.0);
-
-        // 1 if positive, 0 otherwise
-        int sign0 = (E0[1] >= 0) ? 1 : 0;
-        int sign1 = (E1[1] >= 0) ? 1 : 0;
-
-        // If both of the v coordinates have the same sign, then the edge definitely doesn't cross the positive u axis
-        if(sign0 == sign1) continue;
-
-        // If both the u coordinates is leq to 0, then the edge definitely doesn't cross the ray on the positive u axis
-        if(E0[0] <= 0 && E1[0] <= 0) continue;
-
-        // If both the u coordinates are greather than 0, then the edge definitely crosses the positive u axis
-        if(E0[0] > epsilon && E1[0] > epsilon) {
-          edge_crossings++;
-        }
-        else
-        {
-          // Otherwise the edge may or may not cross the positive u axis. We must calculate the intersection point
-          // We know that the v coordinate of the intersection point must be 0. We just have to check the u coordinate
-          // and see if it is greater than 0
-          double s = (-E0[1]) / (E1[1] - E0[1]);
-          double u = E0[0] + s * (E1[0] - E0[0]);
-          if(u > epsilon) edge_crossings++;
-        }
-      }
+  return intersected;
+}
 
+TriMesh::TriMesh(const std::vector<Point3D>& verts, const std::vector<Face>& faces, const MeshOptions& options)
+  : Mesh(Buffer<Point3D>(verts))
+  , m_edge_length(0.0)
+  , m_error(0.0)
+{
+  build(triangulate(faces), options);
+}
 
-      if(edge_crossings & 0x1)
-      {
-        // It is within the bounds of the polygon
-        intersected = true;
-        prev_t = t;
-        j.q = Q;
-        j.n = n;
-      }
+TriMesh::TriMesh(Buffer<Point3D> verts, Buffer<Vector3D> normals, Buffer<Point2D> uvs, const Buffer<unsigned int>& indices, const MeshOptions& options)
+  : Mesh(verts)
+  , m_normals(normals)
+  , m_uvs(uvs)
+  , m_edge_length(0.0)
+  , m_error(0.0)
+{
+  build(indices, options);
+}
+
+TriMesh::TriMesh(Buffer<Point3D> verts, Buffer<Vector3D> normals, Buffer<Point2D> uvs, Buffer<unsigned int> indices, BVH bvh, double edge_length, double error)
+  : Mesh(verts)
+  , m_normals(normals)
+  , m_uvs(uvs)
+  , m_indices(indices)
+  , m_bvh(bvh)
+  , m_edge_length(edge_length)
+  , m_error(error)
+{
+}
+
+TriMesh::TriMesh(Buffer<PackedVertex> packed, const Point3D& origin, const Vector3D& step, Buffer<Point2D> uvs, Buffer<unsigned int> indices, BVH bvh, double edge_length, double error)
+  : Mesh(Buffer<Point3D>())
+  , m_uvs(uvs)
+  , m_indices(indices)
+  , m_bvh(bvh)
+  , m_packed(packed)
+  , m_origin(origin)
+  , m_step(step)
+  , m_edge_length(edge_length)
+  , m_error(error)
+{
+}
+
+void TriMesh::build(const Buffer<unsigned int>& indices, const MeshOptions& options)
+{
+  std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+  auto stage = [&](const char* name) {
+    std::chrono::time_point<std::chrono::system_clock> now = std::chrono::system_clock::now();
+    m_stats.timings.push_back(std::make_pair(std::string(name), std::chrono::duration<double>(now - start).count()));
+    start = now;
+  };
+
+  // Only normals for every vertex can be used, otherwise they are generated
+  if(m_normals.size() != m_verts.size()) m_normals = Buffer<Vector3D>();
+  if(m_uvs.size() != m_verts.size()) m_uvs = Buffer<Point2D>();
+
+  Buffer<unsigned int> welded = indices;
+  if(options.weld)
+  {
+    welded = weld(indices);
+    stage("weld");
+  }
+
+  if(m_normals.empty())
+  {
+    m_normals = normalate(m_verts, welded);
+    stage("normals");
+  }
+
+  // The hierarchy is built around the decoded vertices so it bounds the triangles that are intersected
+  if(options.compress)
+  {
+    quantize();
+    stage("quantize");
+  }
+
+  build_hierarchy(welded);
+  stage("hierarchy");
+
+  if(options.reorder)
+  {
+    m_stats.cache_misses_before = cache_misses();
+    reorder_vertices();
+    m_stats.cache_misses_after = cache_misses();
+    stage("reorder");
+  }
+
+  if(options.lod)
+  {
+    build_levels(options);
+    stage("levels");
+  }
+
+  if(options.compress)
+  {
+    pack();
+    stage("pack");
+  }
+}
+
+namespace {
+
+// Side of the equilateral triangle with the mean area of the mesh's triangles
+double typical_edge_length(const Buffer<Point3D>& verts, const Buffer<unsigned int>& indices)
+{
+  size_t num_triangles = indices.size() / 3;
+  if(num_triangles == 0) return 0.0;
+
+  double area = 0.0;
+  for(size_t i = 0; i < indices.size(); i += 3)
+  {
+    const Point3D& A = verts[indices[i]];
+    area += 0.5 * (verts[indices[i+1]] - A).cross(verts[indices[i+2]] - A).length();
+  }
+  return std::sqrt(4.0 * area / (std::sqrt(3.0) * num_triangles));
+}
+
+}
+
+void TriMesh::build_levels(const MeshOptions& options)
+{
+  // Each level is simplified from the one before to a quarter of its triangles, about doubling the length of its
+  // edges, until it is too small to be worth it. Levels keep the normals and texture coordinates of the vertices
+  // that survive, which are those of the full mesh
+  const size_t MIN_TRIANGLES = 256;
+
+  MeshOptions level_options;
+  level_options.reorder = true;
+
+  m_edge_length = typical_edge_length(m_verts, m_indices);
+
+  std::vector<std::shared_ptr<TriMesh>> levels;
+  const TriMesh* previous = this;
+  double error = 0.0;
+  while(previous->num_triangles() / 4 >= MIN_TRIANGLES)
+  {
+    double level_error;
+    std::vector<unsigned int> indices = decimate(previous->m_verts, previous->m_indices, previous->num_triangles() / 4, level_error);
+
+    // Stop when the mesh can't be simplified much further
+    if(indices.size() > previous->m_indices.size() / 2) break;
+
+    std::shared_ptr<TriMesh> level = std::make_shared<TriMesh>(previous->m_verts, previous->m_normals, previous->m_uvs, std::move(indices), level_options);
+    error += level_error;
+    level->m_edge_length = typical_edge_length(level->m_verts, level->m_indices);
+    level->m_error = error;
+    levels.push_back(level);
+    previous = level.get();
+  }
+
+  for(auto& level : levels)
+  {
+    // The vertices of the levels are a subset of this mesh's so they are already on its grid
+    if(options.compress)
+    {
+      level->m_origin = m_origin;
+      level->m_step = m_step;
+      level->pack();
     }
+    m_levels.push_back(level);
   }
+}
 
-  return intersected;
+namespace {
+
+uint16_t quantize_unit(double c)
+{
+  // [-1, 1] to [0, 65535]
+  return (uint16_t)std::floor(std::min(std::max(c * 0.5 + 0.5, 0.0), 1.0) * 65535.0 + 0.5);
 }
 
-TriMesh::TriMesh(const std::vector<Point3D>& verts, const std::vector<Face>& faces)
-  : Mesh(verts, faces)
+double dequantize_unit(uint16_t q)
 {
-  m_tfaces = triangulate(m_faces);
-  m_normals = normalate(m_verts, m_faces);
-  
-  m_faces.clear();
-  m_faces.resize(0);
+  return q * (2.0 / 65535.0) - 1.0;
 }
 
-TriMesh::TriMesh(const std::vector<Point3D>& verts, const std::vector<Vector3D>& normals, const std::vector<TriFace>& tfaces)
-  : Mesh(verts, std::vector<Face>()) 
-  , m_normals(normals)
-  , m_tfaces(tfaces)
+void encode_normal(const Vector3D& n, uint16_t out[2])
+{
+  double l = fabs(n[0]) + fabs(n[1]) + fabs(n[2]);
+  if(l == 0.0)
+  {
+    out[0] = out[1] = quantize_unit(0.0);
+    return;
+  }
+
+  double x = n[0] / l, y = n[1] / l;
+  if(n[2] < 0.0)
+  {
+    double fx = (1.0 - fabs(y)) * (x >= 0.0 ? 1.0 : -1.0);
+    double fy = (1.0 - fabs(x)) * (y >= 0.0 ? 1.0 : -1.0);
+    x = fx;
+    y = fy;
+  }
+
+  out[0] = quantize_unit(x);
+  out[1] = quantize_unit(y);
+}
+
+Vector3D decode_normal(const uint16_t in[2])
 {
+  double x = dequantize_unit(in[0]), y = dequantize_unit(in[1]);
+  double z = 1.0 - fabs(x) - fabs(y);
+  if(z < 0.0)
+  {
+    double fx = (1.0 - fabs(y)) * (x >= 0.0 ? 1.0 : -1.0);
+    double fy = (1.0 - fabs(x)) * (y >= 0.0 ? 1.0 : -1.0);
+    x = fx;
+    y = fy;
+  }
+
+  Vector3D n(x, y, z);
+  n.normalize();
+  return n;
 }
 
-std::vector<TriMesh::TriFace> TriMesh::triangulate(const std::vector<Face>& faces) 
+uint16_t quantize_coordinate(double c, double origin, double step)
 {
-  // For each face, split the face up into triangles
-  std::vector<TriMesh::TriFace> tfaces;
-  for(auto face : faces)
+  if(step == 0.0) return 0;
+  return (uint16_t)std::floor(std::min(std::max((c - origin) / step, 0.0), 65535.0) + 0.5);
+}
+
+Point3D decode_position(const uint16_t in[3], const Point3D& origin, const Vector3D& step)
+{
+  return Point3D(origin[0] + in[0]*step[0], origin[1] + in[1]*step[1], origin[2] + in[2]*step[2]);
+}
+
+// Vertex fetch for the intersection kernel, either straight from the full precision buffers or decoded from the
+// packed vertices
+struct FullVertices {
+  const Point3D* verts;
+  const Vector3D* normals;
+
+  const Point3D& position(unsigned int i) const
   {
-    if(face.size() < 3) continue;
+    return verts[i];
+  }
+  const Vector3D& normal(unsigned int i) const
+  {
+    return normals[i];
+  }
+};
 
-    for(size_t i = 2; i < face.size(); i++)
+struct PackedVertices {
+  const TriMesh::PackedVertex* packed;
+  Point3D origin;
+  Vector3D step;
+
+  Point3D position(unsigned int i) const
+  {
+    return decode_position(packed[i].position, origin, step);
+  }
+  Vector3D normal(unsigned int i) const
+  {
+    return decode_normal(packed[i].normal);
+  }
+};
+
+}
+
+void TriMesh::quantize()
+{
+  // Snap the vertices and normals to the values they will have once packed
+  if(m_verts.empty()) return;
+
+  BoundingBox bounds;
+  for(auto& v : m_verts) bounds.extend(v);
+
+  m_origin = bounds.min();
+  Vector3D extent = bounds.max() - bounds.min();
+  m_step = Vector3D(extent[0] / 65535.0, extent[1] / 65535.0, extent[2] / 65535.0);
+
+  std::vector<Point3D> verts(m_verts.size());
+  std::vector<Vector3D> normals(m_verts.size());
+  parallel_for(verts.size(), [&](size_t first, size_t last) {
+    for(size_t i = first; i < last; i++)
     {
-      int i0 = face[0];
-      int i1 = face[i-1];
-      int i2 = face[i];
+      PackedVertex v;
+      for(int k = 0; k < 3; k++) v.position[k] = quantize_coordinate(m_verts[i][k], m_origin[k], m_step[k]);
+      encode_normal(m_normals[i], v.normal);
+      verts[i] = decode_position(v.position, m_origin, m_step);
+      normals[i] = decode_normal(v.normal);
+    }
+  });
 
-      // Assume the same index is used to index into the vertex position and vertex normal lists
-      TriMesh::TriFace tface;
-      tface.push_back(std::make_tuple(i0, i0));
-      tface.push_back(std::make_tuple(i1, i1));
-      tface.push_back(std::make_tuple(i2, i2));
+  m_verts = std::move(verts);
+  m_normals = std::move(normals);
+}
 
-      tfaces.push_back(tface);
+void TriMesh::pack()
+{
+  // The vertices are already on the grid, so this is exact
+  std::vector<PackedVertex> packed(m_verts.size());
+  parallel_for(packed.size(), [&](size_t first, size_t last) {
+    for(size_t i = first; i < last; i++)
+    {
+      for(int k = 0; k < 3; k++) packed[i].position[k] = quantize_coordinate(m_verts[i][k], m_origin[k], m_step[k]);
+      encode_normal(m_normals[i], packed[i].normal);
     }
+  });
+
+  m_packed = std::move(packed);
+  m_verts = Buffer<Point3D>();
+  m_normals = Buffer<Vector3D>();
+}
+
+void TriMesh::build_hierarchy(const Buffer<unsigned int>& indices)
+{
+  size_t num_triangles = indices.size() / 3;
+  std::vector<BoundingBox> bounds(num_triangles);
+  parallel_for(num_triangles, [&](size_t first, size_t last) {
+    for(size_t f = first; f < last; f++)
+    {
+      for(size_t i = 3*f; i < 3*f+3; i++) bounds[f].extend(m_verts[indices[i]]);
+    }
+  });
+
+  m_bvh = BVH(bounds);
+
+  // Store the triangles in the order the leaves reference them
+  std::vector<unsigned int> ordered(3*num_triangles);
+  for(size_t f = 0; f < num_triangles; f++)
+  {
+    unsigned int k = m_bvh.indices()[f];
+    for(size_t i = 0; i < 3; i++) ordered[3*f+i] = indices[3*k+i];
   }
 
-  return tfaces;
+  m_indices = std::move(ordered);
+  m_bvh = BVH(m_bvh.nodes());
 }
 
-std::vector<Vector3D> TriMesh::normalate(const std::vector<Point3D>& verts, const std::vector<Mesh::Face>& faces)
+void TriMesh::reorder_vertices()
 {
-  std::unordered_map<int, Vector3D> v_normals;
+  // The triangles are in the order the leaves of the hierarchy reference them, so triangles that are tested
+  // together are next to each other. Number the vertices in the order those triangles first use them so their
+  // vertices are next to each other as well. Vertices no triangle uses are dropped
+  const unsigned int NONE = ~0u;
+  std::vector<unsigned int> remap(m_verts.size(), NONE);
+  std::vector<unsigned int> order;
+  order.reserve(m_verts.size());
+  std::vector<unsigned int> indices(m_indices.size());
+  for(size_t i = 0; i < m_indices.size(); i++)
+  {
+    unsigned int v = m_indices[i];
+    if(remap[v] == NONE)
+    {
+      remap[v] = order.size();
+      order.push_back(v);
+    }
+    indices[i] = remap[v];
+  }
+
+  std::vector<Point3D> verts(order.size());
+  std::vector<Vector3D> normals(order.size());
+  std::vector<Point2D> uvs(m_uvs.empty() ? 0 : order.size());
+  parallel_for(order.size(), [&](size_t first, size_t last) {
+    for(size_t w = first; w < last; w++)
+    {
+      verts[w] = m_verts[order[w]];
+      normals[w] = m_normals[order[w]];
+      if(!uvs.empty()) uvs[w] = m_uvs[order[w]];
+    }
+  });
+
+  m_verts = std::move(verts);
+  m_normals = std::move(normals);
+  m_uvs = std::move(uvs);
+  m_indices = std::move(indices);
+}
+
+size_t TriMesh::cache_misses() const
+{
+  // A direct mapped cache of 512 lines of 64 bytes (a typical L1 data cache) reading the position of each corner
+  // of each triangle in storage order. A rough model of how well the layout suits the leaves of the hierarchy
+  const size_t LINE_SIZE = 64;
+  const size_t NUM_LINES = 512;
+  std::vector<size_t> tags(NUM_LINES, ~(size_t)0);
+
+  size_t misses = 0;
+  for(size_t i = 0; i < m_indices.size(); i++)
+  {
+    size_t line = (m_indices[i] * sizeof(Point3D)) / LINE_SIZE;
+    size_t& tag = tags[line % NUM_LINES];
+    if(tag != line)
+    {
+      tag = line;
+      misses++;
+    }
+  }
 
-  // Fill the map with a running sum of face normals for each vertex
-  int largest_key = 0;
-  for(auto face : faces) 
+  return misses;
+}
+
+std::vector<unsigned int> TriMesh::triangulate(const std::vector<Face>& faces) 
+{
+  // For each face, split the face up into triangles
+  std::vector<unsigned int> indices;
+  for(auto& face : faces)
   {
     if(face.size() < 3) continue;
 
-    // Compute the normal for the face
-    Point3D P0 = verts[face[0]];
-    Point3D P1 = verts[face[1]];
-    Point3D P2 = verts[face[2]];
+    for(size_t i = 2; i < face.size(); i++)
+    {
+      indices.push_back(face[0]);
+      indices.push_back(face[i-1]);
+      indices.push_back(face[i]);
+    }
+  }
 
-    Vector3D n = (P1-P0).cross(P2-P0);
+  return indices;
+}
+
+Buffer<unsigned int> TriMesh::weld(const Buffer<unsigned int>& indices)
+{
+  // Snap the positions to a grid with cells a millionth of the size of the mesh and hash the cells. Vertices in
+  // the same cell are the same vertex if their normals and texture coordinates (when there are any) match too
+  BoundingBox bounds;
+  for(auto& v : m_verts) bounds.extend(v);
+  double cell = 1e-6 * (bounds.max() - bounds.min()).length();
+  double inv_cell = (cell > 0.0) ? 1.0 / cell : 1.0;
+
+  struct Cell {
+    long long x, y, z;
+    bool operator==(const Cell& other) const
+    {
+      return x == other.x && y == other.y && z == other.z;
+    }
+  };
+  struct CellHash {
+    size_t operator()(const Cell& c) const
+    {
+      return (size_t)(c.x * 73856093LL) ^ (size_t)(c.y * 19349663LL) ^ (size_t)(c.z * 83492791LL);
+    }
+  };
+
+  auto same = [&](unsigned int a, unsigned int b) {
+    bool normals = m_normals.empty() || (m_normals[a] - m_normals[b]).length2() == 0.0;
+    bool uvs = m_uvs.empty() || (m_uvs[a][0] == m_uvs[b][0] && m_uvs[a][1] == m_uvs[b][1]);
+    return normals && uvs;
+  };
+
+  // Each cell heads a list of the distinct vertices in it
+  const unsigned int NONE = ~0u;
+  std::unordered_map<Cell, unsigned int, CellHash> cells;
+  cells.reserve(m_verts.size());
+  std::vector<unsigned int> kept, next, remap(m_verts.size());
+  for(size_t v = 0; v < m_verts.size(); v++)
+  {
+    const Point3D& p = m_verts[v];
+    Cell c = { llround((p[0] - bounds.min()[0]) * inv_cell), llround((p[1] - bounds.min()[1]) * inv_cell), llround((p[2] - bounds.min()[2]) * inv_cell) };
 
-    for(auto i : face) 
+    auto it = cells.find(c);
+    unsigned int w = (it != cells.end()) ? it->second : NONE;
+    while(w != NONE && !same(kept[w], v)) w = next[w];
+    if(w == NONE)
     {
-      v_normals[i] = v_normals[i] + n;
-      largest_key = std::max<int>(largest_key, i);
+      w = kept.size();
+      kept.push_back(v);
+      next.push_back((it != cells.end()) ? it->second : NONE);
+      cells[c] = w;
     }
+    remap[v] = w;
+  }
+
+  std::vector<Point3D> verts(kept.size());
+  std::vector<Vector3D> normals(m_normals.empty() ? 0 : kept.size());
+  std::vector<Point2D> uvs(m_uvs.empty() ? 0 : kept.size());
+  for(size_t w = 0; w < kept.size(); w++)
+  {
+    verts[w] = m_verts[kept[w]];
+    if(!normals.empty()) normals[w] = m_normals[kept[w]];
+    if(!uvs.empty()) uvs[w] = m_uvs[kept[w]];
   }
 
-  // For each vertex average the face normals by normalization to get the vertex normal
-  std::vector<Vector3D> normals;
-  normals.reserve(largest_key+1);
-  for(auto kv : v_normals) normals[kv.first] = kv.second.normalized(); 
+  std::vector<unsigned int> welded(indices.size());
+  for(size_t i = 0; i < indices.size(); i++) welded[i] = remap[indices[i]];
+
+  m_verts = std::move(verts);
+  m_normals = std::move(normals);
+  m_uvs = std::move(uvs);
+
+  return Buffer<unsigned int>(std::move(welded));
+}
+
+std::vector<Vector3D> TriMesh::normalate(const Buffer<Point3D>& verts, const Buffer<unsigned int>& indices)
+{
+  // The normal of each face. The cross product isn't normalized so larger faces have more of a say in the
+  // direction of the vertex normals
+  size_t num_triangles = indices.size() / 3;
+  std::vector<Vector3D> face_normals(num_triangles);
+  parallel_for(num_triangles, [&](size_t first, size_t last) {
+    for(size_t f = first; f < last; f++)
+    {
+      const Point3D& P0 = verts[indices[3*f]];
+      const Point3D& P1 = verts[indices[3*f+1]];
+      const Point3D& P2 = verts[indices[3*f+2]];
+      face_normals[f] = (P1-P0).cross(P2-P0);
+    }
+  });
+
+  // List the faces around each vertex, in face order, with a count of the faces of each vertex turned into offsets
+  // into one array by a prefix sum
+  std::vector<unsigned int> offsets(verts.size() + 1, 0);
+  for(size_t i = 0; i < 3*num_triangles; i++) offsets[indices[i]+1]++;
+  for(size_t v = 0; v < verts.size(); v++) offsets[v+1] += offsets[v];
+  std::vector<unsigned int> faces(3*num_triangles);
+  std::vector<unsigned int> next(offsets.begin(), offsets.end() - 1);
+  for(size_t i = 0; i < 3*num_triangles; i++) faces[next[indices[i]]++] = i/3;
+
+  // Sum the normals of the faces around each vertex and normalize the sum to get the vertex normal. Each thread
+  // owns a range of vertices and adds their faces in order, so the result doesn't depend on the number of threads
+  std::vector<Vector3D> normals(verts.size(), Vector3D(0.0, 0.0, 0.0));
+  parallel_for(verts.size(), [&](size_t first, size_t last) {
+    for(size_t v = first; v < last; v++)
+    {
+      for(unsigned int k = offsets[v]; k < offsets[v+1]; k++) normals[v] = normals[v] + face_normals[faces[k]];
+      if(normals[v].length2() > 0) normals[v].normalize();
+    }
+  });
 
   return normals;
 }
 
+BoundingBox TriMesh::bounds() const
+{
+  return m_bvh.bounds();
+}
+
 bool TriMesh::intersect(const Ray& ray, Intersection& intersection) const
 {
+  double tmax = std::numeric_limits<double>::infinity();
+  return intersect(ray, intersection, tmax);
+}
 
-  // Check if bounding ball has been intersected first
-  // If not then the mesh cannot have been intersected
-  Intersection k;
-  if(!m_boundingBall.intersect(ray, k)) return false;
+bool TriMesh::intersect(const Ray& ray, Intersection& intersection, double& tmax) const
+{
+  if(!m_levels.empty() && !m_bvh.empty() && (ray.width() > 0.0 || ray.spread() > 0.0))
+  {
+    // Size up the ray where it enters the mesh
+    Vector3D d = ray.direction();
+    Vector3D inv_dir(1.0 / d[0], 1.0 / d[1], 1.0 / d[2]);
+    double t0 = 0.0, t1 = tmax;
+    if(!m_bvh.bounds().intersect(ray.origin(), inv_dir, t0, t1)) return false;
+
+    double footprint = ray.footprint(t0);
+    const TriMesh* level = nullptr;
+    for(auto& l : m_levels)
+    {
+      if(l->m_edge_length > footprint) break;
+      level = l.get();
+    }
 
-  // Test intersection with each triangle
-  bool intersected = false;
-  double prev_t = std::numeric_limits<double>::infinity();
-  for(auto face : m_tfaces)
+    // A ray leaving the mesh may hit the simplified surface right away, so hits on it closer than the simplification
+    // error are ignored. Rays from anywhere else keep them, they may be real occluders
+    if(level) return level->intersect_level(ray, intersection, (ray.surface() == this) ? level->m_error : 0.0, tmax);
+  }
+
+  return intersect_level(ray, intersection, 0.0, tmax);
+}
+
+bool TriMesh::intersect_level(const Ray& ray, Intersection& intersection, double tmin, double& tmax) const
+{
+  if(m_packed.empty()) return intersect_vertices(ray, intersection, tmin, tmax, FullVertices{m_verts.data(), m_normals.data()});
+  return intersect_vertices(ray, intersection, tmin, tmax, PackedVertices{m_packed.data(), m_origin, m_step});
+}
+
+template<typename Vertices>
+bool TriMesh::intersect_vertices(const Ray& ray, Intersection& intersection, double tmin, double& tmax, const Vertices& vertices) const
+{
+  const unsigned int* indices = m_indices.data();
+
+  double hit_t = 0.0, hit_u = 0.0, hit_v = 0.0;
+  size_t hit_f = 0;
+
+  // Test intersection with each triangle in the leaves of the hierarchy hit by the ray
+  auto visit = [&](unsigned int first, unsigned int count, double& tmax) -> bool {
+    bool intersected = false;
+    for(size_t f = 3*first; f < 3*(first+count); f += 3)
+    {
+      Point3D A = vertices.position(indices[f]);
+      Point3D B = vertices.position(indices[f+1]);
+      Point3D C = vertices.position(indices[f+2]);
+
+      // Compute the intersection using Moller & Trumbore's algorithm and Cramer's rule
+      // The following variables are the expanded terms from the matrix form of the system
+      Vector3D E1 = B - A;
+      Vector3D E2 = C - A;
+      Vector3D D = ray.direction();
+
+      Vector3D P = D.cross(E2);
+
+      // If determinant is zero then the ray is parallel to the triangle
+      double det = P.dot(E1);
+      if(fabs(det) < std::numeric_limits<double>::epsilon()) continue;
+
+      // Calculate u, barycentric coordinate, and make sure it is within range of [0, 1]
+      Vector3D T = ray.origin() - A;
+      double u = P.dot(T);
+      if(u < 0 || u > det) continue;
+
+      // Calculate v, barycentric coordinate, and make sure it is within range. u + v must be less than 1!
+      Vector3D Q = T.cross(E1);
+      double v = Q.dot(D);
+      if(v < 0 || v > (det - u)) continue;
+
+      // Calculate t and make sure it is positive otherwise it is behind the ray's origin
+      // Also make sure that it is the closest intersection thus far
+      double _P_E1 = 1.0 / det;
+      double t = _P_E1 * Q.dot(E2);
+      if(t < tmin || t > tmax) continue;
+
+      // Alright! The ray intersects this triangle
+      intersected = true;
+      tmax = t;
+      hit_t = t;
+      hit_u = _P_E1 * u;
+      hit_v = _P_E1 * v;
+      hit_f = f;
+    }
+    return intersected;
+  };
+
+  if(!m_bvh.traverse(ray, tmax, visit)) return false;
+  tmax = hit_t;
+
+  // Interpolate the per vertex normals for the closest triangle
+  unsigned int i0 = m_indices[hit_f], i1 = m_indices[hit_f+1], i2 = m_indices[hit_f+2];
+  double u = hit_u, v = hit_v;
+  intersection.q = ray.origin() + hit_t * ray.direction();
+  intersection.n = (1-u-v)*vertices.normal(i0) + u*vertices.normal(i1) + v*vertices.normal(i2);
+
+  if(!m_uvs.empty())
   {
-    Point3D A = m_verts[std::get<0>(face[0])];
-    Point3D B = m_verts[std::get<0>(face[1])];
-    Point3D C = m_verts[std::get<0>(face[2])];
-
-    // Compute the intersection using Moller & Trumbore's algorithm and Cramer's rule
-    // The following variables are the expanded terms from the matrix form of the system
-    Vector3D E1 = B - A;
-    Vector3D E2 = C - A;
-    Vector3D D = ray.direction();
-
-    Vector3D P = D.cross(E2);
-
-    // If determinant is zero then the ray is parallel to the triangle
-    double det = P.dot(E1);
-    if(fabs(det) < std::numeric_limits<double>::epsilon()) continue;
-
-    // Calculate u, barycentric coordinate, and make sure it is within range of [0, 1]
-    Vector3D T = ray.origin() - A;
-    double u = P.dot(T);
-    if(u < 0 || u > det) continue;
-
-    // Calculate v, barycentric coordinate, and make sure it is within range. u + v must be less than 1!
-    Vector3D Q = T.cross(E1);
-    double v = Q.dot(D);
-    if(v < 0 || v > (det - u)) continue;
-
-    // Calculate t and make sure it is positive otherwise it is behind the ray's origin
-    // Also make sure that it is the closest intersection thus far
-    double _P_E1 = 1.0 / P.dot(E1);
-    double t = _P_E1 * Q.dot(E2);
-    if(t < 0 || t > prev_t) continue;
-
-    // Scale u and v
-    u = _P_E1 * u;
-    v = _P_E1 * v;
-
-    // Get the per vertex normals
-    Vector3D nA = m_normals[std::get<1>(face[0])];
-    Vector3D nB = m_normals[std::get<1>(face[1])];
-    Vector3D nC = m_normals[std::get<1>(face[2])];
-
-    // Alright! The ray intersects this triangle
-    intersected = true;
-    prev_t = t;
-    intersection.q = ray.origin() + t * ray.direction();
-    intersection.n = (1-u-v)*nA + u*nB + v*nC;
+    // Interpolate the texture coordinates and find the tangents along the u and v directions of the texture
+    const Point2D& t0 = m_uvs[i0];
+    const Point2D& t1 = m_uvs[i1];
+    const Point2D& t2 = m_uvs[i2];
+    intersection.u = (1-u-v)*t0[0] + u*t1[0] + v*t2[0];
+    intersection.v = (1-u-v)*t0[1] + u*t1[1] + v*t2[1];
+
+    Point3D P0 = vertices.position(i0);
+    Vector3D E1 = vertices.position(i1) - P0;
+    Vector3D E2 = vertices.position(i2) - P0;
+    double du1 = t1[0] - t0[0], dv1 = t1[1] - t0[1];
+    double du2 = t2[0] - t0[0], dv2 = t2[1] - t0[1];
+    double det = du1*dv2 - du2*dv1;
+    if(fabs(det) > std::numeric_limits<double>::epsilon())
+    {
+      intersection.pu = (1.0 / det) * (dv2*E1 - dv1*E2);
+      intersection.pv = (1.0 / det) * (du1*E2 - du2*E1);
+    }
   }
 
-  return intersected;
+  return true;
 }
 
 std::ostream& operator<<(std::ostream& out, const Mesh& mesh)
 {
   std::cerr << "mesh({";
-  for (std::vector<Point3D>::const_iterator I = mesh.m_verts.begin(); I != mesh.m_verts.end(); ++I) {
+  for (const Point3D* I = mesh.m_verts.begin(); I != mesh.m_verts.end(); ++I) {
     if (I != mesh.m_verts.begin()) std::cerr << ",\n      ";
     std::cerr << *I;
   }
@@ -306,6 +871,10 @@ std::ostream& operator<<(std::ostream& out, const Mesh& mesh)
     }
     std::cerr << "]";
   }
+  for (size_t f = 0; f < mesh.m_triangles.size(); f += 3) {
+    if (f != 0 || !mesh.m_faces.empty()) std::cerr << ",\n      ";
+    std::cerr << "[" << mesh.m_triangles[f] << ", " << mesh.m_triangles[f+1] << ", " << mesh.m_triangles[f+2] << "]";
+  }
   std::cerr << "});" << std::endl;
   return out;
 }
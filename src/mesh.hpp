@@ -2,46 +2,208 @@
 #define CS488_MESH_HPP
 
 #include <vector>
+#include <string>
+#include <cstdint>
 #include <utility>
+#include <memory>
 #include <iosfwd>
 #include "primitive.hpp"
 #include "algebra.hpp"
+#include "buffer.hpp"
+#include "bvh.hpp"
 
 // A polygonal mesh.
 class Mesh : public Primitive {
 public:
   typedef std::vector<int> Face;
   
-  Mesh(const std::vector<Point3D>& verts, const std::vector<Face>& faces);
+  Mesh(Buffer<Point3D> verts, std::vector<Face> faces);
+
+  // A mesh of triangles, three indices each, shares the index buffer rather than copying it into faces
+  Mesh(Buffer<Point3D> verts, Buffer<unsigned int> triangles);
 
   virtual bool intersect(const Ray& ray, Intersection& j) const;
+  virtual BoundingBox bounds() const;
   
 protected:
-  std::vector<Point3D> m_verts;
+  // For subclasses that have their own bounding volumes, the bounding ball is left empty
+  Mesh(Buffer<Point3D> verts);
+
+  Buffer<Point3D> m_verts;
   std::vector<Face> m_faces;
+  Buffer<unsigned int> m_triangles;
   NonhierSphere m_boundingBall;
 
-  NonhierSphere getBoundingBall(const std::vector<Point3D>& verts) const;
+  NonhierSphere getBoundingBall(const Buffer<Point3D>& verts) const;
 
   friend std::ostream& operator<<(std::ostream& out, const Mesh& mesh);
 };
 
-// A polygonal mesh with triangular faces and vertex normals
+// Optional processing of a triangle mesh as it is built
+struct MeshOptions {
+  MeshOptions()
+    : weld(false)
+    , reorder(true)
+    , compress(false)
+    , lod(false)
+  {
+  }
+
+  // Bit per option, meshes built with the same flags from the same data are the same
+  unsigned int flags() const
+  {
+    return (weld ? 1 : 0) | (reorder ? 2 : 0) | (compress ? 4 : 0) | (lod ? 8 : 0);
+  }
+
+  bool weld;     // Merge vertices at the same position (to within a millionth of the mesh's size) with the same attributes
+  bool reorder;  // Renumber the vertices in the order the triangles use them
+  bool compress; // Store quantized positions and normals, see TriMesh::PackedVertex
+  bool lod;      // Build simplified levels of detail for wide rays, see TriMesh::levels
+};
+
+// What happened while building a triangle mesh, for reporting
+struct MeshStats {
+  MeshStats()
+    : cache_misses_before(0)
+    , cache_misses_after(0)
+  {
+  }
+
+  std::vector< std::pair<std::string, double> > timings; // Seconds spent in each stage, in the order they ran
+
+  // Simulated cache misses reading the vertices of every triangle in order, before and after reordering
+  size_t cache_misses_before, cache_misses_after;
+};
+
+// A polygonal mesh with triangular faces and vertex normals. Positions, normals and texture coordinates
+// share a single index, every three consecutive entries of the index buffer form a triangle. The triangles
+// are stored in the leaf order of a bounding volume hierarchy over them
 class TriMesh : public Mesh {
 public:
-  typedef std::vector<std::tuple<int, int>> TriFace;
+  // A vertex in 10 bytes rather than the 48 of a Point3D and Vector3D. The position is quantized to 16 bits along each
+  // axis of the mesh's bounding box. The normal is octahedral encoded: projected onto the octahedron |x|+|y|+|z| = 1
+  // with the lower half folded over the upper half, leaving two coordinates in [-1, 1] quantized to 16 bits each
+  struct PackedVertex {
+    uint16_t position[3];
+    uint16_t normal[2];
+  };
+
+  // If normals is empty they are generated by averaging the normals of the faces around each vertex.
+  // uvs may be empty if the mesh has no texture coordinates
+  TriMesh(Buffer<Point3D> verts, Buffer<Vector3D> normals, Buffer<Point2D> uvs, const Buffer<unsigned int>& indices, const MeshOptions& options = MeshOptions());
+  TriMesh(const std::vector<Point3D>& verts, const std::vector<Face>& faces, const MeshOptions& options = MeshOptions()); 
 
-  TriMesh(const std::vector<Point3D>& verts, const std::vector<Vector3D>& normals, const std::vector<TriFace>& tfaces);
-  TriMesh(const std::vector<Point3D>& verts, const std::vector<Face>& faces); 
+  // Uses already processed geometry as is, e.g. from a mesh cache: there must be a normal per vertex and the
+  // leaves of the hierarchy must address the triangles directly
+  TriMesh(Buffer<Point3D> verts, Buffer<Vector3D> normals, Buffer<Point2D> uvs, Buffer<unsigned int> indices, BVH bvh, double edge_length = 0.0, double error = 0.0);
+  TriMesh(Buffer<PackedVertex> packed, const Point3D& origin, const Vector3D& step, Buffer<Point2D> uvs, Buffer<unsigned int> indices, BVH bvh, double edge_length = 0.0, double error = 0.0);
   
+  // Rays are intersected with the coarsest level of detail whose edges are no longer than the ray's footprint where
+  // it enters the mesh
   virtual bool intersect(const Ray& ray, Intersection& j) const;
+  virtual BoundingBox bounds() const;
+
+  // Finds the closest intersection nearer than tmax, lowering tmax to its distance along the ray
+  bool intersect(const Ray& ray, Intersection& j, double& tmax) const;
+
+  const Buffer<Point3D>& verts() const
+  {
+    return m_verts;
+  }
+  const Buffer<Vector3D>& normals() const
+  {
+    return m_normals;
+  }
+  // Quantized vertices of a compressed mesh, in which case verts() and normals() are empty. A quantized
+  // position p decodes to origin + p * step
+  const Buffer<PackedVertex>& packed() const
+  {
+    return m_packed;
+  }
+  const Point3D& packed_origin() const
+  {
+    return m_origin;
+  }
+  const Vector3D& packed_step() const
+  {
+    return m_step;
+  }
+  const Buffer<Point2D>& uvs() const
+  {
+    return m_uvs;
+  }
+  const Buffer<unsigned int>& indices() const
+  {
+    return m_indices;
+  }
+  const BVH& bvh() const
+  {
+    return m_bvh;
+  }
+
+  size_t num_vertices() const
+  {
+    return m_packed.empty() ? m_verts.size() : m_packed.size();
+  }
+  size_t num_triangles() const
+  {
+    return m_indices.size() / 3;
+  }
+
+  const MeshStats& stats() const
+  {
+    return m_stats;
+  }
+
+  // Simplified versions of the mesh, from finest to coarsest. Each has about a quarter of the triangles of the
+  // one before and its own levels are empty
+  const std::vector<std::shared_ptr<const TriMesh>>& levels() const
+  {
+    return m_levels;
+  }
+  void set_levels(std::vector<std::shared_ptr<const TriMesh>> levels)
+  {
+    m_levels = std::move(levels);
+  }
+
+  // Typical length of an edge, and a bound on the distance to the mesh a level was simplified from. Both are only
+  // known for meshes built with levels of detail
+  double edge_length() const
+  {
+    return m_edge_length;
+  }
+  double error() const
+  {
+    return m_error;
+  }
 
 protected:
-  std::vector<Vector3D> m_normals;
-  std::vector<TriFace> m_tfaces;
+  Buffer<Vector3D> m_normals;
+  Buffer<Point2D> m_uvs;
+  Buffer<unsigned int> m_indices;
+  BVH m_bvh;
+  Buffer<PackedVertex> m_packed;
+  Point3D m_origin;
+  Vector3D m_step;
+  double m_edge_length;
+  double m_error;
+  std::vector<std::shared_ptr<const TriMesh>> m_levels;
+  MeshStats m_stats;
+
+  void build(const Buffer<unsigned int>& indices, const MeshOptions& options);
+  std::vector<unsigned int> triangulate(const std::vector<Face>& faces);
+  Buffer<unsigned int> weld(const Buffer<unsigned int>& indices);
+  std::vector<Vector3D> normalate(const Buffer<Point3D>& verts, const Buffer<unsigned int>& indices);
+  void build_hierarchy(const Buffer<unsigned int>& indices);
+  void reorder_vertices();
+  void quantize();
+  void pack();
+  void build_levels(const MeshOptions& options);
+  size_t cache_misses() const;
 
-  std::vector<TriFace> triangulate(const std::vector<Face>& faces);
-  std::vector<Vector3D> normalate(const std::vector<Point3D>& verts, const std::vector<Face>& faces);
+  bool intersect_level(const Ray& ray, Intersection& j, double tmin, double& tmax) const;
+  template<typename Vertices>
+  bool intersect_vertices(const Ray& ray, Intersection& j, double tmin, double& tmax, const Vertices& vertices) const;
 };
 
 #endif
@@ -0,0 +1,259 @@
+#include "meshcache.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+namespace {
+
+const char MAGIC[8] = { 'R', 'T', 'M', 'E', 'S', 'H', 0, 0 };
+const uint32_t VERSION = 3;
+const uint64_t ALIGNMENT = 64;
+
+enum Section {
+  VERTS,
+  NORMALS,
+  UVS,
+  INDICES,
+  NODES,
+  PACKED,
+  NUM_SECTIONS
+};
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t element_size[NUM_SECTIONS]; // Guards against a build with a different struct layout reading the file
+  uint32_t reserved;
+  uint64_t key;
+  double origin[3]; // Decoding of the packed vertices of a compressed mesh
+  double step[3];
+  double edge_length; // Of a level of detail
+  double error;
+  uint64_t count[NUM_SECTIONS];
+  uint64_t offset[NUM_SECTIONS];
+};
+
+const uint32_t ELEMENT_SIZE[NUM_SECTIONS] = {
+  sizeof(Point3D), sizeof(Vector3D), sizeof(Point2D), sizeof(unsigned int), sizeof(BVH::Node), sizeof(TriMesh::PackedVertex)
+};
+
+uint64_t align(uint64_t offset)
+{
+  return (offset + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+}
+
+}
+
+uint64_t mesh_cache_hash(const char* data, size_t size)
+{
+  // Four independent lanes of 64 bit multiply/rotate mixing so the loop isn't bound by the latency of one chain,
+  // then the lanes and the tail are folded together
+  const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+  const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+  auto round = [&](uint64_t h, uint64_t w) {
+    h += w * PRIME2;
+    h = (h << 31) | (h >> 33);
+    return h * PRIME1;
+  };
+
+  uint64_t lanes[4] = { PRIME1 + PRIME2, PRIME2, 0, (uint64_t)0 - PRIME1 };
+  size_t i = 0;
+  for(; i + 32 <= size; i += 32)
+  {
+    uint64_t w[4];
+    memcpy(w, data + i, sizeof(w));
+    for(int k = 0; k < 4; k++) lanes[k] = round(lanes[k], w[k]);
+  }
+
+  uint64_t h = size * PRIME1;
+  for(int k = 0; k < 4; k++) h = round(h ^ lanes[k], (uint64_t)k);
+  for(; i < size; i++) h = round(h, (unsigned char)data[i]);
+
+  h ^= h >> 33;
+  h *= PRIME2;
+  h ^= h >> 29;
+  return h;
+}
+
+std::string mesh_cache_path(const std::string& directory, uint64_t key)
+{
+  std::ostringstream path;
+  path << directory << "/" << std::hex << std::setw(16) << std::setfill('0') << key << ".mesh";
+  return path.str();
+}
+
+bool write_mesh_image(std::ostream& out, const TriMesh& mesh, uint64_t key)
+{
+  const void* data[NUM_SECTIONS] = {
+    mesh.verts().data(), mesh.normals().data(), mesh.uvs().data(), mesh.indices().data(), mesh.bvh().nodes().data(),
+    mesh.packed().data()
+  };
+
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.header_size = sizeof(Header);
+  header.key = key;
+  header.count[VERTS] = mesh.verts().size();
+  header.count[NORMALS] = mesh.normals().size();
+  header.count[UVS] = mesh.uvs().size();
+  header.count[INDICES] = mesh.indices().size();
+  header.count[NODES] = mesh.bvh().nodes().size();
+  header.count[PACKED] = mesh.packed().size();
+  for(int k = 0; k < 3; k++)
+  {
+    header.origin[k] = mesh.packed_origin()[k];
+    header.step[k] = mesh.packed_step()[k];
+  }
+  header.edge_length = mesh.edge_length();
+  header.error = mesh.error();
+
+  uint64_t offset = align(sizeof(Header));
+  for(int s = 0; s < NUM_SECTIONS; s++)
+  {
+    header.element_size[s] = ELEMENT_SIZE[s];
+    header.offset[s] = offset;
+    offset = align(offset + header.count[s] * ELEMENT_SIZE[s]);
+  }
+
+  static const char padding[ALIGNMENT] = {0};
+  out.write((const char*)&header, sizeof(Header));
+  uint64_t position = sizeof(Header);
+  for(int s = 0; s < NUM_SECTIONS; s++)
+  {
+    out.write(padding, header.offset[s] - position);
+    out.write((const char*)data[s], header.count[s] * ELEMENT_SIZE[s]);
+    position = header.offset[s] + header.count[s] * ELEMENT_SIZE[s];
+  }
+
+  // Pad the end as well so images can be written back to back
+  out.write(padding, offset - position);
+  return (bool)out;
+}
+
+std::shared_ptr<TriMesh> read_mesh_image(const char* base, size_t size, std::shared_ptr<const void> owner, uint64_t key, size_t* image_size)
+{
+  if(size < sizeof(Header)) return nullptr;
+
+  const Header& header = *(const Header*)base;
+  if(memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION || header.header_size != sizeof(Header) || header.key != key)
+  {
+    return nullptr;
+  }
+
+  uint64_t end = align(sizeof(Header));
+  for(int s = 0; s < NUM_SECTIONS; s++)
+  {
+    if(header.element_size[s] != ELEMENT_SIZE[s] || header.offset[s] % ALIGNMENT != 0 || header.offset[s] > size ||
+       header.count[s] > (size - header.offset[s]) / ELEMENT_SIZE[s])
+    {
+      return nullptr;
+    }
+    end = std::max(end, align(header.offset[s] + header.count[s] * ELEMENT_SIZE[s]));
+  }
+  if(image_size) *image_size = std::min<uint64_t>(end, size);
+
+  // Either full precision vertices and normals or packed vertices
+  bool packed = header.count[PACKED] != 0;
+  uint64_t num_verts = packed ? header.count[PACKED] : header.count[VERTS];
+  if((packed && (header.count[VERTS] != 0 || header.count[NORMALS] != 0)) || header.count[NORMALS] != header.count[VERTS] || (header.count[UVS] != 0 && header.count[UVS] != num_verts) ||
+     header.count[INDICES] % 3 != 0 || (header.count[NODES] == 0) != (header.count[INDICES] == 0))
+  {
+    return nullptr;
+  }
+
+  Buffer<Point3D> verts((const Point3D*)(base + header.offset[VERTS]), header.count[VERTS], owner);
+  Buffer<Vector3D> normals((const Vector3D*)(base + header.offset[NORMALS]), header.count[NORMALS], owner);
+  Buffer<Point2D> uvs((const Point2D*)(base + header.offset[UVS]), header.count[UVS], owner);
+  Buffer<unsigned int> indices((const unsigned int*)(base + header.offset[INDICES]), header.count[INDICES], owner);
+  Buffer<BVH::Node> nodes((const BVH::Node*)(base + header.offset[NODES]), header.count[NODES], owner);
+
+  // A damaged or stale file can have the right sizes and still point outside the arrays, which would only show up as
+  // reads out of bounds while rendering. So every index and every node is checked once here
+  BVH bvh(nodes);
+  if(!bvh.valid(header.count[INDICES] / 3)) return nullptr;
+  for(size_t i = 0; i < indices.size(); i++)
+  {
+    if(indices[i] >= num_verts) return nullptr;
+  }
+
+  if(packed)
+  {
+    Buffer<TriMesh::PackedVertex> vertices((const TriMesh::PackedVertex*)(base + header.offset[PACKED]), num_verts, owner);
+    Point3D origin(header.origin[0], header.origin[1], header.origin[2]);
+    Vector3D step(header.step[0], header.step[1], header.step[2]);
+    return std::make_shared<TriMesh>(vertices, origin, step, uvs, indices, bvh, header.edge_length, header.error);
+  }
+
+  return std::make_shared<TriMesh>(verts, normals, uvs, indices, bvh, header.edge_length, header.error);
+}
+
+bool save_mesh_cache(const std::string& filename, const TriMesh& mesh, uint64_t key)
+{
+  std::ostringstream tmp;
+  tmp << filename << ".tmp." << getpid();
+
+  std::ofstream out(tmp.str().c_str(), std::ios::binary);
+  if(!out) return false;
+
+  // The levels of detail follow the mesh
+  write_mesh_image(out, mesh, key);
+  for(auto& level : mesh.levels()) write_mesh_image(out, *level, key);
+  out.close();
+
+  if(!out || rename(tmp.str().c_str(), filename.c_str()) != 0)
+  {
+    remove(tmp.str().c_str());
+    return false;
+  }
+
+  return true;
+}
+
+std::shared_ptr<TriMesh> load_mesh_cache(const std::string& filename, uint64_t key)
+{
+  int fd = open(filename.c_str(), O_RDONLY);
+  if(fd < 0) return nullptr;
+
+  struct stat st;
+  if(fstat(fd, &st) != 0 || st.st_size == 0)
+  {
+    close(fd);
+    return nullptr;
+  }
+
+  // A shared mapping so every process using the file is backed by the same pages
+  size_t size = st.st_size;
+  void* map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) return nullptr;
+
+  std::shared_ptr<const void> owner(map, [size](const void* p) { munmap(const_cast<void*>(p), size); });
+
+  const char* base = (const char*)map;
+  size_t offset = 0;
+  std::shared_ptr<TriMesh> mesh = read_mesh_image(base, size, owner, key, &offset);
+  if(!mesh) return nullptr;
+
+  std::vector<std::shared_ptr<const TriMesh>> levels;
+  while(offset < size)
+  {
+    size_t level_size = 0;
+    std::shared_ptr<TriMesh> level = read_mesh_image(base + offset, size - offset, owner, key, &level_size);
+    if(!level) return nullptr;
+    levels.push_back(level);
+    offset += level_size;
+  }
+  mesh->set_levels(std::move(levels));
+
+  return mesh;
+}
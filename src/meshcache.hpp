@@ -0,0 +1,40 @@
+#ifndef CS488_MESHCACHE_HPP
+#define CS488_MESHCACHE_HPP
+
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <iosfwd>
+#include "mesh.hpp"
+
+// Binary cache of processed triangle meshes. A cache file holds the vertex positions and normals (or the packed
+// vertices of a compressed mesh), texture coordinates, index buffer and hierarchy of a TriMesh exactly as they are
+// laid out in memory, each section aligned to 64 bytes behind a small header, followed by its levels of detail. Loading maps the file and the mesh uses
+// the mapped sections directly, so nothing is parsed or copied and processes rendering the same asset share the pages.
+//
+// Files are keyed by a hash of the source they were made from and carry a format version, a file that doesn't match
+// both is ignored. The format depends on the layout of doubles and structs so caches are not portable across machines.
+
+// Hash of a block of memory, used as the key of the file made from it
+uint64_t mesh_cache_hash(const char* data, size_t size);
+
+// Path of the cache file for the given key in a cache directory
+std::string mesh_cache_path(const std::string& directory, uint64_t key);
+
+// Writes the mesh to a cache file. The file is written under a temporary name and renamed into place so readers
+// never see a partial file. Returns false if the file can't be written
+bool save_mesh_cache(const std::string& filename, const TriMesh& mesh, uint64_t key);
+
+// Writes the image of a mesh held by a cache file to a stream. Its size is a multiple of 64 bytes
+bool write_mesh_image(std::ostream& out, const TriMesh& mesh, uint64_t key);
+
+// Makes a mesh that uses the image of a mesh in memory directly, the memory is kept alive by owner. It must be at
+// least 16 byte aligned. Returns nullptr if the image is invalid or has a different key, otherwise sets image_size (if
+// given) to the size of the image so images stored back to back can be walked
+std::shared_ptr<TriMesh> read_mesh_image(const char* data, size_t size, std::shared_ptr<const void> owner, uint64_t key, size_t* image_size = nullptr);
+
+// Maps a cache file. Returns nullptr if it doesn't exist, is from another version of the format or was made from
+// a different source
+std::shared_ptr<TriMesh> load_mesh_cache(const std::string& filename, uint64_t key);
+
+#endif
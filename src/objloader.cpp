@@ -0,0 +1,763 @@
+#include "objloader.hpp"
+#include "meshcache.hpp"
+#include "pagedmesh.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <sstream>
+#include <algorithm>
+
+namespace {
+
+// A corner of a face. Indices are 0 based or -1 when not given
+struct ObjCorner {
+  long v, t, n;
+};
+
+// Everything parsed from one chunk of the file. OBJ indices may be negative, meaning relative to the end of the
+// list parsed so far. Those are stored relative to the start of the chunk and flagged, to be resolved once the
+// number of elements in the chunks before this one is known
+struct ObjChunk {
+  std::vector<Point3D> verts;
+  std::vector<Vector3D> normals;
+  std::vector<Point2D> uvs;
+  std::vector<ObjCorner> corners; // Three per triangle
+  std::vector<unsigned char> relative; // Per corner: 1 if v is relative, 2 if t is, 4 if n is
+  bool error;
+};
+
+inline const char* skip_space(const char* p, const char* end)
+{
+  while(p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+  return p;
+}
+
+inline const char* skip_line(const char* p, const char* end)
+{
+  while(p < end && *p != '\n') p++;
+  return (p < end) ? p+1 : p;
+}
+
+inline bool is_space(const char* p, const char* end)
+{
+  return p < end && (*p == ' ' || *p == '\t');
+}
+
+// Parses a floating point number. This is a lot quicker than strtod for the short numbers OBJ files are made of, and
+// gives the same results: a mantissa below 2^53 and a power of ten up to 1e22 are both exact doubles, so one
+// multiplication or division rounds correctly (Clinger's fast path). Anything else is handed to strtod. Returns nullptr
+// if there is no number
+const char* parse_double(const char* p, const char* end, double& value)
+{
+  static const double powers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+
+  p = skip_space(p, end);
+  const char* start = p;
+
+  bool negative = false;
+  if(p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+
+  // Keep up to 19 significant digits in the mantissa, the rest only affect the exponent
+  unsigned long long mantissa = 0;
+  int exponent = 0, digits = 0;
+  bool any = false;
+  for(; p < end && *p >= '0' && *p <= '9'; p++, any = true)
+  {
+    if(digits < 19)
+    {
+      mantissa = mantissa*10 + (*p - '0');
+      if(mantissa != 0) digits++;
+    }
+    else exponent++;
+  }
+  if(p < end && *p == '.')
+  {
+    for(p++; p < end && *p >= '0' && *p <= '9'; p++, any = true)
+    {
+      if(digits < 19)
+      {
+        mantissa = mantissa*10 + (*p - '0');
+        if(mantissa != 0) digits++;
+        exponent--;
+      }
+    }
+  }
+  if(!any) return nullptr;
+
+  if(p < end && (*p == 'e' || *p == 'E'))
+  {
+    p++;
+    bool negative_exponent = false;
+    if(p < end && (*p == '-' || *p == '+')) negative_exponent = (*p++ == '-');
+    int e = 0;
+    for(; p < end && *p >= '0' && *p <= '9'; p++) e = std::min(e*10 + (*p - '0'), 10000);
+    exponent += negative_exponent ? -e : e;
+  }
+
+  if(digits < 19 && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22)
+  {
+    value = (double)mantissa;
+    if(exponent < 0) value /= powers[-exponent];
+    else value *= powers[exponent];
+    if(negative) value = -value;
+    return p;
+  }
+
+  std::string number(start, p);
+  value = strtod(number.c_str(), nullptr);
+  return p;
+}
+
+const char* parse_index(const char* p, const char* end, long& value)
+{
+  bool negative = false;
+  if(p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+  if(p >= end || *p < '0' || *p > '9') return nullptr;
+
+  value = 0;
+  for(; p < end && *p >= '0' && *p <= '9'; p++) value = value*10 + (*p - '0');
+  if(negative) value = -value;
+
+  return p;
+}
+
+// OBJ indices start at 1, negative indices count back from the most recent element
+inline bool resolve_index(long index, size_t count, long& out, unsigned char& relative, unsigned char flag)
+{
+  if(index > 0) out = index - 1;
+  else if(index < 0)
+  {
+    out = (long)count + index;
+    relative |= flag;
+  }
+  else return false;
+  return true;
+}
+
+void parse_chunk(const char* p, const char* end, ObjChunk& chunk)
+{
+  std::vector<ObjCorner> polygon;
+  std::vector<unsigned char> polygon_relative;
+
+  chunk.error = false;
+  for(; p < end; p = skip_line(p, end))
+  {
+    p = skip_space(p, end);
+    if(p+1 >= end || p[0] == '#') continue;
+
+    if(p[0] == 'v' && is_space(p+1, end))
+    {
+      Point3D v;
+      for(int i = 0; i < 3 && p; i++) p = parse_double(p+(i == 0), end, v[i]);
+      if(!p) break;
+      chunk.verts.push_back(v);
+    }
+    else if(p[0] == 'v' && p[1] == 'n' && is_space(p+2, end))
+    {
+      Vector3D n;
+      p += 2;
+      for(int i = 0; i < 3 && p; i++) p = parse_double(p, end, n[i]);
+      if(!p) break;
+      chunk.normals.push_back(n);
+    }
+    else if(p[0] == 'v' && p[1] == 't' && is_space(p+2, end))
+    {
+      // The v coordinate is optional. Images are stored top row first so flip it to match the rest of the ray tracer
+      double u, v = 0.0;
+      p = parse_double(p+2, end, u);
+      if(!p) break;
+      const char* q = parse_double(p, end, v);
+      if(q) p = q;
+      chunk.uvs.push_back(Point2D(u, 1.0 - v));
+    }
+    else if(p[0] == 'f' && is_space(p+1, end))
+    {
+      // Each corner is v, v/t, v//n or v/t/n
+      polygon.clear();
+      polygon_relative.clear();
+      for(p = skip_space(p+1, end); p && p < end && *p != '\n' && *p != '#'; p = p ? skip_space(p, end) : p)
+      {
+        ObjCorner c = { -1, -1, -1 };
+        unsigned char relative = 0;
+        long index;
+
+        p = parse_index(p, end, index);
+        if(!p || !resolve_index(index, chunk.verts.size(), c.v, relative, 1)) p = nullptr;
+        if(p && p < end && *p == '/')
+        {
+          p++;
+          if(p < end && *p != '/')
+          {
+            p = parse_index(p, end, index);
+            if(!p || !resolve_index(index, chunk.uvs.size(), c.t, relative, 2)) p = nullptr;
+          }
+          if(p && p < end && *p == '/')
+          {
+            p = parse_index(p+1, end, index);
+            if(!p || !resolve_index(index, chunk.normals.size(), c.n, relative, 4)) p = nullptr;
+          }
+        }
+        if(!p) break;
+
+        polygon.push_back(c);
+        polygon_relative.push_back(relative);
+      }
+      if(!p || polygon.size() < 3) break;
+
+      for(size_t i = 2; i < polygon.size(); i++)
+      {
+        size_t fan[3] = { 0, i-1, i };
+        for(size_t k : fan)
+        {
+          chunk.corners.push_back(polygon[k]);
+          chunk.relative.push_back(polygon_relative[k]);
+        }
+      }
+    }
+  }
+
+  // Parsing stopped early on a malformed line
+  chunk.error = (p == nullptr || p < end);
+}
+
+// Parses [data, end) split into one chunk per thread, with each chunk ending at a line boundary. Small amounts of text
+// aren't worth splitting
+void parse_chunks(const char* data, const char* end, std::vector<ObjChunk>& chunks)
+{
+  size_t size = end - data;
+  unsigned int num_chunks = std::max(1u, std::min(std::thread::hardware_concurrency(), (unsigned int)(size >> 20) + 1));
+
+  std::vector<const char*> bounds(num_chunks+1);
+  bounds[0] = data;
+  bounds[num_chunks] = end;
+  for(unsigned int i = 1; i < num_chunks; i++)
+  {
+    const char* p = std::max(data + size / num_chunks * i, bounds[i-1]);
+    bounds[i] = skip_line(p, end);
+  }
+
+  chunks.assign(num_chunks, ObjChunk());
+  std::vector<std::thread> threads;
+  for(unsigned int i = 1; i < num_chunks; i++) threads.push_back(std::thread(parse_chunk, bounds[i], bounds[i+1], std::ref(chunks[i])));
+  parse_chunk(bounds[0], bounds[1], chunks[0]);
+  for(auto& thread : threads) thread.join();
+}
+
+// The options change the mesh that is built so they are part of the key
+uint64_t cache_key(const char* data, size_t size, const MeshOptions& options)
+{
+  return mesh_cache_hash(data, size) ^ (options.flags() * 0x9E3779B97F4A7C15ULL);
+}
+
+// An array of T in a temporary file, which is unlinked as soon as it is made so it goes away however the process
+// ends. It is appended to while it is written, then mapped so the OS pages it in and out instead of it taking up memory
+template<typename T>
+class TempArray {
+public:
+  explicit TempArray(const std::string& filename)
+    : m_fd(open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600))
+    , m_size(0)
+    , m_data(nullptr)
+  {
+    if(m_fd >= 0) unlink(filename.c_str());
+  }
+  ~TempArray()
+  {
+    if(m_data) munmap(m_data, m_size * sizeof(T));
+    if(m_fd >= 0) close(m_fd);
+  }
+
+  bool valid() const
+  {
+    return m_fd >= 0;
+  }
+  size_t size() const
+  {
+    return m_size;
+  }
+
+  bool append(const std::vector<T>& elements)
+  {
+    const char* p = (const char*)elements.data();
+    size_t bytes = elements.size() * sizeof(T);
+    while(bytes > 0)
+    {
+      ssize_t n = write(m_fd, p, bytes);
+      if(n <= 0) return false;
+      p += n;
+      bytes -= n;
+    }
+    m_size += elements.size();
+    return true;
+  }
+
+  // Grows the array with zeroed elements
+  bool resize(size_t size)
+  {
+    if(ftruncate(m_fd, size * sizeof(T)) != 0) return false;
+    m_size = size;
+    return true;
+  }
+
+  // Maps the elements for reading and writing, nothing can be appended afterwards
+  bool map()
+  {
+    if(m_size == 0) return true;
+    void* data = mmap(nullptr, m_size * sizeof(T), PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if(data == MAP_FAILED) return false;
+    m_data = (T*)data;
+    return true;
+  }
+
+  T& operator[](size_t i)
+  {
+    return m_data[i];
+  }
+
+private:
+  TempArray(const TempArray&);
+  TempArray& operator=(const TempArray&);
+
+  int m_fd;
+  size_t m_size;
+  T* m_data;
+};
+
+// Interleaves the bits of the cell coordinates so cells close together in space are mostly close together in the order
+unsigned int morton(unsigned int x, unsigned int y, unsigned int z, unsigned int bits)
+{
+  unsigned int code = 0;
+  for(unsigned int b = 0; b < bits; b++) code |= (((x >> b) & 1) << (3*b)) | (((y >> b) & 1) << (3*b+1)) | (((z >> b) & 1) << (3*b+2));
+  return code;
+}
+
+// Writes the paged mesh of an OBJ file without the mesh ever being in memory at once. The file is parsed a block at a
+// time into temporary files of positions, normals, texture coordinates and triangles in the cache directory. The
+// triangles are then binned by their centroids into a grid of cells, on disk in Morton order, and runs of cells are
+// built into clusters of at most cluster_size triangles with their own hierarchies. Generated normals are summed
+// around each position over the whole mesh first so they match where clusters meet
+bool build_paged_obj(const char* data, size_t size, const std::string& filename, const std::string& directory, const std::string& paged_filename, uint64_t key, const MeshOptions& options, unsigned int cluster_size = 4096)
+{
+  std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+
+  std::ostringstream prefix;
+  prefix << directory << "/build." << getpid();
+  TempArray<Point3D> positions(prefix.str() + ".v");
+  TempArray<Vector3D> normals(prefix.str() + ".vn");
+  TempArray<Point2D> uvs(prefix.str() + ".vt");
+  TempArray<ObjCorner> corners(prefix.str() + ".f");
+  TempArray<Vector3D> position_normals(prefix.str() + ".n");
+  TempArray<ObjCorner> binned(prefix.str() + ".bins");
+  if(!positions.valid() || !normals.valid() || !uvs.valid() || !corners.valid() || !position_normals.valid() || !binned.valid())
+  {
+    std::cerr << "Error: Could not make temporary files in " << directory << std::endl;
+    return false;
+  }
+
+  // Relative indices are resolved as each chunk is written, as load_obj does
+  const size_t BLOCK = 64 << 20;
+  const char* end = data + size;
+  for(const char* p = data; p < end;)
+  {
+    const char* q = ((size_t)(end - p) > BLOCK) ? skip_line(p + BLOCK, end) : end;
+    std::vector<ObjChunk> chunks;
+    parse_chunks(p, q, chunks);
+    for(auto& chunk : chunks)
+    {
+      if(chunk.error)
+      {
+        std::cerr << "Error: Malformed line in " << filename << std::endl;
+        return false;
+      }
+
+      for(size_t i = 0; i < chunk.corners.size(); i++)
+      {
+        ObjCorner& c = chunk.corners[i];
+        if(chunk.relative[i] & 1) c.v += positions.size();
+        if(chunk.relative[i] & 2) c.t += uvs.size();
+        if(chunk.relative[i] & 4) c.n += normals.size();
+      }
+
+      if(!corners.append(chunk.corners) || !positions.append(chunk.verts) || !normals.append(chunk.normals) || !uvs.append(chunk.uvs))
+      {
+        std::cerr << "Error: Could not write temporary files in " << directory << std::endl;
+        return false;
+      }
+    }
+    p = q;
+  }
+
+  if(!positions.map() || !normals.map() || !uvs.map() || !corners.map())
+  {
+    std::cerr << "Error: Could not map temporary files in " << directory << std::endl;
+    return false;
+  }
+
+  size_t num_triangles = corners.size() / 3;
+  bool has_t = false, has_n = true;
+  for(size_t i = 0; i < corners.size(); i++)
+  {
+    const ObjCorner& c = corners[i];
+    if(c.v < 0 || c.v >= (long)positions.size() || c.t >= (long)uvs.size() || c.n >= (long)normals.size() || c.t < -1 || c.n < -1)
+    {
+      std::cerr << "Error: Face references a missing vertex in " << filename << std::endl;
+      return false;
+    }
+    has_t = has_t || c.t >= 0;
+    has_n = has_n && c.n >= 0;
+  }
+
+  // Normals are generated from the faces unless every corner has one. The cross product isn't normalized so larger
+  // faces have more of a say
+  if(!has_n)
+  {
+    if(!position_normals.resize(positions.size()) || !position_normals.map())
+    {
+      std::cerr << "Error: Could not write temporary files in " << directory << std::endl;
+      return false;
+    }
+    for(size_t t = 0; t < num_triangles; t++)
+    {
+      const Point3D& P0 = positions[corners[3*t].v];
+      Vector3D n = (positions[corners[3*t+1].v] - P0).cross(positions[corners[3*t+2].v] - P0);
+      for(size_t k = 0; k < 3; k++) position_normals[corners[3*t+k].v] = position_normals[corners[3*t+k].v] + n;
+    }
+    for(size_t v = 0; v < positions.size(); v++) if(position_normals[v].length2() > 0) position_normals[v].normalize();
+  }
+
+  // A grid fine enough for a few cells per cluster, up to 128 cells a side
+  auto centroid = [&](size_t t) {
+    const Point3D& A = positions[corners[3*t].v];
+    const Point3D& B = positions[corners[3*t+1].v];
+    const Point3D& C = positions[corners[3*t+2].v];
+    return Point3D((A[0]+B[0]+C[0]) / 3.0, (A[1]+B[1]+C[1]) / 3.0, (A[2]+B[2]+C[2]) / 3.0);
+  };
+  BoundingBox box;
+  for(size_t t = 0; t < num_triangles; t++) box.extend(centroid(t));
+
+  unsigned int bits = 0;
+  while(bits < 7 && ((uint64_t)1 << (3*bits)) * cluster_size < 4 * (uint64_t)num_triangles) bits++;
+  unsigned int cells = 1u << bits;
+  auto cell = [&](size_t t) {
+    Point3D c = centroid(t);
+    unsigned int xyz[3];
+    for(int a = 0; a < 3; a++)
+    {
+      double extent = box.max()[a] - box.min()[a];
+      double x = (extent > 0.0) ? (c[a] - box.min()[a]) / extent * cells : 0.0;
+      xyz[a] = std::min((unsigned int)std::max(x, 0.0), cells - 1);
+    }
+    return morton(xyz[0], xyz[1], xyz[2], bits);
+  };
+
+  // Counting sort of the triangles by cell into the binned file
+  std::vector<uint64_t> offsets(((size_t)1 << (3*bits)) + 1, 0);
+  for(size_t t = 0; t < num_triangles; t++) offsets[cell(t)+1]++;
+  for(size_t c = 1; c < offsets.size(); c++) offsets[c] += offsets[c-1];
+
+  if(!binned.resize(3*num_triangles) || !binned.map())
+  {
+    std::cerr << "Error: Could not write temporary files in " << directory << std::endl;
+    return false;
+  }
+  std::vector<uint64_t> next(offsets.begin(), offsets.end() - 1);
+  for(size_t t = 0; t < num_triangles; t++)
+  {
+    uint64_t slot = next[cell(t)]++;
+    for(size_t k = 0; k < 3; k++) binned[3*slot+k] = corners[3*t+k];
+  }
+
+  // Levels of detail aren't paged
+  MeshOptions cluster_options = options;
+  cluster_options.lod = false;
+
+  PagedMeshWriter writer(paged_filename, key);
+  auto write_cluster = [&](size_t first, size_t last) {
+    // Corners using the same position, normal and texture coordinates are the same vertex. Sorting the corners puts
+    // them next to each other
+    std::vector<size_t> order;
+    for(size_t i = 3*first; i < 3*last; i++)
+    {
+      if(!has_t) binned[i].t = -1;
+      if(!has_n) binned[i].n = -1;
+      order.push_back(i);
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      const ObjCorner& A = binned[a];
+      const ObjCorner& B = binned[b];
+      return (A.v != B.v) ? A.v < B.v : (A.t != B.t) ? A.t < B.t : A.n < B.n;
+    });
+
+    std::vector<Point3D> mesh_verts;
+    std::vector<Vector3D> mesh_normals;
+    std::vector<Point2D> mesh_uvs;
+    std::vector<unsigned int> indices(3*(last - first));
+    for(size_t k = 0; k < order.size(); k++)
+    {
+      const ObjCorner& c = binned[order[k]];
+      if(k == 0 || c.v != binned[order[k-1]].v || c.t != binned[order[k-1]].t || c.n != binned[order[k-1]].n)
+      {
+        mesh_verts.push_back(positions[c.v]);
+        mesh_normals.push_back(has_n ? normals[c.n] : position_normals[c.v]);
+        if(has_t) mesh_uvs.push_back((c.t >= 0) ? uvs[c.t] : Point2D(0.0, 0.0));
+      }
+      indices[order[k] - 3*first] = mesh_verts.size() - 1;
+    }
+
+    TriMesh mesh(std::move(mesh_verts), std::move(mesh_normals), std::move(mesh_uvs), std::move(indices), cluster_options);
+    return writer.add(mesh);
+  };
+
+  // Runs of cells in order make up the clusters, and a cell with more triangles than fit in a cluster is split
+  size_t first = 0;
+  bool written = true;
+  for(size_t c = 0; c + 1 < offsets.size() && written; c++)
+  {
+    if(offsets[c+1] - first > cluster_size && offsets[c] > first)
+    {
+      written = write_cluster(first, offsets[c]);
+      first = offsets[c];
+    }
+    while(written && offsets[c+1] - first > cluster_size)
+    {
+      written = write_cluster(first, first + cluster_size);
+      first += cluster_size;
+    }
+  }
+  if(written && first < num_triangles) written = write_cluster(first, num_triangles);
+  if(!written || !writer.finish()) return false;
+
+  std::chrono::duration<double> duration = std::chrono::system_clock::now() - start;
+  std::cout << "Built " << paged_filename << " out of core: " << num_triangles << " triangles in " << cells*cells*cells << " cells in " << duration.count() << "s" << std::endl;
+
+  return true;
+}
+
+}
+
+std::shared_ptr<TriMesh> load_obj(const std::string& filename, const std::string& cache_directory, const MeshOptions& options, uint64_t* content_key)
+{
+  std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+
+  int fd = open(filename.c_str(), O_RDONLY);
+  if(fd < 0) return nullptr;
+
+  struct stat st;
+  if(fstat(fd, &st) != 0 || st.st_size == 0)
+  {
+    close(fd);
+    return nullptr;
+  }
+
+  size_t size = st.st_size;
+  void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) return nullptr;
+  madvise(map, size, MADV_SEQUENTIAL);
+
+  // Use the cached mesh if this file has been loaded before
+  const char* data = (const char*)map;
+  uint64_t key = 0;
+  std::string cache_filename;
+  if(!cache_directory.empty() || content_key) key = cache_key(data, size, options);
+  if(content_key) *content_key = key;
+  if(!cache_directory.empty())
+  {
+    cache_filename = mesh_cache_path(cache_directory, key);
+
+    std::shared_ptr<TriMesh> mesh = load_mesh_cache(cache_filename, key);
+    if(mesh)
+    {
+      munmap(map, size);
+
+      std::chrono::duration<double> duration = std::chrono::system_clock::now() - start;
+      std::cout << "Loaded " << filename << " from " << cache_filename << ": " << mesh->num_vertices() << " vertices, " << mesh->num_triangles() << " triangles in " << duration.count() << "s" << std::endl;
+
+      return mesh;
+    }
+  }
+
+  std::vector<ObjChunk> chunks;
+  parse_chunks(data, data + size, chunks);
+
+  munmap(map, size);
+
+  std::chrono::time_point<std::chrono::system_clock> parsed = std::chrono::system_clock::now();
+
+  // Stitch the chunks together, resolving the relative indices now that the number of elements before each chunk is known
+  std::vector<Point3D> positions;
+  std::vector<Vector3D> normals;
+  std::vector<Point2D> uvs;
+  std::vector<ObjCorner> corners;
+  bool has_t = false, has_n = true;
+  for(auto& chunk : chunks)
+  {
+    if(chunk.error)
+    {
+      std::cerr << "Error: Malformed line in " << filename << std::endl;
+      return nullptr;
+    }
+
+    for(size_t i = 0; i < chunk.corners.size(); i++)
+    {
+      ObjCorner c = chunk.corners[i];
+      if(chunk.relative[i] & 1) c.v += positions.size();
+      if(chunk.relative[i] & 2) c.t += uvs.size();
+      if(chunk.relative[i] & 4) c.n += normals.size();
+      corners.push_back(c);
+    }
+
+    positions.insert(positions.end(), chunk.verts.begin(), chunk.verts.end());
+    normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+    uvs.insert(uvs.end(), chunk.uvs.begin(), chunk.uvs.end());
+
+    chunk = ObjChunk();
+  }
+
+  for(auto& c : corners)
+  {
+    if(c.v < 0 || c.v >= (long)positions.size() || c.t >= (long)uvs.size() || c.n >= (long)normals.size() || c.t < -1 || c.n < -1)
+    {
+      std::cerr << "Error: Face references a missing vertex in " << filename << std::endl;
+      return nullptr;
+    }
+    has_t = has_t || c.t >= 0;
+    has_n = has_n && c.n >= 0;
+  }
+
+  // Normals are generated from the faces unless every corner has one
+  if(!has_n) normals.clear();
+
+  // A corner is a vertex of the triangle mesh, but corners using the same position, normal and texture coordinates
+  // are the same vertex. Look these up with a short list of the distinct corners seen for each position
+  std::vector<Point3D> mesh_verts;
+  std::vector<Vector3D> mesh_normals;
+  std::vector<Point2D> mesh_uvs;
+  std::vector<unsigned int> indices(corners.size());
+  if(!has_t && !has_n)
+  {
+    for(size_t i = 0; i < corners.size(); i++) indices[i] = corners[i].v;
+    mesh_verts.swap(positions);
+  }
+  else
+  {
+    std::vector<long> head(positions.size(), -1);
+    std::vector<long> next;
+    std::vector<ObjCorner> distinct;
+    for(size_t i = 0; i < corners.size(); i++)
+    {
+      const ObjCorner& c = corners[i];
+      long n = has_n ? c.n : -1;
+      long k = head[c.v];
+      while(k >= 0 && (distinct[k].t != c.t || distinct[k].n != n)) k = next[k];
+      if(k < 0)
+      {
+        k = distinct.size();
+        distinct.push_back(c);
+        next.push_back(head[c.v]);
+        head[c.v] = k;
+
+        mesh_verts.push_back(positions[c.v]);
+        if(has_n) mesh_normals.push_back(normals[c.n]);
+        if(has_t) mesh_uvs.push_back((c.t >= 0) ? uvs[c.t] : Point2D(0.0, 0.0));
+      }
+      indices[i] = k;
+    }
+  }
+
+  std::chrono::time_point<std::chrono::system_clock> indexed = std::chrono::system_clock::now();
+
+  std::shared_ptr<TriMesh> mesh = std::make_shared<TriMesh>(std::move(mesh_verts), std::move(mesh_normals), std::move(mesh_uvs), std::move(indices), options);
+
+  std::chrono::duration<double> duration = std::chrono::system_clock::now() - start;
+  std::chrono::duration<double> parse_duration = parsed - start;
+  std::chrono::duration<double> index_duration = indexed - parsed;
+  std::cout << "Loaded " << filename << ": " << mesh->num_vertices() << " vertices, " << mesh->num_triangles() << " triangles in " << duration.count() << "s";
+  std::cout << " (parse " << parse_duration.count() << "s, index " << index_duration.count() << "s";
+  for(auto& stage : mesh->stats().timings) std::cout << ", " << stage.first << " " << stage.second << "s";
+  std::cout << ")" << std::endl;
+
+  const MeshStats& stats = mesh->stats();
+  if(stats.cache_misses_before > 0)
+  {
+    double change = 100.0 * ((double)stats.cache_misses_after / stats.cache_misses_before - 1.0);
+    std::cout << "Reordered vertices: " << stats.cache_misses_before << " -> " << stats.cache_misses_after << " simulated cache misses (";
+    std::cout << std::showpos << change << std::noshowpos << "%)" << std::endl;
+  }
+
+  if(!mesh->packed().empty())
+  {
+    size_t full = mesh->num_vertices() * (sizeof(Point3D) + sizeof(Vector3D));
+    size_t packed = mesh->num_vertices() * sizeof(TriMesh::PackedVertex);
+    std::cout << "Compressed vertices: " << full << " -> " << packed << " bytes" << std::endl;
+  }
+
+  if(!mesh->levels().empty())
+  {
+    std::cout << "Levels of detail:";
+    for(auto& level : mesh->levels()) std::cout << " " << level->num_triangles();
+    std::cout << " triangles" << std::endl;
+  }
+
+  if(!cache_filename.empty()) mkdir(cache_directory.c_str(), 0777);
+  if(!cache_filename.empty() && !save_mesh_cache(cache_filename, *mesh, key))
+  {
+    std::cerr << "Warning: Could not write mesh cache " << cache_filename << std::endl;
+  }
+
+  return mesh;
+}
+
+std::shared_ptr<PagedMesh> load_paged_obj(const std::string& filename, const std::string& cache_directory, size_t memory_budget, const MeshOptions& options, uint64_t* content_key)
+{
+  int fd = open(filename.c_str(), O_RDONLY);
+  if(fd < 0) return nullptr;
+
+  struct stat st;
+  if(fstat(fd, &st) != 0 || st.st_size == 0)
+  {
+    close(fd);
+    return nullptr;
+  }
+
+  size_t size = st.st_size;
+  void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) return nullptr;
+
+  uint64_t key = cache_key((const char*)map, size, options);
+  if(content_key) *content_key = key;
+
+  std::string paged_filename = paged_mesh_path(cache_directory, key);
+  std::shared_ptr<PagedMesh> paged = load_paged_mesh(paged_filename, key, memory_budget);
+  if(paged)
+  {
+    munmap(map, size);
+    std::cout << "Opened " << filename << " from " << paged_filename << ": " << paged->num_clusters() << " clusters" << std::endl;
+    return paged;
+  }
+
+  // First load of this file: build the clusters out of core and write them out
+  mkdir(cache_directory.c_str(), 0777);
+  bool built = build_paged_obj((const char*)map, size, filename, cache_directory, paged_filename, key, options);
+  munmap(map, size);
+  if(!built)
+  {
+    std::cerr << "Error: Could not write paged mesh " << paged_filename << std::endl;
+    return nullptr;
+  }
+
+  paged = load_paged_mesh(paged_filename, key, memory_budget);
+  if(paged) std::cout << "Paged " << filename << " into " << paged_filename << ": " << paged->num_clusters() << " clusters" << std::endl;
+  return paged;
+}
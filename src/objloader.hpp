@@ -0,0 +1,26 @@
+#ifndef CS488_OBJLOADER_HPP
+#define CS488_OBJLOADER_HPP
+
+#include <string>
+#include <cstdint>
+#include <memory>
+#include "mesh.hpp"
+#include "pagedmesh.hpp"
+
+// Loads an Alias/Wavefront OBJ file into a triangle mesh. Vertex positions (v), normals (vn), texture coordinates (vt)
+// and polygonal faces (f) are read, everything else is ignored. Faces are triangulated as fans. The file is memory mapped
+// and split into chunks at line boundaries which are parsed in parallel. Returns nullptr if the file can't be read or
+// references vertices that don't exist.
+//
+// If a cache directory is given the processed mesh is stored there, keyed by the contents of the file, and later
+// loads of the same contents map the cached mesh instead (see meshcache.hpp). If key is given it is set to the cache
+// key of the file's contents and options, so callers can tell files apart without reading them again.
+std::shared_ptr<TriMesh> load_obj(const std::string& filename, const std::string& cache_directory = "", const MeshOptions& options = MeshOptions(), uint64_t* key = nullptr);
+
+// Loads an OBJ file as a paged mesh (see pagedmesh.hpp). memory_budget bytes of clusters may be in memory, shared with
+// every other paged mesh. The clustered mesh is kept in the cache directory, keyed like the mesh cache. The first load
+// of a file builds the clusters out of core, with the parsed file in temporary files in the cache directory, so the mesh
+// never has to fit in memory. Later loads only read the clusters rays reach. key is set as by load_obj.
+std::shared_ptr<PagedMesh> load_paged_obj(const std::string& filename, const std::string& cache_directory, size_t memory_budget, const MeshOptions& options = MeshOptions(), uint64_t* key = nullptr);
+
+#endif
@@ -0,0 +1,295 @@
+#include "pagedmesh.hpp"
+#include "meshcache.hpp"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <limits>
+#include <algorithm>
+
+namespace {
+
+const char MAGIC[8] = { 'R', 'T', 'P', 'A', 'G', 'E', 'S', 0 };
+const uint32_t VERSION = 1;
+const uint64_t ALIGNMENT = 64;
+
+// The cluster images follow the header, then the cluster table and the top level hierarchy
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t entry_size; // Size of the structs in the file, guards against a build with a different layout
+  uint32_t node_size;
+  uint64_t key;
+  uint64_t num_clusters;
+  uint64_t num_nodes;
+  uint64_t clusters_offset;
+  uint64_t nodes_offset;
+};
+
+uint64_t align(uint64_t offset)
+{
+  return (offset + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+}
+
+bool read_all(int fd, void* data, size_t size, uint64_t offset)
+{
+  char* p = (char*)data;
+  while(size > 0)
+  {
+    ssize_t n = pread(fd, p, size, offset);
+    if(n <= 0) return false;
+    p += n;
+    size -= n;
+    offset += n;
+  }
+  return true;
+}
+
+}
+
+std::mutex PagedMesh::s_mutex;
+PagedMesh::LRU PagedMesh::s_lru;
+uint64_t PagedMesh::s_resident = 0;
+uint64_t PagedMesh::s_peak_resident = 0;
+size_t PagedMesh::s_memory_budget = 0;
+
+PagedMesh::PagedMesh(const std::string& filename, int fd, std::vector<Cluster> clusters, BVH bvh, uint64_t key, size_t memory_budget)
+  : m_filename(filename)
+  , m_fd(fd)
+  , m_clusters(std::move(clusters))
+  , m_bvh(bvh)
+  , m_key(key)
+  , m_entries(m_clusters.size())
+{
+  memset(&m_stats, 0, sizeof(m_stats));
+
+  std::lock_guard<std::mutex> lock(s_mutex);
+  s_memory_budget = std::max(s_memory_budget, memory_budget);
+}
+
+PagedMesh::~PagedMesh()
+{
+  PagedMeshStats stats = this->stats();
+
+  // Give the mesh's share of the cache back
+  {
+    std::lock_guard<std::mutex> lock(s_mutex);
+    for(size_t c = 0; c < m_entries.size(); c++)
+    {
+      if(!m_entries[c].mesh) continue;
+      s_lru.erase(m_entries[c].lru);
+      s_resident -= m_clusters[c].size;
+    }
+  }
+
+  uint64_t lookups = stats.hits + stats.misses;
+  std::cout << "Paged " << m_filename << ": " << stats.hits << " cluster hits, " << stats.misses << " misses";
+  if(lookups > 0) std::cout << " (" << 100.0 * stats.hits / lookups << "% hit rate)";
+  std::cout << ", " << stats.evictions << " evictions, " << stats.bytes_read / (1024.0 * 1024.0) << "MB read, peak ";
+  std::cout << stats.peak_resident / (1024.0 * 1024.0) << "MB of " << s_memory_budget / (1024.0 * 1024.0) << "MB resident across paged meshes" << std::endl;
+
+  close(m_fd);
+}
+
+PagedMeshStats PagedMesh::stats() const
+{
+  std::lock_guard<std::mutex> lock(s_mutex);
+  PagedMeshStats stats = m_stats;
+  stats.peak_resident = s_peak_resident;
+  return stats;
+}
+
+BoundingBox PagedMesh::bounds() const
+{
+  return m_bvh.bounds();
+}
+
+bool PagedMesh::intersect(const Ray& ray, Intersection& j) const
+{
+  // Clusters are visited front to back so once a hit is found clusters behind it are never read
+  auto visit = [&](unsigned int first, unsigned int count, double& tmax) -> bool {
+    bool intersected = false;
+    for(unsigned int c = first; c < first + count; c++)
+    {
+      std::shared_ptr<const TriMesh> cluster = fetch(c);
+      if(cluster && cluster->intersect(ray, j, tmax)) intersected = true;
+    }
+    return intersected;
+  };
+
+  return m_bvh.traverse(ray, std::numeric_limits<double>::infinity(), visit);
+}
+
+std::shared_ptr<const TriMesh> PagedMesh::fetch(unsigned int cluster) const
+{
+  Entry& entry = m_entries[cluster];
+  {
+    std::lock_guard<std::mutex> lock(s_mutex);
+    if(entry.mesh)
+    {
+      s_lru.splice(s_lru.begin(), s_lru, entry.lru);
+      m_stats.hits++;
+      return entry.mesh;
+    }
+    m_stats.misses++;
+  }
+
+  // Read without holding the lock so other threads can carry on with the clusters in memory
+  std::shared_ptr<const TriMesh> mesh = read(cluster);
+  if(!mesh) return nullptr;
+
+  std::lock_guard<std::mutex> lock(s_mutex);
+
+  // Another thread may have read the same cluster in the meantime
+  if(entry.mesh) return entry.mesh;
+
+  entry.mesh = mesh;
+  s_lru.push_front(std::make_pair(this, cluster));
+  entry.lru = s_lru.begin();
+  s_resident += m_clusters[cluster].size;
+  m_stats.bytes_read += m_clusters[cluster].size;
+
+  // The oldest cluster may belong to any paged mesh. Always keep the cluster just read, even if it alone is over budget
+  while(s_resident > s_memory_budget && s_lru.size() > 1)
+  {
+    const PagedMesh* owner = s_lru.back().first;
+    unsigned int oldest = s_lru.back().second;
+    s_lru.pop_back();
+    owner->m_entries[oldest].mesh = nullptr;
+    s_resident -= owner->m_clusters[oldest].size;
+    owner->m_stats.evictions++;
+  }
+
+  s_peak_resident = std::max(s_peak_resident, s_resident);
+  return mesh;
+}
+
+std::shared_ptr<const TriMesh> PagedMesh::read(unsigned int cluster) const
+{
+  const Cluster& c = m_clusters[cluster];
+  std::shared_ptr<char> data(new char[c.size], std::default_delete<char[]>());
+  if(!read_all(m_fd, data.get(), c.size, c.offset))
+  {
+    std::cerr << "Error: Could not read cluster " << cluster << " of " << m_filename << std::endl;
+    return nullptr;
+  }
+
+  return read_mesh_image(data.get(), c.size, data, m_key);
+}
+
+std::string paged_mesh_path(const std::string& directory, uint64_t key)
+{
+  std::ostringstream path;
+  path << directory << "/" << std::hex << std::setw(16) << std::setfill('0') << key << ".pages";
+  return path.str();
+}
+
+PagedMeshWriter::PagedMeshWriter(const std::string& filename, uint64_t key)
+  : m_filename(filename)
+  , m_key(key)
+  , m_offset(align(sizeof(Header)))
+{
+  std::ostringstream tmp;
+  tmp << filename << ".tmp." << getpid();
+  m_tmp = tmp.str();
+
+  m_out.open(m_tmp.c_str(), std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+  m_out.seekp(m_offset);
+}
+
+PagedMeshWriter::~PagedMeshWriter()
+{
+  // Nothing is left behind if finish wasn't called or failed
+  if(m_out.is_open()) m_out.close();
+  remove(m_tmp.c_str());
+}
+
+bool PagedMeshWriter::add(const TriMesh& cluster)
+{
+  // Every image starts aligned, as the loader checks
+  static const char padding[ALIGNMENT] = {0};
+  m_out.write(padding, align(m_offset) - m_offset);
+  m_offset = align(m_offset);
+  if(!m_out || !write_mesh_image(m_out, cluster, m_key)) return false;
+
+  uint64_t end = m_out.tellp();
+  m_clusters.push_back(PagedMesh::Cluster{ m_offset, end - m_offset });
+  m_bounds.push_back(cluster.bounds());
+  m_offset = end;
+  return true;
+}
+
+bool PagedMeshWriter::finish()
+{
+  // The top level hierarchy has a cluster per leaf. Its leaves address the table, so the table is in their order
+  BVH bvh(m_bounds, 1);
+  std::vector<PagedMesh::Cluster> clusters(m_clusters.size());
+  for(size_t c = 0; c < clusters.size(); c++) clusters[c] = m_clusters[bvh.indices()[c]];
+
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.header_size = sizeof(Header);
+  header.entry_size = sizeof(PagedMesh::Cluster);
+  header.node_size = sizeof(BVH::Node);
+  header.key = m_key;
+  header.num_clusters = clusters.size();
+  header.num_nodes = bvh.nodes().size();
+  header.clusters_offset = m_offset;
+  header.nodes_offset = align(header.clusters_offset + header.num_clusters * sizeof(PagedMesh::Cluster));
+
+  static const char padding[ALIGNMENT] = {0};
+  m_out.seekp(m_offset);
+  m_out.write((const char*)clusters.data(), clusters.size() * sizeof(PagedMesh::Cluster));
+  m_out.write(padding, header.nodes_offset - (header.clusters_offset + clusters.size() * sizeof(PagedMesh::Cluster)));
+  m_out.write((const char*)bvh.nodes().data(), bvh.nodes().size() * sizeof(BVH::Node));
+  m_out.seekp(0);
+  m_out.write((const char*)&header, sizeof(Header));
+  m_out.close();
+
+  return m_out && rename(m_tmp.c_str(), m_filename.c_str()) == 0;
+}
+
+std::shared_ptr<PagedMesh> load_paged_mesh(const std::string& filename, uint64_t key, size_t memory_budget)
+{
+  int fd = open(filename.c_str(), O_RDONLY);
+  if(fd < 0) return nullptr;
+
+  struct stat st;
+  Header header;
+  if(fstat(fd, &st) != 0 || !read_all(fd, &header, sizeof(Header), 0) ||
+     memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION || header.header_size != sizeof(Header) ||
+     header.entry_size != sizeof(PagedMesh::Cluster) || header.node_size != sizeof(BVH::Node) || header.key != key ||
+     header.clusters_offset > (uint64_t)st.st_size || header.num_clusters > (st.st_size - header.clusters_offset) / sizeof(PagedMesh::Cluster) ||
+     header.nodes_offset > (uint64_t)st.st_size || header.num_nodes > (st.st_size - header.nodes_offset) / sizeof(BVH::Node) ||
+     (header.num_nodes == 0) != (header.num_clusters == 0))
+  {
+    close(fd);
+    return nullptr;
+  }
+
+  std::vector<PagedMesh::Cluster> clusters(header.num_clusters);
+  std::vector<BVH::Node> nodes(header.num_nodes);
+  bool valid = read_all(fd, clusters.data(), clusters.size() * sizeof(PagedMesh::Cluster), header.clusters_offset) &&
+               read_all(fd, nodes.data(), nodes.size() * sizeof(BVH::Node), header.nodes_offset);
+  for(auto& cluster : clusters)
+  {
+    valid = valid && cluster.offset % ALIGNMENT == 0 && cluster.offset <= (uint64_t)st.st_size && cluster.size <= st.st_size - cluster.offset;
+  }
+
+  BVH bvh(std::move(nodes));
+  if(!valid || !bvh.valid(clusters.size()))
+  {
+    close(fd);
+    return nullptr;
+  }
+
+  return std::make_shared<PagedMesh>(filename, fd, std::move(clusters), bvh, key, memory_budget);
+}
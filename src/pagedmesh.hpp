@@ -0,0 +1,115 @@
+#ifndef CS488_PAGEDMESH_HPP
+#define CS488_PAGEDMESH_HPP
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <list>
+#include <fstream>
+#include <utility>
+#include <mutex>
+#include <cstdint>
+#include "primitive.hpp"
+#include "mesh.hpp"
+#include "bvh.hpp"
+
+// Counters of a paged mesh's clusters in the cache shared by all paged meshes
+struct PagedMeshStats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t bytes_read;
+  uint64_t peak_resident; // Most bytes of clusters of any paged mesh in memory at once
+};
+
+// A triangle mesh which doesn't have to fit in memory. The mesh is split into clusters of nearby triangles which are
+// stored in a file, each as a TriMesh image with its own hierarchy (see meshcache.hpp). Only the cluster table and a
+// hierarchy over the bounds of the clusters are kept in memory. Clusters are read from the file the first time a ray
+// reaches them and kept in a least recently used cache. The cache is shared by every paged mesh, and the oldest
+// clusters of any of them are evicted once the clusters in memory take more than the memory budget. The budget is the
+// largest any paged mesh has been given.
+class PagedMesh : public Primitive {
+public:
+  struct Cluster {
+    uint64_t offset; // Of the cluster's image in the file
+    uint64_t size;
+  };
+
+  // Takes ownership of the file descriptor. The leaves of the hierarchy must address the clusters directly
+  PagedMesh(const std::string& filename, int fd, std::vector<Cluster> clusters, BVH bvh, uint64_t key, size_t memory_budget);
+  virtual ~PagedMesh();
+
+  virtual bool intersect(const Ray& ray, Intersection& j) const;
+  virtual BoundingBox bounds() const;
+
+  size_t num_clusters() const
+  {
+    return m_clusters.size();
+  }
+
+  PagedMeshStats stats() const;
+
+private:
+  // Returns the cluster, reading it if it isn't in memory. The cluster stays valid while the caller holds it even
+  // if it is evicted in the meantime. Returns nullptr if it can't be read
+  std::shared_ptr<const TriMesh> fetch(unsigned int cluster) const;
+  std::shared_ptr<const TriMesh> read(unsigned int cluster) const;
+
+  typedef std::list< std::pair<const PagedMesh*, unsigned int> > LRU;
+
+  struct Entry {
+    std::shared_ptr<const TriMesh> mesh;
+    LRU::iterator lru;
+  };
+
+  std::string m_filename;
+  int m_fd;
+  std::vector<Cluster> m_clusters;
+  BVH m_bvh;
+  uint64_t m_key;
+
+  // Guarded by s_mutex
+  mutable std::vector<Entry> m_entries;
+  mutable PagedMeshStats m_stats;
+
+  // The cache of clusters shared by all paged meshes
+  static std::mutex s_mutex;
+  static LRU s_lru; // Clusters in memory, most recently used first
+  static uint64_t s_resident;
+  static uint64_t s_peak_resident;
+  static size_t s_memory_budget;
+};
+
+// Writes a paged mesh file a cluster at a time, so the whole mesh is never in memory. Clusters should be added in an
+// order that keeps clusters close together in the scene close together in the file. The file is written under a
+// temporary name and only renamed into place by finish
+class PagedMeshWriter {
+public:
+  PagedMeshWriter(const std::string& filename, uint64_t key);
+  ~PagedMeshWriter();
+
+  // Returns false if the cluster can't be written
+  bool add(const TriMesh& cluster);
+
+  // Writes the cluster table and a hierarchy over the bounds of the clusters. Returns false if the file can't be
+  // written
+  bool finish();
+
+private:
+  std::string m_filename;
+  std::string m_tmp;
+  std::fstream m_out;
+  uint64_t m_key;
+  uint64_t m_offset;
+  std::vector<PagedMesh::Cluster> m_clusters;
+  std::vector<BoundingBox> m_bounds;
+};
+
+// Path of the paged mesh file for the given key in a cache directory
+std::string paged_mesh_path(const std::string& directory, uint64_t key);
+
+// Opens a paged mesh file, reading only its cluster table and hierarchy. Returns nullptr if it doesn't exist, is from
+// another version of the format or was made from a different source
+std::shared_ptr<PagedMesh> load_paged_mesh(const std::string& filename, uint64_t key, size_t memory_budget);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef CS488_PARALLEL_HPP
+#define CS488_PARALLEL_HPP
+
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+// Splits [0, count) into one contiguous range per hardware thread and calls f(first, last) for each range on its
+// own thread, returning once they have all finished. Ranges are never smaller than min_count so small amounts of
+// work stay on the calling thread.
+template<typename Function>
+void parallel_for(size_t count, Function&& f, size_t min_count = 4096)
+{
+  size_t num_threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), count / std::max<size_t>(min_count, 1));
+  num_threads = std::max<size_t>(num_threads, 1);
+
+  std::vector<std::thread> threads;
+  for(size_t t = 1; t < num_threads; t++) threads.push_back(std::thread(f, count * t / num_threads, count * (t+1) / num_threads));
+  f((size_t)0, count / num_threads);
+  for(auto& thread : threads) thread.join();
+}
+
+#endif
@@ -1075,3 +1075,140 @@ int SolveQuartic( double c[5], double s[4] )
  * Copying, use and development for non-commercial purposes permitted.
  *                  All rights for commercial use reserved.
  */
+
+/*
+**  Return the real roots of a polynomial of degree 4 or less in an interval.
+**  The interval is split at the roots of the derivative so the polynomial is
+**  monotonic on each piece, and a piece holds a root exactly when its ends
+**  differ in sign. Each such root is refined with Newton-Raphson iteration
+**  kept inside the bracket by bisection, which always converges. When the
+**  interval is tight around the roots, e.g. from a bounding volume, this is
+**  both faster and more accurate than solving for all roots in closed form.
+*/
+static double EvalPoly( const double c[], size_t degree, double x, double* dydx, double* bound )
+{
+	size_t j;
+	double y = c[0];
+	double ax = (x < 0) ? -x : x;
+
+	/* bound grows like the rounding error of y */
+	*dydx = 0;
+	*bound = (c[0] < 0) ? -c[0] : c[0];
+	for( j = 1; j <= degree; ++j ) {
+		*dydx = *dydx*x + y;
+		y = y*x + c[j];
+		*bound = *bound*ax + ((c[j] < 0) ? -c[j] : c[j]);
+	}
+
+	return y;
+}
+
+static double BracketRoot( const double c[], size_t degree, double lo, double hi, double ylo, double yhi )
+{
+	size_t i;
+	double x, y, dydx, bound, next, step;
+
+	/* Start where the chord crosses zero */
+	x = lo - ylo*(hi - lo)/(yhi - ylo);
+	for( i = 0; i < 64; ++i ) {
+		/* Stop once y is down to rounding error */
+		y = EvalPoly( c, degree, x, &dydx, &bound );
+		if( ((y < 0) ? -y : y) <= 1e-15*bound ) {
+			break;
+		}
+
+		/* Keep the part of the bracket that still holds the sign change */
+		if( (y < 0) == (ylo < 0) ) {
+			lo = x;
+			ylo = y;
+		} else {
+			hi = x;
+		}
+
+		/* Take the Newton step if it stays in the bracket, otherwise bisect */
+		next = (dydx != 0) ? x - y/dydx : lo;
+		if( !(next > lo && next < hi) ) {
+			next = 0.5*(lo + hi);
+		}
+
+		step = next - x;
+		x = next;
+		if( step*step <= 1e-28*(1.0 + x*x) ) {
+			break;
+		}
+	}
+
+	return x;
+}
+
+/* Sorts the roots and keeps those in [lo, hi] */
+static size_t ClipRoots( double roots[], size_t n, double lo, double hi )
+{
+	size_t i, j, nr;
+	double t;
+
+	for( i = 1; i < n; ++i ) {
+		for( j = i; j > 0 && roots[j] < roots[j-1]; --j ) {
+			t = roots[j];
+			roots[j] = roots[j-1];
+			roots[j-1] = t;
+		}
+	}
+
+	nr = 0;
+	for( i = 0; i < n; ++i ) {
+		if( roots[i] >= lo && roots[i] <= hi ) {
+			roots[nr++] = roots[i];
+		}
+	}
+
+	return nr;
+}
+
+size_t intervalRoots( const double c[], size_t degree, double lo, double hi, double roots[], size_t max_roots )
+{
+	double derivative[4] = { 0, 0, 0, 0 }, breaks[5], ya, yb, dydx, bound;
+	size_t i, nb, nr;
+
+	if( c[0] == 0 ) {
+		return (degree > 1) ? intervalRoots( c+1, degree-1, lo, hi, roots, max_roots ) : 0;
+	}
+
+	/* A quadratic's roots are cheaper in closed form */
+	if( degree <= 2 ) {
+		nb = (degree == 2) ? quadraticRoots( c[0], c[1], c[2], breaks ) : quadraticRoots( 0.0, c[0], c[1], breaks );
+		nb = ClipRoots( breaks, nb, lo, hi );
+		for( i = 0; i < nb && i < max_roots; ++i ) {
+			roots[i] = breaks[i];
+		}
+		return i;
+	}
+
+	/* Ends of the monotonic pieces. They only have to separate the roots, which
+	** the closed form for a cubic does well enough
+	*/
+	for( i = 0; i < degree; ++i ) {
+		derivative[i] = c[i]*(degree - i);
+	}
+	if( degree == 4 ) {
+		nb = cubicRoots( derivative[1]/derivative[0], derivative[2]/derivative[0], derivative[3]/derivative[0], breaks+1 );
+		nb = ClipRoots( breaks+1, nb, lo, hi );
+	} else {
+		nb = intervalRoots( derivative, degree-1, lo, hi, breaks+1, degree-1 );
+	}
+	breaks[0] = lo;
+	breaks[++nb] = hi;
+	++nb;
+
+	nr = 0;
+	ya = EvalPoly( c, degree, lo, &dydx, &bound );
+	for( i = 0; i+1 < nb && nr < max_roots; ++i ) {
+		yb = EvalPoly( c, degree, breaks[i+1], &dydx, &bound );
+		if( (ya < 0) != (yb < 0) ) {
+			roots[nr++] = BracketRoot( c, degree, breaks[i], breaks[i+1], ya, yb );
+		}
+		ya = yb;
+	}
+
+	return nr;
+}
@@ -17,6 +17,12 @@ size_t quadraticRoots(double A, double B, double C, double roots[2]);
 size_t cubicRoots(double A, double B, double C, double roots[3]);
 size_t quarticRoots(double A, double B, double C, double D, double roots[4]);
 
+/* The first max_roots real roots of the polynomial c[0] x^degree + c[1] x^(degree-1)
+** + ... + c[degree] (degree <= 4) which lie in [lo, hi], in increasing order. Roots
+** where the polynomial only touches zero may be skipped.
+*/
+size_t intervalRoots(const double c[], size_t degree, double lo, double hi, double roots[], size_t max_roots = 4);
+
 #endif /* CS488_POLYROOTS_HPP */
 
 /*
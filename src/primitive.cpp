@@ -5,10 +5,89 @@
 #include <algorithm>
 #include <limits>
 
+namespace {
+
+typedef std::pair<double, int> Crossing; // Distance along a ray where it may cross a surface and which part of it
+
+// Builds the spans of a ray through a bounded solid from every distance where the ray may cross its surface. The ray
+// is either inside or outside the solid all the way between consecutive crossings so testing the middle is enough,
+// which stays right when a root is missed or repeated. surface fills in the details of a part of the surface at a point
+template<typename Inside, typename Surface>
+void spans_between(const Ray& ray, std::vector<Crossing>& crossings, const Inside& inside, const Surface& surface, std::vector<Span>& spans)
+{
+  std::sort(crossings.begin(), crossings.end());
+
+  bool open = false;
+  for(size_t i = 0; i+1 < crossings.size(); i++)
+  {
+    double t0 = crossings[i].first, t1 = crossings[i+1].first;
+    if(!(t1 > t0)) continue;
+
+    bool in = inside(ray.origin() + (0.5*(t0+t1))*ray.direction());
+    if(in == open) continue;
+
+    if(in)
+    {
+      spans.push_back(Span());
+      spans.back().t0 = t0;
+      surface(ray.origin() + t0*ray.direction(), crossings[i].second, spans.back().enter);
+    }
+    else
+    {
+      spans.back().t1 = t0;
+      surface(ray.origin() + t0*ray.direction(), crossings[i].second, spans.back().exit);
+    }
+    open = in;
+  }
+
+  if(open)
+  {
+    spans.back().t1 = crossings.back().first;
+    surface(ray.origin() + crossings.back().first*ray.direction(), crossings.back().second, spans.back().exit);
+  }
+}
+
+void add_crossing(std::vector<Crossing>& crossings, double t, int part)
+{
+  if(std::isfinite(t)) crossings.push_back(Crossing(t, part));
+}
+
+BoundingBox infinite_bounds()
+{
+  double inf = std::numeric_limits<double>::infinity();
+  return BoundingBox(Point3D(-inf, -inf, -inf), Point3D(inf, inf, inf));
+}
+
+}
+
 Primitive::~Primitive()
 {
 }
 
+void Primitive::spans(const Ray& ray, std::vector<Span>& spans) const
+{
+  Intersection j;
+  if(!intersect(ray, j)) return;
+
+  double t = (j.q - ray.origin()).dot(ray.direction());
+  spans.push_back(Span{ t, t, j, j });
+}
+
+BoundingBox Primitive::bounds() const
+{
+  return infinite_bounds();
+}
+
+std::shared_ptr<Quadric> Primitive::quadric() const
+{
+  return nullptr;
+}
+
+void Primitive::surface_details(const Point3D& q, int part, Intersection& j) const
+{
+  j.q = q;
+}
+
 Sphere::~Sphere()
 {
 }
@@ -19,6 +98,32 @@ bool Sphere::intersect(const Ray& ray, Intersection& j) const
   return sphere.intersect(ray, j);
 }
 
+void Sphere::spans(const Ray& ray, std::vector<Span>& spans) const
+{
+  NonhierSphere sphere(Point3D(0.0, 0.0, 0.0), 1.0);
+  sphere.spans(ray, spans);
+}
+
+BoundingBox Sphere::bounds() const
+{
+  NonhierSphere sphere(Point3D(0.0, 0.0, 0.0), 1.0);
+  return sphere.bounds();
+}
+
+std::shared_ptr<Quadric> Sphere::quadric() const
+{
+  // x^2 + y^2 + z^2 - 1 < 0
+  Matrix4x4 Q;
+  Q[3][3] = -1.0;
+  return std::make_shared<Quadric>(Q, std::vector<Quadric::Clip>(), bounds());
+}
+
+void Sphere::surface_details(const Point3D& q, int part, Intersection& j) const
+{
+  NonhierSphere sphere(Point3D(0.0, 0.0, 0.0), 1.0);
+  sphere.surface(q, j);
+}
+
 Cone::~Cone()
 {
 }
@@ -29,6 +134,34 @@ bool Cone::intersect(const Ray& ray, Intersection& j) const
   return cone.intersect(ray, j);
 }
 
+void Cone::spans(const Ray& ray, std::vector<Span>& spans) const
+{
+  NonhierCone cone(Point3D(0.0, 0.0, 0.0), 1.0);
+  cone.spans(ray, spans);
+}
+
+BoundingBox Cone::bounds() const
+{
+  NonhierCone cone(Point3D(0.0, 0.0, 0.0), 1.0);
+  return cone.bounds();
+}
+
+std::shared_ptr<Quadric> Cone::quadric() const
+{
+  // x^2 + y^2 - z^2 < 0 below the apex (z < 0) and above the cap (-z - 1 < 0)
+  Matrix4x4 Q;
+  Q[2][2] = -1.0;
+  Q[3][3] = 0.0;
+  std::vector<Quadric::Clip> clips = { { Vector4D(0.0, 0.0, 1.0, 0.0), 0 }, { Vector4D(0.0, 0.0, -1.0, -1.0), 1 } };
+  return std::make_shared<Quadric>(Q, clips, bounds());
+}
+
+void Cone::surface_details(const Point3D& q, int part, Intersection& j) const
+{
+  NonhierCone cone(Point3D(0.0, 0.0, 0.0), 1.0);
+  cone.surface(q, part == 1, j);
+}
+
 Cylinder::~Cylinder()
 {
 }
@@ -39,6 +172,34 @@ bool Cylinder::intersect(const Ray& ray, Intersection& j) const
   return cylinder.intersect(ray, j);
 }
 
+void Cylinder::spans(const Ray& ray, std::vector<Span>& spans) const
+{
+  NonhierCylinder cylinder(Point3D(0.0, 0.0, 0.0), 1.0, 1.0);
+  cylinder.spans(ray, spans);
+}
+
+BoundingBox Cylinder::bounds() const
+{
+  NonhierCylinder cylinder(Point3D(0.0, 0.0, 0.0), 1.0, 1.0);
+  return cylinder.bounds();
+}
+
+std::shared_ptr<Quadric> Cylinder::quadric() const
+{
+  // x^2 + y^2 - 1 < 0 between the caps at z = -0.5 and z = 0.5
+  Matrix4x4 Q;
+  Q[2][2] = 0.0;
+  Q[3][3] = -1.0;
+  std::vector<Quadric::Clip> clips = { { Vector4D(0.0, 0.0, 1.0, -0.5), 1 }, { Vector4D(0.0, 0.0, -1.0, -0.5), -1 } };
+  return std::make_shared<Quadric>(Q, clips, bounds());
+}
+
+void Cylinder::surface_details(const Point3D& q, int part, Intersection& j) const
+{
+  NonhierCylinder cylinder(Point3D(0.0, 0.0, 0.0), 1.0, 1.0);
+  cylinder.surface(q, part, j);
+}
+
 Cube::~Cube()
 {
 }
@@ -49,6 +210,18 @@ bool Cube::intersect(const Ray& ray, Intersection& j) const
   return box.intersect(ray, j);
 }
 
+void Cube::spans(const Ray& ray, std::vector<Span>& spans) const
+{
+  NonhierBox box(Point3D(0.0, 0.0, 0.0), 1.0);
+  box.spans(ray, spans);
+}
+
+BoundingBox Cube::bounds() const
+{
+  NonhierBox box(Point3D(0.0, 0.0, 0.0), 1.0);
+  return box.bounds();
+}
+
 Plane::~Plane()
 {
 }
@@ -59,6 +232,12 @@ bool Plane::intersect(const Ray& ray, Intersection& j) const
   return plane.intersect(ray, j);
 }
 
+BoundingBox Plane::bounds() const
+{
+  NonhierPlane plane(Point3D(0.0, 0.0, 0.0), 1.0);
+  return plane.bounds();
+}
+
 Torus::~Torus()
 {
 }
@@ -69,6 +248,18 @@ bool Torus::intersect(const Ray& ray, Intersection& j) const
   return torus.intersect(ray, j);
 }
 
+void Torus::spans(const Ray& ray, std::vector<Span>& spans) const
+{
+  NonhierTorus torus(Point3D(0.0, 0.0, 0.0), 1, 0.5);
+  torus.spans(ray, spans);
+}
+
+BoundingBox Torus::bounds() const
+{
+  NonhierTorus torus(Point3D(0.0, 0.0, 0.0), 1, 0.5);
+  return torus.bounds();
+}
+
 Disc::~Disc()
 {
 }
@@ -79,6 +270,12 @@ bool Disc::intersect(const Ray& ray, Intersection& j) const
   return disc.intersect(ray, j);
 }
 
+BoundingBox Disc::bounds() const
+{
+  NonhierDisc disc(Point3D(0.0, 0.0, 0.0), 1.0);
+  return disc.bounds();
+}
+
 NonhierSphere::~NonhierSphere()
 {
 }
@@ -121,30 +318,7 @@ bool NonhierSphere::intersect(const Ray& ray, Intersection& j) const
     double min = std::min<double>(roots[0], roots[1]);
     double t = (num_roots == 1) ? roots[0] : ((min < 0) ? std::max<double>(roots[0], roots[1]) : min);
     if(t < 0) return false;
-    j.q = ray.origin() + t*ray.direction();
-    j.n = (j.q - m_pos);
-
-    // To calculate the parametric coordinates of the point on the sphere we need to define 3 bivariate functions.
-    // For a sphere the spherical coordinate system can be used to define the X, Y, Z coordinates like so:
-    // X = r*cos(THETA)*sin(PHI)
-    // Y = -r*cos(PHI)
-    // Z = -r*sin(THETA)*sin(PHI)
-    // Where THETA = atan2(-(z - center.z), x - center.x) and PHI = acos(-(y - center.y) / r)
-    // And the parameters u = (THETA + PI) / (2*PI) and v = PHI / PI; u,v E [0, 1]
-    double theta = atan2(-j.n[2], j.n[0]);
-    double phi = acos(-j.n[1] / m_radius);
-
-    j.u = (theta + M_PI) / (2 * M_PI);
-    j.v = phi / M_PI;
-
-    j.pu = Vector3D(-m_radius*sin(theta)*sin(phi), 0, -m_radius*cos(theta)*sin(phi));
-    j.pv = Vector3D(m_radius*cos(theta)*cos(phi), m_radius*sin(phi), -m_radius*sin(theta)*cos(phi));
-
-    //Vector3D pu1, pv1;
-    //if(j.n[2] <= j.n[0] && j.n[2] <= j.n[1]) pu1 = Vector3D(-j.n[1], j.n[2], 0.0);
-    //else if(j.n[1] <= j.n[0]) pu1 = Vector3D(-j.n[2], 0.0, j.n[0]);
-    //else pu1 = Vector3D(0.0, -j.n[2], j.n[1]);
-    //pv1 = j.n.cross(pu1);
+    surface(ray.origin() + t*ray.direction(), j);
 
     return true;
   }
@@ -152,6 +326,55 @@ bool NonhierSphere::intersect(const Ray& ray, Intersection& j) const
   return false;
 }
 
+void NonhierSphere::spans(const Ray& ray, std::vector<Span>& spans) const
+{
+  Vector3D v = ray.origin() - m_pos;
+  double roots[2];
+  size_t num_roots = quadraticRoots(1.0, 2*ray.direction().dot(v), v.dot(v) - m_radius*m_radius, roots);
+
+  std::vector<Crossing> crossings;
+  for(size_t i = 0; i < num_roots; i++) add_crossing(crossings, roots[i], 0);
+
+  spans_between(ray, crossings,
+    [&](const Point3D& p) { return (p - m_pos).dot(p - m_pos) < m_radius*m_radius; },
+    [&](const Point3D& q, int, Intersection& j) { surface(q, j); },
+    spans);
+}
+
+BoundingBox NonhierSphere::bounds() const
+{
+  Vector3D r(m_radius, m_radius, m_radius);
+  return BoundingBox(m_pos - r, m_pos + r);
+}
+
+void NonhierSphere::surface(const Point3D& q, Intersection& j) const
+{
+  j.q = q;
+  j.n = (j.q - m_pos);
+
+  // To calculate the parametric coordinates of the point on the sphere we need to define 3 bivariate functions.
+  // For a sphere the spherical coordinate system can be used to define the X, Y, Z coordinates like so:
+  // X = r*cos(THETA)*sin(PHI)
+  // Y = -r*cos(PHI)
+  // Z = -r*sin(THETA)*sin(PHI)
+  // Where THETA = atan2(-(z - center.z), x - center.x) and PHI = acos(-(y - center.y) / r)
+  // And the parameters u = (THETA + PI) / (2*PI) and v = PHI / PI; u,v E [0, 1]
+  double theta = atan2(-j.n[2], j.n[0]);
+  double phi = acos(std::max(-1.0, std::min(1.0, -j.n[1] / m_radius)));
+
+  j.u = (theta + M_PI) / (2 * M_PI);
+  j.v = phi / M_PI;
+
+  j.pu = Vector3D(-m_radius*sin(theta)*sin(phi), 0, -m_radius*cos(theta)*sin(phi));
+  j.pv = Vector3D(m_radius*cos(theta)*cos(phi), m_radius*sin(phi), -m_radius*sin(theta)*cos(phi));
+
+  //Vector3D pu1, pv1;
+  //if(j.n[2] <= j.n[0] && j.n[2] <= j.n[1]) pu1 = Vector3D(-j.n[1], j.n[2], 0.0);
+  //else if(j.n[1] <= j.n[0]) pu1 = Vector3D(-j.n[2], 0.0, j.n[0]);
+  //else pu1 = Vector3D(0.0, -j.n[2], j.n[1]);
+  //pv1 = j.n.cross(pu1);
+}
+
 NonhierCone::~NonhierCone()
 {
 }
@@ -200,27 +423,16 @@ bool NonhierCone::intersect(const Ray& ray, Intersection& j) const
 
         // The end cap may have been intersected only if there is only one root or the z1 and z2 are on either side of zmin
         // If so, we check if the intersection point is closer than any other intersection points
-        Point3D Q = ray.origin() + t*ray.direction();
-        Vector3D N(2*Q[0], 2*Q[1], -2*Q[2]);
-        
-        double U = acos(Vector3D(Q[0]-m_pos[0], Q[1]-m_pos[1], 0.0).dot(Vector3D(1.0, 0.0, 0.0))) / M_PI;
-        double V = (Q[2]-m_pos[2]) / zmin;
-     
+        bool cap = false;
         int signz1 = ((z1-zmin) > 0) ? 1 : 0;
         int signz2 = ((z2-zmin) > 0) ? 1 : 0;
         if(signz1 != signz2 && t3 > 0 && t3 < t)
         {
           t = t3;
-          Q = ray.origin() + t*ray.direction();
-          N = Vector3D(0.0, 0.0, zmin);
+          cap = true;
         }
 
-        // To find the normal we just take the gradient and plug the coordinate values for the intersection point into the gradient result
-        j.q = Q;
-        j.n = N;
-        j.u = U;
-        j.v = V;
-
+        surface(ray.origin() + t*ray.direction(), cap, j);
         return true;
       }
     }
@@ -229,6 +441,45 @@ bool NonhierCone::intersect(const Ray& ray, Intersection& j) const
   return false;
 }
 
+void NonhierCone::spans(const Ray& ray, std::vector<Span>& spans) const
+{
+  // The solid is the part of the lower half of the double cone above the cap, so the ray may cross the side of the
+  // cone or the planes of the cap and the apex
+  Vector3D O = ray.origin() - m_pos;
+  Vector3D d = ray.direction();
+
+  double roots[2];
+  size_t num_roots = quadraticRoots(d[0]*d[0] + d[1]*d[1] - d[2]*d[2], 2*(O[0]*d[0] + O[1]*d[1] - O[2]*d[2]), O[0]*O[0] + O[1]*O[1] - O[2]*O[2], roots);
+
+  std::vector<Crossing> crossings;
+  for(size_t i = 0; i < num_roots; i++) add_crossing(crossings, roots[i], 0);
+  add_crossing(crossings, (-m_height - O[2]) / d[2], 1);
+  add_crossing(crossings, -O[2] / d[2], 0);
+
+  spans_between(ray, crossings,
+    [&](const Point3D& p) {
+      Vector3D v = p - m_pos;
+      return v[2] < 0.0 && v[2] > -m_height && v[0]*v[0] + v[1]*v[1] < v[2]*v[2];
+    },
+    [&](const Point3D& q, int part, Intersection& j) { surface(q, part == 1, j); },
+    spans);
+}
+
+BoundingBox NonhierCone::bounds() const
+{
+  return BoundingBox(m_pos - Vector3D(m_height, m_height, m_height), m_pos + Vector3D(m_height, m_height, 0.0));
+}
+
+void NonhierCone::surface(const Point3D& q, bool cap, Intersection& j) const
+{
+  // To find the normal we just take the gradient and plug the coordinate values for the intersection point into the gradient result
+  Vector3D v = q - m_pos;
+  j.q = q;
+  j.n = cap ? Vector3D(0.0, 0.0, -m_height) : Vector3D(2*v[0], 2*v[1], -2*v[2]);
+  j.u = acos(Vector3D(v[0], v[1], 0.0).dot(Vector3D(1.0, 0.0, 0.0))) / M_PI;
+  j.v = v[2] / -m_height;
+}
+
 NonhierCylinder::~NonhierCylinder()
 {
 }
@@ -261,8 +512,7 @@ bool NonhierCylinder::intersect(const Ray& ray, Intersection& j) const
   // For this case we take the smallest root greater than 0 to find the nearest intersection point
   // If the roots are negative then the cylinder is behind the ray
   double t = std::numeric_limits<double>::infinity();
-  double U, V;
-  Vector3D N;
+  int side = 0;
   bool intersected = false;
   if(num_roots > 0)
   {
@@ -282,18 +532,7 @@ bool NonhierCylinder::intersect(const Ray& ray, Intersection& j) const
       t = (z2 < zmax && z2 > zmin && t2 > 0) ? ((t2 < t) ? t2 : t) : t;
 
       // Found a valid intersection
-      if(!std::isinf<double>(t)) 
-      {
-        // The normal is essentially the vector from the center point to the intersection point removing the component
-        // corresponding to the axis which the cylinder is aligned (the Z axis in this case)
-        // While we are at it, lets just calculate the U, V texture coordinates
-        N = (ray.origin() + t*ray.direction())-m_pos;
-        U = acos(Vector3D(N[0], N[1], 0.0).dot(Vector3D(1.0, 0.0, 0.0))) / M_PI;
-        V = N[2] / m_height + 0.5;
-        N[2] = 0.0;
-
-        intersected = true;
-      }
+      if(!std::isinf<double>(t)) intersected = true;
     }
   }
 
@@ -309,10 +548,7 @@ bool NonhierCylinder::intersect(const Ray& ray, Intersection& j) const
     if(tzmin < t)
     {
       t = tzmin;
-      Vector3D Q = ray_o + t*ray.direction();
-      N = Vector3D(0.0, 0.0, -1.0);
-      U = Q[0] / (2.0*m_radius) + 0.5;
-      V = Q[1] / (2.0*m_radius) + 0.5;
+      side = -1;
       intersected = true;
     }
   }
@@ -325,25 +561,66 @@ bool NonhierCylinder::intersect(const Ray& ray, Intersection& j) const
     if(tzmax < t)
     {
       t = tzmax;
-      Vector3D Q = ray_o + t*ray.direction();
-      N = Vector3D(0.0, 0.0, 1.0);
-      U = Q[0] / (2.0*m_radius) + 0.5;
-      V = Q[1] / (2.0*m_radius) + 0.5;
+      side = 1;
       intersected = true;
     }
   }
 
-  if(intersected)
-  {
-    j.q = ray.origin() + t*ray.direction();
-    j.n = N;
-    j.u = U;
-    j.v = V;
-  }
+  if(intersected) surface(ray.origin() + t*ray.direction(), side, j);
 
   return intersected;
 }
 
+void NonhierCylinder::spans(const Ray& ray, std::vector<Span>& spans) const
+{
+  Vector3D v = ray.origin() - m_pos;
+  Vector3D d = ray.direction();
+  double zmax = m_height / 2.0;
+
+  double roots[2];
+  size_t num_roots = quadraticRoots(d[0]*d[0] + d[1]*d[1], 2*(d[0]*v[0] + d[1]*v[1]), v[0]*v[0] + v[1]*v[1] - m_radius*m_radius, roots);
+
+  std::vector<Crossing> crossings;
+  for(size_t i = 0; i < num_roots; i++) add_crossing(crossings, roots[i], 0);
+  add_crossing(crossings, (-zmax - v[2]) / d[2], -1);
+  add_crossing(crossings, (zmax - v[2]) / d[2], 1);
+
+  spans_between(ray, crossings,
+    [&](const Point3D& p) {
+      Vector3D w = p - m_pos;
+      return fabs(w[2]) < zmax && w[0]*w[0] + w[1]*w[1] < m_radius*m_radius;
+    },
+    [&](const Point3D& q, int side, Intersection& j) { surface(q, side, j); },
+    spans);
+}
+
+BoundingBox NonhierCylinder::bounds() const
+{
+  Vector3D extent(m_radius, m_radius, m_height / 2.0);
+  return BoundingBox(m_pos - extent, m_pos + extent);
+}
+
+void NonhierCylinder::surface(const Point3D& q, int side, Intersection& j) const
+{
+  Vector3D v = q - m_pos;
+  j.q = q;
+  if(side == 0)
+  {
+    // The normal is essentially the vector from the center point to the intersection point removing the component
+    // corresponding to the axis which the cylinder is aligned (the Z axis in this case)
+    // While we are at it, lets just calculate the U, V texture coordinates
+    j.n = Vector3D(v[0], v[1], 0.0);
+    j.u = acos(Vector3D(v[0], v[1], 0.0).dot(Vector3D(1.0, 0.0, 0.0))) / M_PI;
+    j.v = v[2] / m_height + 0.5;
+  }
+  else
+  {
+    j.n = Vector3D(0.0, 0.0, side);
+    j.u = v[0] / (2.0*m_radius) + 0.5;
+    j.v = v[1] / (2.0*m_radius) + 0.5;
+  }
+}
+
 NonhierBox::~NonhierBox()
 {
 }
@@ -442,7 +719,41 @@ bool NonhierBox::intersect(const Ray& ray, Intersection& j) const
   
   if(t < 0) return false;
 
-  j.q = ray.origin() + t * ray.direction();
+  surface(ray.origin() + t * ray.direction(), n, j);
+  return true;
+}
+
+void NonhierBox::spans(const Ray& ray, std::vector<Span>& spans) const
+{
+  // Part 2*i is the face at the low end of axis i, 2*i+1 the one at the high end
+  std::vector<Crossing> crossings;
+  for(int i = 0; i < 3; i++)
+  {
+    add_crossing(crossings, (m_pos[i] - ray.origin()[i]) / ray.direction()[i], 2*i);
+    add_crossing(crossings, (m_pos[i] + m_size - ray.origin()[i]) / ray.direction()[i], 2*i+1);
+  }
+
+  spans_between(ray, crossings,
+    [&](const Point3D& p) {
+      for(int i = 0; i < 3; i++) if(p[i] < m_pos[i] || p[i] > m_pos[i] + m_size) return false;
+      return true;
+    },
+    [&](const Point3D& q, int part, Intersection& j) {
+      Vector3D n(0.0, 0.0, 0.0);
+      n[part / 2] = (part % 2) ? 1.0 : -1.0;
+      surface(q, n, j);
+    },
+    spans);
+}
+
+BoundingBox NonhierBox::bounds() const
+{
+  return BoundingBox(m_pos, m_pos + Vector3D(m_size, m_size, m_size));
+}
+
+void NonhierBox::surface(const Point3D& q, const Vector3D& n, Intersection& j) const
+{
+  j.q = q;
   j.n = n;
 
   int i1, i2;
@@ -457,8 +768,6 @@ bool NonhierBox::intersect(const Ray& ray, Intersection& j) const
   else if(j.n[1] <= j.n[0]) j.pu = Vector3D(-j.n[2], 0, j.n[0]);
   else j.pu = Vector3D(0, -j.n[2], j.n[1]); 
   j.pv = j.n.cross(j.pu);
-
-  return true;
 }
 
 NonhierPlane::~NonhierPlane()
@@ -497,71 +806,169 @@ bool NonhierPlane::intersect(const Ray& ray, Intersection& j) const
   return true;
 }
 
+BoundingBox NonhierPlane::bounds() const
+{
+  double size = m_size / 2.0;
+  return BoundingBox(m_pos - Vector3D(size, 0.0, size), m_pos + Vector3D(size, 0.0, size));
+}
+
 NonhierTorus::~NonhierTorus()
 {
 }
 
 bool NonhierTorus::intersect(const Ray& ray, Intersection& j) const
 {
-  // The implicit formula for the surface of a torus centered at c and lying on the xy plane: (x^2 + y^2 + z^2 + R^2 - r^2)^2 + 4R^2(z^2 - r^2)  
+  double intervals[2][2];
+  size_t num_intervals = bounding_intervals(ray, intervals);
+
+  // The intervals are in order so the first crossing in front of the ray is the nearest. One may be right at the
+  // origin of a ray leaving the surface, so two are asked for
+  for(size_t k = 0; k < num_intervals; k++)
+  {
+    double t0 = std::max(intervals[k][0], 0.0);
+    if(t0 > intervals[k][1]) continue;
+
+    double roots[4];
+    size_t num_roots = crossings(ray, t0, intervals[k][1], roots, 2);
+    for(size_t i = 0; i < num_roots; i++)
+    {
+      if(roots[i] <= 0.0) continue;
+      surface(ray.origin() + roots[i]*ray.direction(), j);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void NonhierTorus::spans(const Ray& ray, std::vector<Span>& spans) const
+{
+  double intervals[2][2];
+  size_t num_intervals = bounding_intervals(ray, intervals);
+
+  std::vector<Crossing> crossings;
+  for(size_t k = 0; k < num_intervals; k++)
+  {
+    double roots[4];
+    size_t num_roots = this->crossings(ray, intervals[k][0], intervals[k][1], roots);
+    for(size_t i = 0; i < num_roots; i++) add_crossing(crossings, roots[i], 0);
+  }
+
+  double R2 = m_oradius*m_oradius;
+  double r2 = m_iradius*m_iradius;
+  spans_between(ray, crossings,
+    [&](const Point3D& q) {
+      Vector3D v = q - m_pos;
+      double w = v.dot(v) - r2 - R2;
+      return w*w + 4*R2*(v[2]*v[2] - r2) < 0.0;
+    },
+    [&](const Point3D& q, int, Intersection& j) { surface(q, j); },
+    spans);
+}
+
+size_t NonhierTorus::bounding_intervals(const Ray& ray, double intervals[2][2]) const
+{
+  // The torus lies in the slab |z| <= r, between the spheres of radius R-r and R+r around its center. Most rays that
+  // miss it are rejected here without solving the quartic
+  Vector3D p = ray.origin() - m_pos;
+  Vector3D d = ray.direction();
+
+  double t0 = -std::numeric_limits<double>::infinity(), t1 = std::numeric_limits<double>::infinity();
+  if(d[2] != 0.0)
+  {
+    double a = (-m_iradius - p[2]) / d[2], b = (m_iradius - p[2]) / d[2];
+    t0 = std::min(a, b);
+    t1 = std::max(a, b);
+  }
+  else if(fabs(p[2]) > m_iradius) return 0;
+
+  double b = p.dot(d);
+  double outer = m_oradius + m_iradius;
+  double disc = b*b - (p.dot(p) - outer*outer);
+  if(disc < 0.0) return 0;
+  disc = sqrt(disc);
+  t0 = std::max(t0, -b - disc);
+  t1 = std::min(t1, -b + disc);
+  if(t0 > t1) return 0;
+
+  // Leave out the part inside the inner sphere, allowing for rounding since the torus touches it
+  double inner = m_oradius - m_iradius;
+  disc = b*b - (p.dot(p) - inner*inner);
+  if(inner <= 0.0 || disc <= 0.0)
+  {
+    intervals[0][0] = t0;
+    intervals[0][1] = t1;
+    return 1;
+  }
+  disc = sqrt(disc);
+  double pad = 1e-9 * outer;
+  double h0 = -b - disc + pad, h1 = -b + disc - pad;
+
+  size_t n = 0;
+  if(t0 < h0)
+  {
+    intervals[n][0] = t0;
+    intervals[n][1] = std::min(t1, h0);
+    n++;
+  }
+  if(t1 > h1)
+  {
+    intervals[n][0] = std::max(t0, h1);
+    intervals[n][1] = t1;
+    n++;
+  }
+  return n;
+}
+
+size_t NonhierTorus::crossings(const Ray& ray, double t0, double t1, double roots[4], size_t max_roots) const
+{
+  // The implicit formula for the surface of a torus centered at c and lying on the xy plane: (x^2 + y^2 + z^2 - R^2 - r^2)^2 + 4R^2(z^2 - r^2)
   // The parametric equation of a ray: O + t*d = P
   // I'm not going to go through the process of solving this equation. Instead I got the final formula here:
   // http://www.emeyex.com/site/projects/raytorus.pdf
-  Vector3D p = ray.origin() - m_pos;
+  // The direction is a unit vector so the quartic is monic. It is written about the start of the interval, which keeps
+  // the coefficients small when the ray starts far from the torus
+  Vector3D p = (ray.origin() + t0*ray.direction()) - m_pos;
   Vector3D d = ray.direction();
 
   double R2 = m_oradius*m_oradius;
   double r2 = m_iradius*m_iradius;
-  double a = d.dot(d);
   double b = 2*(p.dot(d));
   double y = p.dot(p) - r2 - R2;
 
-  double _A = 1.0 / (a*a);
-  double B = 2*a*b;
-  double C = (b*b) + 2*a*y + 4*R2*(d[2]*d[2]);
-  double D = 2*b*y + 8*R2*p[2]*d[2];
-  double E = (y*y) + 4*R2*(p[2]*p[2]) - 4*R2*r2;
-
-  double roots[4];
-
-  // Now solve for the roots which shall give us values for t
-  size_t num_roots = quarticRoots(B * _A, C * _A, D * _A, E * _A, roots);
-
-  // If there are no roots, then no intersection
-  if(num_roots == 0) return false;
-
+  double c[5] = { 1.0, 2*b, b*b + 2*y + 4*R2*(d[2]*d[2]), 2*b*y + 8*R2*p[2]*d[2], y*y + 4*R2*(p[2]*p[2]) - 4*R2*r2 };
+  size_t num_roots = intervalRoots(c, 4, 0.0, t1 - t0, roots, max_roots);
+  for(size_t i = 0; i < num_roots; i++) roots[i] += t0;
+  return num_roots;
+}
 
-  // If all the roots are less than 0, then the whole torus is behind the ray
-  // Now we want the find the smallest intersection point greater than 0
-  double t = std::numeric_limits<double>::infinity(); 
-  for(size_t i = 0; i < num_roots; i++)
-  {
-    t = (roots[i] > 0 && roots[i] < t) ? roots[i] : t;
-  }
+BoundingBox NonhierTorus::bounds() const
+{
+  double r = m_oradius + m_iradius;
+  return BoundingBox(m_pos - Vector3D(r, r, m_iradius), m_pos + Vector3D(r, r, m_iradius));
+}
 
-  // No intersection points greater than 0 means the whole torus is behind the ray
-  if(std::isinf(t)) return false;
+void NonhierTorus::surface(const Point3D& Q, Intersection& j) const
+{
+  double R2 = m_oradius*m_oradius;
+  double r2 = m_iradius*m_iradius;
 
   // To find the surface normal, we take the partial derivative of the implicit formula of the torus
   // with respect to each of the coordinates and then plug in the coordinate values from the intersection point
-  Point3D Q = ray.origin() + t*ray.direction();
-  double qx2 = Q[0]*Q[0];
-  double qy2 = Q[1]*Q[1];
-  double qz2 = Q[2]*Q[2];
-  double nx = 4*Q[0]*(qx2 + qy2 + qz2 - r2 - R2);
-  double ny = 4*Q[1]*(qx2 + qy2 + qz2 - r2 - R2);
-  double nz = 4*Q[2]*(qz2 + qy2 + qz2 - r2 - R2) + 8*R2*Q[2];
+  Vector3D v = Q - m_pos;
+  double w = v.dot(v) - r2 - R2;
+  double nx = 4*v[0]*w;
+  double ny = 4*v[1]*w;
+  double nz = 4*v[2]*w + 8*R2*v[2];
   
   j.q = Q;
   j.n = Vector3D(nx, ny, nz);
 
-  double theta = asin((Q[2]-m_pos[2]) / m_iradius);
-  double phi = asin((Q[1]-m_pos[1]) / (m_oradius + m_iradius*cos(theta)));
+  double theta = asin(std::max(-1.0, std::min(1.0, v[2] / m_iradius)));
+  double phi = asin(std::max(-1.0, std::min(1.0, v[1] / (m_oradius + m_iradius*cos(theta)))));
 
   j.u = 0.5 + phi / M_PI;
   j.v = 0.5 + theta / M_PI;
-
-  return true;
 }
 
 NonhierDisc::~NonhierDisc()
@@ -597,3 +1004,195 @@ bool NonhierDisc::intersect(const Ray& ray, Intersection& j) const
   return true;
 }
 
+BoundingBox NonhierDisc::bounds() const
+{
+  return BoundingBox(m_pos - Vector3D(m_radius, m_radius, 0.0), m_pos + Vector3D(m_radius, m_radius, 0.0));
+}
+
+Quadric::Quadric(const Matrix4x4& Q, const std::vector<Clip>& clips, const BoundingBox& bounds)
+  : m_clips(clips)
+  , m_bounds(bounds)
+{
+  size_t k = 0;
+  for(int i = 0; i < 4; i++)
+  {
+    for(int j = i; j < 4; j++) m_q[k++] = 0.5 * (Q[i][j] + Q[j][i]);
+  }
+}
+
+Quadric::~Quadric()
+{
+}
+
+bool Quadric::intersect(const Ray& ray, Intersection& j) const
+{
+  double t[2][2];
+  size_t on[2][2];
+  size_t num_spans = solve(ray, t, on);
+
+  // The nearest hit is where the first span ahead of the ray starts, or where it ends if the ray starts inside
+  for(size_t i = 0; i < num_spans; i++)
+  {
+    if(!(t[i][1] > 0.0)) continue;
+
+    int end = (t[i][0] > 0.0) ? 0 : 1;
+    if(std::isinf(t[i][end])) return false;
+    surface(ray.origin() + t[i][end]*ray.direction(), on[i][end], j);
+    return true;
+  }
+
+  return false;
+}
+
+void Quadric::spans(const Ray& ray, std::vector<Span>& spans) const
+{
+  double t[2][2];
+  size_t on[2][2];
+  size_t num_spans = solve(ray, t, on);
+
+  // An unclipped quadric may go on forever, leaving nothing to describe at that end
+  for(size_t i = 0; i < num_spans; i++)
+  {
+    spans.push_back(Span());
+    spans.back().t0 = t[i][0];
+    spans.back().t1 = t[i][1];
+    if(std::isfinite(t[i][0])) surface(ray.origin() + t[i][0]*ray.direction(), on[i][0], spans.back().enter);
+    if(std::isfinite(t[i][1])) surface(ray.origin() + t[i][1]*ray.direction(), on[i][1], spans.back().exit);
+  }
+}
+
+BoundingBox Quadric::bounds() const
+{
+  return m_bounds;
+}
+
+std::shared_ptr<Quadric> Quadric::transformed(const Matrix4x4& inverse, const BoundingBox& bounds, std::shared_ptr<const Primitive> shape) const
+{
+  Matrix4x4 Q;
+  size_t k = 0;
+  for(int i = 0; i < 4; i++)
+  {
+    for(int j = i; j < 4; j++) Q[i][j] = Q[j][i] = m_q[k++];
+  }
+
+  std::vector<Clip> clips(m_clips);
+  for(auto& clip : clips)
+  {
+    Vector4D p = clip.plane;
+    for(int j = 0; j < 4; j++) clip.plane[j] = inverse[0][j]*p[0] + inverse[1][j]*p[1] + inverse[2][j]*p[2] + inverse[3][j]*p[3];
+  }
+
+  std::shared_ptr<Quadric> result = std::make_shared<Quadric>(inverse.transpose() * Q * inverse, clips, bounds);
+  result->m_shape = shape;
+  result->m_inverse = m_inverse * inverse;
+  return result;
+}
+
+size_t Quadric::solve(const Ray& ray, double t[2][2], size_t on[2][2]) const
+{
+  Point3D o = ray.origin();
+  Vector3D d = ray.direction();
+  const double* q = m_q;
+  double inf = std::numeric_limits<double>::infinity();
+
+  // Along the ray x^T Q x = a*t^2 + 2b*t + c, from Q times the origin (w = 1) and the direction (w = 0)
+  double qo0 = q[0]*o[0] + q[1]*o[1] + q[2]*o[2] + q[3];
+  double qo1 = q[1]*o[0] + q[4]*o[1] + q[5]*o[2] + q[6];
+  double qo2 = q[2]*o[0] + q[5]*o[1] + q[7]*o[2] + q[8];
+  double qo3 = q[3]*o[0] + q[6]*o[1] + q[8]*o[2] + q[9];
+  double qd0 = q[0]*d[0] + q[1]*d[1] + q[2]*d[2];
+  double qd1 = q[1]*d[0] + q[4]*d[1] + q[5]*d[2];
+  double qd2 = q[2]*d[0] + q[5]*d[1] + q[7]*d[2];
+  double a = d[0]*qd0 + d[1]*qd1 + d[2]*qd2;
+  double b = d[0]*qo0 + d[1]*qo1 + d[2]*qo2;
+  double c = o[0]*qo0 + o[1]*qo1 + o[2]*qo2 + qo3;
+
+  // The stretch of the ray on the inner side of every clip plane. A ray parallel to a plane is on one side all the way
+  double lo = -inf, hi = inf;
+  size_t lo_on = 0, hi_on = 0;
+  for(size_t k = 0; k < m_clips.size(); k++)
+  {
+    const Vector4D& p = m_clips[k].plane;
+    double pd = p[0]*d[0] + p[1]*d[1] + p[2]*d[2];
+    double po = p[0]*o[0] + p[1]*o[1] + p[2]*o[2] + p[3];
+    double tk = -po / pd;
+    if(pd < 0.0 && tk > lo)
+    {
+      lo = tk;
+      lo_on = k + 1;
+    }
+    else if(pd > 0.0 && tk < hi)
+    {
+      hi = tk;
+      hi_on = k + 1;
+    }
+    else if(pd == 0.0 && po >= 0.0)
+    {
+      return 0;
+    }
+  }
+  if(!(lo < hi)) return 0;
+
+  // Where x^T Q x < 0: between the roots if a > 0 and outside them if a < 0, a half line if a = 0, and all or nothing
+  // when there are no roots. Q may be scaled by anything so only signs are compared against zero
+  double s[2][2];
+  size_t num_stretches = 0;
+  double disc = b*b - a*c;
+  if(disc > 0.0 && a != 0.0)
+  {
+    double h = -(b + ((b < 0.0) ? -std::sqrt(disc) : std::sqrt(disc)));
+    double r0 = h / a, r1 = c / h;
+    double near = std::min(r0, r1), far = std::max(r0, r1);
+    if(a > 0.0)
+    {
+      s[0][0] = near; s[0][1] = far;
+      num_stretches = 1;
+    }
+    else
+    {
+      s[0][0] = -inf; s[0][1] = near;
+      s[1][0] = far; s[1][1] = inf;
+      num_stretches = 2;
+    }
+  }
+  else if(a == 0.0 && b != 0.0)
+  {
+    double r = -c / (2.0*b);
+    s[0][0] = (b > 0.0) ? -inf : r;
+    s[0][1] = (b > 0.0) ? r : inf;
+    num_stretches = 1;
+  }
+  else if(a < 0.0 || (a == 0.0 && c < 0.0))
+  {
+    s[0][0] = -inf; s[0][1] = inf;
+    num_stretches = 1;
+  }
+
+  size_t num_spans = 0;
+  for(size_t i = 0; i < num_stretches; i++)
+  {
+    double t0 = std::max(s[i][0], lo), t1 = std::min(s[i][1], hi);
+    if(!(t0 < t1)) continue;
+
+    t[num_spans][0] = t0;
+    t[num_spans][1] = t1;
+    on[num_spans][0] = (s[i][0] > lo) ? 0 : lo_on;
+    on[num_spans][1] = (s[i][1] < hi) ? 0 : hi_on;
+    num_spans++;
+  }
+
+  return num_spans;
+}
+
+void Quadric::surface(const Point3D& q, size_t on, Intersection& j) const
+{
+  // Texture coordinates and tangents come from the shape in its own coordinates, as they would without the transform
+  // folded in
+  if(m_shape) m_shape->surface_details(m_inverse * q, (on == 0) ? 0 : m_clips[on-1].part, j);
+
+  // The normal is the gradient of x^T Q x or p . x, which points out of the solid
+  const double* c = m_q;
+  j.q = q;
+  if(on == 0) j.n = Vector3D(c[0]*q[0] + c[1]*q[1] + c[2]*q[2] + c[3], c[1]*q[0] + c[4]*q[1] + c[5]*q[2] + c[6], c[2]*q[0] + c[5]*q[1] + c[7]*q[2] + c[8]);
+  else j.n = Vector3D(m_clips[on-1].plane[0], m_clips[on-1].plane[1], m_clips[on-1].plane[2]);
+}
@@ -1,7 +1,19 @@
 #ifndef CS488_PRIMITIVE_HPP
 #define CS488_PRIMITIVE_HPP
 
+#include <vector>
+#include <memory>
 #include "algebra.hpp"
+#include "bvh.hpp"
+
+class Quadric;
+
+// A stretch of a ray inside a solid, from where it enters at t0 to where it leaves at t1. t is the distance along
+// the ray. The normals at both ends point out of the solid
+struct Span {
+  double t0, t1;
+  Intersection enter, exit;
+};
 
 class Primitive {
 public:
@@ -11,6 +23,58 @@ public:
   {
     return false;
   }
+
+  // Appends the spans of the ray inside the primitive in order along the ray, including those behind its origin. This
+  // is what constructive solid geometry is built from. Primitives that don't enclose a volume use the default, which
+  // makes the nearest hit a span of no length
+  virtual void spans(const Ray& ray, std::vector<Span>& spans) const;
+
+  // Bounds in model coordinates, infinite unless the primitive knows better
+  virtual BoundingBox bounds() const;
+
+  // The primitive as a clipped quadric in model coordinates, or nullptr if it isn't one, see Quadric
+  virtual std::shared_ptr<Quadric> quadric() const;
+
+  // Fills in the surface details of the point q on a part of the primitive's quadric, with the parts numbered as in its
+  // clip planes. Only called on primitives that have a quadric
+  virtual void surface_details(const Point3D& q, int part, Intersection& j) const;
+};
+
+// The solid x^T Q x < 0 over homogeneous points x = (x, y, z, 1), where Q is symmetric, cut down to the inner side
+// (p . x < 0) of any number of planes p. The quadric's surface is part 0 and each plane is a cap with a part of its
+// own. A transform M takes it to another quadric M^-T Q M^-1 cut by the planes M^-T p, so the transform of a node can
+// be folded in once and rays met in the node's parent coordinates without transforming them
+class Quadric : public Primitive {
+public:
+  struct Clip {
+    Vector4D plane;
+    int part;
+  };
+
+  Quadric(const Matrix4x4& Q, const std::vector<Clip>& clips, const BoundingBox& bounds);
+  virtual ~Quadric();
+
+  virtual bool intersect(const Ray& ray, Intersection& j) const;
+  virtual void spans(const Ray& ray, std::vector<Span>& spans) const;
+  virtual BoundingBox bounds() const;
+
+  // The solid moved by the transform whose inverse is inverse, with bounds the transformed bounds. The surface details
+  // of hits come from shape, the primitive the quadric stands for, in its own coordinates
+  std::shared_ptr<Quadric> transformed(const Matrix4x4& inverse, const BoundingBox& bounds, std::shared_ptr<const Primitive> shape) const;
+
+private:
+  // Finds the up to two spans of the ray inside the solid in order. The ends are given by the distance along the ray
+  // and what they lie on, 0 for the quadric and k for clip plane k-1
+  size_t solve(const Ray& ray, double t[2][2], size_t on[2][2]) const;
+
+  // Fills in the surface details of the point q on the quadric or a clip plane, numbered as in solve
+  void surface(const Point3D& q, size_t on, Intersection& j) const;
+
+  double m_q[10]; // Upper triangle of Q by rows: xx, xy, xz, xw, yy, yz, yw, zz, zw, ww
+  std::vector<Clip> m_clips;
+  BoundingBox m_bounds;
+  std::shared_ptr<const Primitive> m_shape;
+  Matrix4x4 m_inverse; // To the coordinates of m_shape
 };
 
 class Sphere : public Primitive {
@@ -18,6 +82,10 @@ public:
   virtual ~Sphere();
 
   virtual bool intersect(const Ray& ray, Intersection& j) const;
+  virtual void spans(const Ray& ray, std::vector<Span>& spans) const;
+  virtual BoundingBox bounds() const;
+  virtual std::shared_ptr<Quadric> quadric() const;
+  virtual void surface_details(const Point3D& q, int part, Intersection& j) const;
 };
 
 class Cone : public Primitive {
@@ -25,6 +93,10 @@ public:
   virtual ~Cone();
 
   virtual bool intersect(const Ray& ray, Intersection& j) const;
+  virtual void spans(const Ray& ray, std::vector<Span>& spans) const;
+  virtual BoundingBox bounds() const;
+  virtual std::shared_ptr<Quadric> quadric() const;
+  virtual void surface_details(const Point3D& q, int part, Intersection& j) const;
 };
 
 class Cylinder : public Primitive {
@@ -32,6 +104,10 @@ public:
   virtual ~Cylinder();
 
   virtual bool intersect(const Ray& ray, Intersection& j) const;
+  virtual void spans(const Ray& ray, std::vector<Span>& spans) const;
+  virtual BoundingBox bounds() const;
+  virtual std::shared_ptr<Quadric> quadric() const;
+  virtual void surface_details(const Point3D& q, int part, Intersection& j) const;
 };
 
 class Cube : public Primitive {
@@ -39,6 +115,8 @@ public:
   virtual ~Cube();
 
   virtual bool intersect(const Ray& ray, Intersection& j) const;
+  virtual void spans(const Ray& ray, std::vector<Span>& spans) const;
+  virtual BoundingBox bounds() const;
 };
 
 class Plane : public Primitive {
@@ -46,6 +124,7 @@ public:
   virtual ~Plane();
 
   virtual bool intersect(const Ray& ray, Intersection& j) const;
+  virtual BoundingBox bounds() const;
 };
 
 class Torus : public Primitive {
@@ -53,6 +132,8 @@ public:
   virtual ~Torus();
 
   virtual bool intersect(const Ray& ray, Intersection& j) const;
+  virtual void spans(const Ray& ray, std::vector<Span>& spans) const;
+  virtual BoundingBox bounds() const;
 };
 
 class Disc : public Primitive {
@@ -60,6 +141,7 @@ public:
   virtual ~Disc();
 
   virtual bool intersect(const Ray& ray, Intersection& j) const;
+  virtual BoundingBox bounds() const;
 };
 
 class NonhierSphere : public Primitive {
@@ -71,8 +153,15 @@ public:
   virtual ~NonhierSphere();
 
   virtual bool intersect(const Ray& ray, Intersection& j) const;
+  virtual void spans(const Ray& ray, std::vector<Span>& spans) const;
+  virtual BoundingBox bounds() const;
 
 private:
+  friend class Sphere;
+
+  // Fills in the surface details of the point q on the sphere
+  void surface(const Point3D& q, Intersection& j) const;
+
   Point3D m_pos;
   double m_radius;
 };
@@ -86,8 +175,15 @@ public:
   virtual ~NonhierCone();
 
   virtual bool intersect(const Ray& ray, Intersection& j) const;
+  virtual void spans(const Ray& ray, std::vector<Span>& spans) const;
+  virtual BoundingBox bounds() const;
 
 private:
+  friend class Cone;
+
+  // Fills in the surface details of the point q on the side of the cone or on its cap
+  void surface(const Point3D& q, bool cap, Intersection& j) const;
+
   Point3D m_pos;
   double m_height;
 };
@@ -101,8 +197,16 @@ public:
   virtual ~NonhierCylinder();
 
   virtual bool intersect(const Ray& ray, Intersection& j) const;
+  virtual void spans(const Ray& ray, std::vector<Span>& spans) const;
+  virtual BoundingBox bounds() const;
 
 private:
+  friend class Cylinder;
+
+  // Fills in the surface details of the point q on the side of the cylinder (side 0) or on the cap at the bottom (-1) or
+  // top (1)
+  void surface(const Point3D& q, int side, Intersection& j) const;
+
   Point3D m_pos;
   double m_radius;
   double m_height;
@@ -118,8 +222,13 @@ public:
   virtual ~NonhierBox();
 
   virtual bool intersect(const Ray& ray, Intersection& j) const;
+  virtual void spans(const Ray& ray, std::vector<Span>& spans) const;
+  virtual BoundingBox bounds() const;
 
 private:
+  // Fills in the surface details of the point q on the face of the box with normal n
+  void surface(const Point3D& q, const Vector3D& n, Intersection& j) const;
+
   Point3D m_pos;
   double m_size;
 };
@@ -134,6 +243,7 @@ public:
   virtual ~NonhierPlane();
 
   virtual bool intersect(const Ray& ray, Intersection& j) const;
+  virtual BoundingBox bounds() const;
 
 private:
   Point3D m_pos;
@@ -152,8 +262,19 @@ public:
   virtual ~NonhierTorus();
 
   virtual bool intersect(const Ray& ray, Intersection& j) const;
+  virtual void spans(const Ray& ray, std::vector<Span>& spans) const;
+  virtual BoundingBox bounds() const;
 
 private:
+  // Finds the at most two intervals of distance along the ray where it can meet the torus. Returns how many
+  size_t bounding_intervals(const Ray& ray, double intervals[2][2]) const;
+
+  // The first max_roots distances where the ray crosses the torus between t0 and t1, in order
+  size_t crossings(const Ray& ray, double t0, double t1, double roots[4], size_t max_roots = 4) const;
+
+  // Fills in the surface details of the point q on the torus
+  void surface(const Point3D& q, Intersection& j) const;
+
   Point3D m_pos;
   double m_oradius;
   double m_iradius;
@@ -170,6 +291,7 @@ public:
   virtual ~NonhierDisc();
 
   virtual bool intersect(const Ray& ray, Intersection& j) const;
+  virtual BoundingBox bounds() const;
 
 private:
   Point3D m_pos;
@@ -0,0 +1,162 @@
+#include "sampler.hpp"
+#include <algorithm>
+
+namespace {
+
+const double TO_UNIT = 1.0 / 4294967296.0;
+
+uint32_t reverse_bits(uint32_t x)
+{
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+  x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+// Laine and Karras' hash, in which each bit only affects the bits above it. On the reversed bits of a point it is a
+// nested uniform (Owen) scramble, as described by Burley in "Practical Hash-based Owen Scrambling"
+uint32_t owen_scramble(uint32_t x, uint32_t seed)
+{
+  x = reverse_bits(x);
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return reverse_bits(x);
+}
+
+// The first two dimensions of the Sobol sequence: the van der Corput sequence, and the one whose direction numbers
+// are the rows of Pascal's triangle mod 2
+uint32_t sobol(uint32_t index, uint32_t dimension)
+{
+  if(dimension == 0) return reverse_bits(index);
+
+  uint32_t x = 0;
+  for(uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+  {
+    if(index & 1) x ^= v;
+  }
+  return x;
+}
+
+// Element i of a random permutation of 0 to n-1 picked by the seed, from Kensler's "Correlated Multi-Jittered
+// Sampling". The hash is a bijection on the smallest power of two above n, and is repeated until it lands below n
+uint32_t permute(uint32_t i, uint32_t n, uint32_t seed)
+{
+  uint32_t w = n - 1;
+  w |= w >> 1;
+  w |= w >> 2;
+  w |= w >> 4;
+  w |= w >> 8;
+  w |= w >> 16;
+  do
+  {
+    i ^= seed;
+    i *= 0xe170893du;
+    i ^= seed >> 16;
+    i ^= (i & w) >> 4;
+    i ^= seed >> 8;
+    i *= 0x0929eb3fu;
+    i ^= seed >> 23;
+    i ^= (i & w) >> 1;
+    i *= 1 | seed >> 27;
+    i *= 0x6935fa69u;
+    i ^= (i & w) >> 11;
+    i *= 0x74dcb303u;
+    i ^= (i & w) >> 2;
+    i *= 0x9e501cc3u;
+    i ^= (i & w) >> 2;
+    i *= 0xc860a3dfu;
+    i &= w;
+    i ^= i >> 5;
+  } while(i >= n);
+  return (i + seed) % n;
+}
+
+// Radical inverse in base 3 with the digits at each position permuted by 3 bits of the hash
+double scrambled_radical_inverse3(uint32_t index, uint64_t hash)
+{
+  static const unsigned char PERMUTATIONS[6][3] = { {0, 1, 2}, {0, 2, 1}, {1, 0, 2}, {1, 2, 0}, {2, 0, 1}, {2, 1, 0} };
+
+  // Every one of the 21 digits a 32 bit index can have, including leading zeros which the permutation can change
+  double inverse = 0.0, scale = 1.0 / 3.0;
+  for(int k = 0; k < 21; k++, index /= 3, scale /= 3.0, hash >>= 3)
+  {
+    inverse += PERMUTATIONS[(hash & 7) % 6][index % 3] * scale;
+  }
+  return std::min(inverse, 1.0 - 1e-16);
+}
+
+}
+
+bool sampler_type(const std::string& name, SamplerType& type)
+{
+  if(name == "random") type = SamplerType::RANDOM;
+  else if(name == "halton") type = SamplerType::HALTON;
+  else if(name == "sobol") type = SamplerType::SOBOL;
+  else if(name == "blue_noise") type = SamplerType::BLUE_NOISE;
+  else return false;
+  return true;
+}
+
+// Position of a pixel in a Morton (Z) order of the image whose quadrants are visited in a random order at every
+// level, as in Ahmed and Wonka's "Screen-Space Blue-Noise Diffusion of Monte Carlo Sampling Error via Hierarchical
+// Ordering of Pixels". Pixels close to each other are close in the order. Only the low bits of the order tell pixels
+// apart once it is multiplied by the samples per pixel, which is fine for images up to thousands of pixels across
+uint32_t Sampler::pixel_order(uint32_t x, uint32_t y, uint64_t seed)
+{
+  uint32_t order = 0, prefix = 0;
+  for(int level = 15; level >= 0; level--)
+  {
+    // A permutation of the four quadrants from the hash of the quadrants above
+    uint64_t hash = mix(seed + prefix * GOLDEN + level);
+    unsigned char permutation[4] = { 0, 1, 2, 3 };
+    for(int i = 3; i > 0; i--)
+    {
+      std::swap(permutation[i], permutation[hash % (i + 1)]);
+      hash /= i + 1;
+    }
+
+    uint32_t quadrant = ((x >> level) & 1) | (((y >> level) & 1) << 1);
+    prefix = (prefix << 2) | quadrant;
+    order = (order << 2) | permutation[quadrant];
+  }
+  return order;
+}
+
+// Each of a set of rays takes a different one of count strata in both coordinates of a pair, matched up at random,
+// so that the set covers the square evenly in each coordinate for any count
+double Sampler::latin_hypercube(uint32_t d, uint32_t j, uint32_t count) const
+{
+  uint32_t pair = d >> 1, component = d & 1;
+  uint64_t hash = mix(mix(m_pixel + GOLDEN * (pair + 1)) + m_sample);
+  uint32_t stratum = component ? permute(j, count, (uint32_t)hash) : j;
+  double jitter = (mix(hash + GOLDEN * (j + 1) + component) >> 11) * (1.0 / 9007199254740992.0);
+  return (stratum + jitter) / count;
+}
+
+double Sampler::low_discrepancy(uint32_t d, uint32_t j, uint32_t count) const
+{
+  uint32_t index = m_sample * count + j;
+  uint32_t pair = d >> 1, component = d & 1;
+
+  if(m_type == SamplerType::BLUE_NOISE)
+  {
+    // Pixels take consecutive runs of one sequence in the order above, so the points of a block of pixels are spread
+    // as evenly as those of a single pixel and their errors cancel out. The shuffle keeps runs of a power of two
+    // together
+    uint64_t hash = mix(mix(m_seed + GOLDEN) + GOLDEN * (pair + 1));
+    uint32_t i = owen_scramble((uint32_t)((((uint64_t)m_order * m_samples + m_sample) * count) + j), (uint32_t)hash);
+    return owen_scramble(sobol(i, component), (uint32_t)mix(hash + component + 1)) * TO_UNIT;
+  }
+
+  // The index is shuffled so the pairs of dimensions are independent of each other
+  uint64_t hash = mix(m_pixel + GOLDEN * (pair + 1));
+  uint32_t i = owen_scramble(index, (uint32_t)hash);
+  uint64_t scramble = mix(hash + component + 1);
+
+  if(m_type == SamplerType::HALTON && component == 1) return scrambled_radical_inverse3(i, scramble);
+  return owen_scramble(sobol(i, m_type == SamplerType::HALTON ? 0 : component), (uint32_t)scramble) * TO_UNIT;
+}
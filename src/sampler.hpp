@@ -0,0 +1,94 @@
+#ifndef CS488_SAMPLER_HPP
+#define CS488_SAMPLER_HPP
+
+#include <string>
+#include <cstdint>
+
+// How the random numbers of the samples in a pixel are spread
+enum class SamplerType {
+  RANDOM,     // Independent, the pixel is still stratified into an aa by aa grid and sets of rays into Latin hypercubes
+  HALTON,     // Halton points in bases 2 and 3 with their digits randomly permuted
+  SOBOL,      // Sobol points with hash-based Owen scrambling
+  BLUE_NOISE  // Sobol points shared out between the pixels so that the error in neighbouring pixels cancels out, and
+              // is high frequency (blue noise) across the image
+};
+
+// Sets type to the sampler with the given name: random, halton, sobol or blue_noise. Returns false for any other name
+bool sampler_type(const std::string& name, SamplerType& type);
+
+// The random numbers of a single sample. They depend only on the render's seed, the pixel, the sample within the
+// pixel and the dimension, so a sample sees the same numbers whichever thread or tile renders it and in whatever
+// order, and renders are reproducible.
+//
+// Sample sets are allocated dimensions as they are used: the pixel position first, then a pair per set of shadow
+// rays to a light, per set of glossy reflections and so on down the path. The low discrepancy samplers are padded:
+// every pair of dimensions is a 2D sequence of its own, made independent of the other pairs by scrambling, with a
+// point for each sample in the pixel times each ray of the set that sample casts. So the shadow rays to a light that
+// all of a pixel's samples cast are well spread over the light, not just those of one sample.
+class Sampler {
+public:
+  // The pixel takes up to samples samples, of which this is the given one
+  Sampler(SamplerType type, uint64_t seed, uint32_t x, uint32_t y, uint32_t sample, uint32_t samples)
+    : m_type(type)
+    , m_seed(seed)
+    , m_sample(sample)
+    , m_samples(samples)
+    , m_pixel(mix(mix(seed + GOLDEN) + (((uint64_t)y << 32) | x)))
+    , m_order(type == SamplerType::BLUE_NOISE ? pixel_order(x, y, seed) : 0)
+    , m_dimension(0)
+  {
+  }
+
+  // Reserves n dimensions (rounded up to pairs) and returns the first
+  uint32_t dimensions(uint32_t n)
+  {
+    uint32_t first = m_dimension;
+    m_dimension += (n + 1) & ~1u;
+    return first;
+  }
+
+  // Coordinate d of ray j of count rays in a set that this sample casts, in [0, 1)
+  double get(uint32_t d, uint32_t j = 0, uint32_t count = 1) const
+  {
+    if(m_type == SamplerType::RANDOM && count == 1)
+    {
+      return (mix(mix(m_pixel + GOLDEN * (d + 1)) + m_sample) >> 11) * (1.0 / 9007199254740992.0);
+    }
+    return m_type == SamplerType::RANDOM ? latin_hypercube(d, j, count) : low_discrepancy(d, j, count);
+  }
+
+  // A number for a one-off choice
+  double uniform()
+  {
+    return get(dimensions(1));
+  }
+
+  SamplerType type() const
+  {
+    return m_type;
+  }
+
+  // The finalizer of SplitMix64, which passes BigCrush when fed a counter
+  static uint64_t mix(uint64_t z)
+  {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+  }
+
+private:
+  static const uint64_t GOLDEN = 0x9E3779B97F4A7C15ULL;
+
+  static uint32_t pixel_order(uint32_t x, uint32_t y, uint64_t seed);
+  double latin_hypercube(uint32_t d, uint32_t j, uint32_t count) const;
+  double low_discrepancy(uint32_t d, uint32_t j, uint32_t count) const;
+
+  SamplerType m_type;
+  uint64_t m_seed;
+  uint32_t m_sample, m_samples;
+  uint64_t m_pixel;
+  uint32_t m_order;
+  uint32_t m_dimension;
+};
+
+#endif
@@ -1,6 +1,49 @@
 #include "scene.hpp"
 #include <iostream>
 #include <cctype>
+#include <limits>
+#include <algorithm>
+
+namespace {
+
+BoundingBox infinite_bounds()
+{
+  double inf = std::numeric_limits<double>::infinity();
+  return BoundingBox(Point3D(-inf, -inf, -inf), Point3D(inf, inf, inf));
+}
+
+// Bounds of a box after a transform, from its corners
+BoundingBox transform_bounds(const Matrix4x4& M, const BoundingBox& b)
+{
+  if(b.empty()) return b;
+  for(int i = 0; i < 3; i++) if(std::isinf(b.min()[i]) || std::isinf(b.max()[i])) return infinite_bounds();
+
+  BoundingBox result;
+  for(int k = 0; k < 8; k++)
+  {
+    result.extend(M * Point3D((k & 1) ? b.max()[0] : b.min()[0], (k & 2) ? b.max()[1] : b.min()[1], (k & 4) ? b.max()[2] : b.min()[2]));
+  }
+  return result;
+}
+
+// Brings the spans from first on, found along inverse * ray in a node's model coordinates, back to the coordinates
+// of the ray. Directions are kept at unit length so distances along the ray scale by how much the inverse stretches it
+void spans_to_parent(const Matrix4x4& trans, const Matrix4x4& inverse, const Ray& ray, std::vector<Span>& spans, size_t first)
+{
+  double scale = 1.0 / (inverse * ray.direction()).length();
+  for(size_t k = first; k < spans.size(); k++)
+  {
+    Span& span = spans[k];
+    span.t0 *= scale;
+    span.t1 *= scale;
+    span.enter.q = trans * span.enter.q;
+    span.enter.n = transNorm(inverse, span.enter.n);
+    span.exit.q = trans * span.exit.q;
+    span.exit.n = transNorm(inverse, span.exit.n);
+  }
+}
+
+}
 
 SceneNode::SceneNode(const std::string& name)
   : m_name(name)
@@ -34,7 +77,7 @@ bool SceneNode::is_joint() const
 bool SceneNode::intersect(const Ray& ray, Intersection& i) const
 {
   // Transform the ray from WCS->MCS for this node
-  Ray r(m_invtrans * ray.origin(), m_invtrans * ray.direction());
+  Ray r = m_invtrans * ray;
 
   bool intersects = false;
   for(auto child : m_children)
@@ -113,15 +156,23 @@ void JointNode::set_joint_y(double min, double init, double max)
 
 GeometryNode::GeometryNode(const std::string& name, std::shared_ptr<Primitive> primitive)
   : SceneNode(name),
-    m_primitive(primitive)
+    m_primitive(primitive),
+    m_folded(false)
 {
 }
 
 bool GeometryNode::intersect(const Ray& ray, Intersection& i) const
 {
+  if(m_folded)
+  {
+    bool intersects = m_primitive->intersect(ray, i);
+    if(intersects) i.m = m_material;
+    return (intersects || SceneNode::intersect(ray, i));
+  }
+
   // Test for intersection
   // But first transform ray to geometry's model coordinates (inverse transform from WCS->MCS)
-  Ray r(m_invtrans * ray.origin(), m_invtrans * ray.direction());
+  Ray r = m_invtrans * ray;
 
   Intersection k;
   bool intersects = m_primitive->intersect(r, k);
@@ -131,11 +182,39 @@ bool GeometryNode::intersect(const Ray& ray, Intersection& i) const
     i.q = m_trans * i.q;
     i.n = transNorm(m_invtrans, i.n);
     i.m = m_material;
+    i.surface = m_primitive.get();
   }
 
   return (intersects || SceneNode::intersect(ray, i));
 }
 
+void GeometryNode::spans(const Ray& ray, std::vector<Span>& spans) const
+{
+  size_t first = spans.size();
+  m_primitive->spans(m_folded ? ray : m_invtrans * ray, spans);
+
+  for(size_t k = first; k < spans.size(); k++) spans[k].enter.m = spans[k].exit.m = m_material;
+  if(!m_folded) spans_to_parent(m_trans, m_invtrans, ray, spans, first);
+}
+
+BoundingBox GeometryNode::bounds() const
+{
+  return transform_bounds(m_trans, m_primitive->bounds());
+}
+
+void GeometryNode::flatten()
+{
+  SceneNode::flatten();
+
+  // The children have taken the transform already, so it can go into the quadric's coefficients in its place
+  std::shared_ptr<Quadric> quadric = m_primitive ? m_primitive->quadric() : nullptr;
+  if(!quadric) return;
+
+  m_primitive = quadric->transformed(m_invtrans, bounds(), m_primitive);
+  set_transform(Matrix4x4(), Matrix4x4());
+  m_folded = true;
+}
+
 GeometryNode::~GeometryNode()
 {
 }
@@ -144,6 +223,8 @@ ConstructiveSolidGeometryNode::ConstructiveSolidGeometryNode(const std::string&
   : GeometryNode(name, NULL)
   , m_A(A)
   , m_B(B)
+  , m_bounds_A(infinite_bounds())
+  , m_bounds_B(infinite_bounds())
 {
 }
 
@@ -151,113 +232,173 @@ ConstructiveSolidGeometryNode::~ConstructiveSolidGeometryNode()
 {
 }
 
-UnionNode::UnionNode(const std::string& name, std::shared_ptr<GeometryNode> A, std::shared_ptr<GeometryNode> B)
-  : ConstructiveSolidGeometryNode(name, A, B)
-{
-}
-
-bool UnionNode::intersect(const Ray& ray, Intersection& i) const
+bool ConstructiveSolidGeometryNode::intersect(const Ray& ray, Intersection& i) const
 {
-  Ray r(m_invtrans * ray.origin(), m_invtrans * ray.direction());
+  Ray r = m_invtrans * ray;
 
-  Intersection j, k;
-  bool intersects_a = m_A->intersect(r, j);
-  bool intersects_b = m_B->intersect(r, k);
+  std::vector<Span> spans;
+  combine(r, spans);
 
-  if(intersects_a || intersects_b)
+  // The visible point is where the ray first enters the result, or where it leaves if it starts inside
+  for(auto& span : spans)
   {
-    i = (std::isinf(j.q[0]) || std::isinf(j.q[1]) || std::isinf(j.q[2]) || (k.q-r.origin()).length() < (j.q-r.origin()).length()) ? k : j;
+    if(span.t1 < 0.0) continue;
+
+    i = (span.t0 >= 0.0) ? span.enter : span.exit;
     i.q = m_trans * i.q;
     i.n = transNorm(m_invtrans, i.n);
+    return true;
   }
 
-  return (intersects_a || intersects_b || SceneNode::intersect(ray, i));
-}
-
-UnionNode::~UnionNode()
-{
+  return false;
 }
 
-IntersectionNode::IntersectionNode(const std::string& name, std::shared_ptr<GeometryNode> A, std::shared_ptr<GeometryNode> B)
-  : ConstructiveSolidGeometryNode(name, A, B)
+void ConstructiveSolidGeometryNode::spans(const Ray& ray, std::vector<Span>& spans) const
 {
+  size_t first = spans.size();
+  combine(m_invtrans * ray, spans);
+  spans_to_parent(m_trans, m_invtrans, ray, spans, first);
 }
 
-bool IntersectionNode::intersect(const Ray& ray, Intersection& i) const
+BoundingBox ConstructiveSolidGeometryNode::bounds() const
 {
-  Ray r(m_invtrans * ray.origin(), m_invtrans * ray.direction());
-
-  Intersection j, k;
-  bool intersects_a = m_A->intersect(r, j);
-  bool intersects_b = m_B->intersect(r, k);
+  BoundingBox a = m_A->bounds(), b = m_B->bounds();
+  bool a_alone = inside(true, false), b_alone = inside(false, true);
 
-  if(intersects_a && intersects_b)
+  BoundingBox result;
+  if(a_alone) result.extend(a);
+  if(b_alone) result.extend(b);
+  if(!a_alone && !b_alone)
   {
-    i = ((k.q-r.origin()).length() > (j.q-r.origin()).length()) ? k : j;
-    i.q = m_trans * i.q;
-    i.n = transNorm(m_invtrans, i.n);
+    // Only where both are, so the overlap of their bounds
+    Point3D min, max;
+    for(int i = 0; i < 3; i++)
+    {
+      min[i] = std::max(a.min()[i], b.min()[i]);
+      max[i] = std::min(a.max()[i], b.max()[i]);
+    }
+    result = BoundingBox(min, max);
   }
 
-  return ((intersects_a && intersects_b) || SceneNode::intersect(ray, i));
+  return transform_bounds(m_trans, result);
 }
 
-IntersectionNode::~IntersectionNode()
+void ConstructiveSolidGeometryNode::flatten()
 {
-}
+  GeometryNode::flatten();
 
-DifferenceNode::DifferenceNode(const std::string& name, std::shared_ptr<GeometryNode> A, std::shared_ptr<GeometryNode> B)
-  : ConstructiveSolidGeometryNode(name, A, B)
-{
+  m_A->flatten();
+  m_B->flatten();
+  m_bounds_A = m_A->bounds();
+  m_bounds_B = m_B->bounds();
 }
 
-bool DifferenceNode::intersect(const Ray& ray, Intersection& i) const
+void ConstructiveSolidGeometryNode::combine(const Ray& r, std::vector<Span>& spans) const
 {
-  Ray r(m_invtrans * ray.origin(), m_invtrans * ray.direction());
-
-  Intersection j, k;
-  bool intersects_a = m_A->intersect(r, j);
-  bool intersects_b = m_B->intersect(r, k);
-
-  bool intersects = false;
-  if(intersects_a)
+  double inf = std::numeric_limits<double>::infinity();
+  Vector3D inv_dir(1.0 / r.direction()[0], 1.0 / r.direction()[1], 1.0 / r.direction()[2]);
+
+  std::vector<Span> a, b;
+  double t0 = -inf, t1 = inf;
+  if(m_bounds_A.intersect(r.origin(), inv_dir, t0, t1)) m_A->spans(r, a);
+
+  // If the result is only ever inside B where A is too, B doesn't matter outside A's spans
+  bool b_alone = inside(false, true);
+  if(a.empty() && !b_alone) return;
+  t0 = b_alone ? -inf : a.front().t0;
+  t1 = b_alone ? inf : a.back().t1;
+  if(m_bounds_B.intersect(r.origin(), inv_dir, t0, t1)) m_B->spans(r, b);
+
+  // The ends of both operands' spans in order along the ray. Where they meet, A's go first
+  struct Boundary {
+    double t;
+    bool b;
+    bool enter;
+    const Intersection* j;
+  };
+  std::vector<Boundary> boundaries;
+  boundaries.reserve(2*(a.size() + b.size()));
+  size_t ia = 0, ib = 0;
+  while(ia < 2*a.size() || ib < 2*b.size())
   {
-    double epsilon = std::numeric_limits<double>::epsilon();
-    if(intersects_b && ((k.q-r.origin()).length() < (j.q-r.origin()).length()))
+    double ta = (ia < 2*a.size()) ? ((ia % 2) ? a[ia/2].t1 : a[ia/2].t0) : inf;
+    double tb = (ib < 2*b.size()) ? ((ib % 2) ? b[ib/2].t1 : b[ib/2].t0) : inf;
+    if(ia < 2*a.size() && ta <= tb)
     {
-      int idx = (fabs(r.direction()[0]) > epsilon) ? 0 : ((fabs(r.direction()[1]) > epsilon) ? 1 : 2);
-      double t = (j.q[idx] - r.origin()[idx]) / r.direction()[idx];
-      Ray nray(r.origin() + (t+1000*epsilon)*r.direction(), r.direction());
-
-      Intersection u, v;
-      intersects_a = m_A->intersect(nray, u);
-      intersects_b = m_B->intersect(nray, v);
-
-      if(!intersects_b)
-      {
-        i = j;
-        intersects = true;
-      }
-      else if(intersects_a && ((v.q-r.origin()).length() < (u.q-r.origin()).length()))
-      {
-        i = v;
-        i.n = -i.n;
-        intersects = true;
-      }
+      boundaries.push_back(Boundary{ ta, false, ia % 2 == 0, (ia % 2) ? &a[ia/2].exit : &a[ia/2].enter });
+      ia++;
     }
     else
     {
-      i = j;
-      intersects = true;
+      boundaries.push_back(Boundary{ tb, true, ib % 2 == 0, (ib % 2) ? &b[ib/2].exit : &b[ib/2].enter });
+      ib++;
     }
   }
 
-  if(intersects)
+  // Track whether the ray is inside each operand, the result starts or ends wherever its inside changes
+  bool in_a = false, in_b = false, in = false;
+  for(auto& boundary : boundaries)
   {
-    i.q = m_trans * i.q;
-    i.n = transNorm(m_invtrans, i.n);
+    (boundary.b ? in_b : in_a) = boundary.enter;
+    bool now = inside(in_a, in_b);
+    if(now == in) continue;
+
+    // The operand's normal points out of the result unless the result is on the operand's outside, e.g. where the
+    // ray leaves the solid being subtracted
+    Intersection j = *boundary.j;
+    if(now != boundary.enter) j.n = -j.n;
+
+    if(now)
+    {
+      spans.push_back(Span());
+      spans.back().t0 = boundary.t;
+      spans.back().enter = j;
+    }
+    else
+    {
+      spans.back().t1 = boundary.t;
+      spans.back().exit = j;
+    }
+    in = now;
   }
-    
-  return (intersects || SceneNode::intersect(ray, i));
+}
+
+UnionNode::UnionNode(const std::string& name, std::shared_ptr<GeometryNode> A, std::shared_ptr<GeometryNode> B)
+  : ConstructiveSolidGeometryNode(name, A, B)
+{
+}
+
+bool UnionNode::inside(bool a, bool b) const
+{
+  return a || b;
+}
+
+UnionNode::~UnionNode()
+{
+}
+
+IntersectionNode::IntersectionNode(const std::string& name, std::shared_ptr<GeometryNode> A, std::shared_ptr<GeometryNode> B)
+  : ConstructiveSolidGeometryNode(name, A, B)
+{
+}
+
+bool IntersectionNode::inside(bool a, bool b) const
+{
+  return a && b;
+}
+
+IntersectionNode::~IntersectionNode()
+{
+}
+
+DifferenceNode::DifferenceNode(const std::string& name, std::shared_ptr<GeometryNode> A, std::shared_ptr<GeometryNode> B)
+  : ConstructiveSolidGeometryNode(name, A, B)
+{
+}
+
+bool DifferenceNode::inside(bool a, bool b) const
+{
+  return a && !b;
 }
 
 DifferenceNode::~DifferenceNode()
@@ -3,6 +3,7 @@
 
 #include <list>
 #include <memory>
+#include <vector>
 #include "algebra.hpp"
 #include "primitive.hpp"
 #include "mesh.hpp"
@@ -93,6 +94,16 @@ public:
 
   virtual bool intersect(const Ray& ray, Intersection& i) const;
 
+  // Appends the spans of the ray inside the node's solid, see Primitive::spans. The ray and the spans are in the
+  // coordinates of the node's parent
+  virtual void spans(const Ray& ray, std::vector<Span>& spans) const;
+
+  // Bounds in the coordinates of the node's parent
+  virtual BoundingBox bounds() const;
+
+  // Also folds the node's transform into primitives that are quadrics, see Quadric
+  virtual void flatten();
+
   std::shared_ptr<const Material> get_material()
   {
     return m_material;
@@ -111,18 +122,34 @@ public:
 protected:
   std::shared_ptr<Material> m_material;
   std::shared_ptr<Primitive> m_primitive;
+  bool m_folded; // The primitive is already in the coordinates of the node's parent
 };
 
+// Combines the solids of two operands. Both are reduced to the spans of the ray inside them and the spans of the result
+// are found in a single pass over their ends, so nested nodes cost one intersection per primitive. An operand is only
+// intersected where the ray passes through its bounds and, if the result can't contain it alone, through A's spans
 class ConstructiveSolidGeometryNode : public GeometryNode {
 public:
   ConstructiveSolidGeometryNode(const std::string& name, std::shared_ptr<GeometryNode> A, std::shared_ptr<GeometryNode> B);
   virtual ~ConstructiveSolidGeometryNode();
 
-  virtual bool intersect(const Ray& ray, Intersection& i) const = 0;
+  virtual bool intersect(const Ray& ray, Intersection& i) const;
+  virtual void spans(const Ray& ray, std::vector<Span>& spans) const;
+  virtual BoundingBox bounds() const;
+
+  // Also flattens the operands and keeps their bounds
+  virtual void flatten();
 
 protected:
+  // Whether a point is inside the result given whether it is inside each operand. Points outside both must be outside
+  virtual bool inside(bool a, bool b) const = 0;
+
+  // Appends the spans of the result along a ray in the node's model coordinates
+  void combine(const Ray& r, std::vector<Span>& spans) const;
+
   std::shared_ptr<GeometryNode> m_A;
   std::shared_ptr<GeometryNode> m_B;
+  BoundingBox m_bounds_A, m_bounds_B; // In model coordinates
 };
 
 class UnionNode : public ConstructiveSolidGeometryNode {
@@ -130,7 +157,8 @@ public:
   UnionNode(const std::string& name, std::shared_ptr<GeometryNode> A, std::shared_ptr<GeometryNode> B);
   virtual ~UnionNode();
 
-  virtual bool intersect(const Ray& ray, Intersection& i) const;
+protected:
+  virtual bool inside(bool a, bool b) const;
 };
 
 class IntersectionNode : public ConstructiveSolidGeometryNode {
@@ -138,7 +166,8 @@ public:
   IntersectionNode(const std::string& name, std::shared_ptr<GeometryNode> A, std::shared_ptr<GeometryNode> B);
   virtual ~IntersectionNode();
 
-  virtual bool intersect(const Ray& ray, Intersection& i) const;
+protected:
+  virtual bool inside(bool a, bool b) const;
 };
 
 class DifferenceNode : public ConstructiveSolidGeometryNode {
@@ -146,7 +175,8 @@ public:
   DifferenceNode(const std::string& name, std::shared_ptr<GeometryNode> A, std::shared_ptr<GeometryNode> B);
   virtual ~DifferenceNode();
 
-  virtual bool intersect(const Ray& ray, Intersection& i) const;
+protected:
+  virtual bool inside(bool a, bool b) const;
 };
 
 #endif
@@ -40,12 +40,18 @@
 #include <cctype>
 #include <cstring>
 #include <cstdio>
+#include <climits>
+#include <fstream>
 #include <vector>
 #include <memory>
 #include "lua488.hpp"
 #include "light.hpp"
 #include "a4.hpp"
 #include "mesh.hpp"
+#include "objloader.hpp"
+#include "meshcache.hpp"
+#include "spherecloud.hpp"
+#include "heightfield.hpp"
 #include "image.hpp"
 
 // Uncomment the following line to enable debugging messages
@@ -72,6 +78,28 @@
 // we can easily keep around the data, all we lose is the extra
 // pointers to it.
 
+// Hash of the script being run and of every file it has loaded, so
+// that a render can tell whether a checkpoint is of the same scene
+static uint64_t scene_fingerprint = 0;
+
+static void fingerprint_hash(uint64_t h)
+{
+  scene_fingerprint = (scene_fingerprint ^ h) * 0x9E3779B97F4A7C15ULL;
+}
+
+// Folds the contents of a file into the scene fingerprint. It's read
+// a block at a time so that large files aren't held in memory twice
+static void fingerprint_file(const char* filename)
+{
+  std::ifstream file(filename, std::ios::binary);
+  std::vector<char> block(1 << 20);
+  while (file) {
+    file.read(block.data(), block.size());
+    if (file.gcount() == 0) break;
+    fingerprint_hash(mesh_cache_hash(block.data(), file.gcount()));
+  }
+}
+
 // The "userdata" type for a node. Objects of this type will be
 // allocated by Lua to represent nodes.
 struct gr_node_ud {
@@ -90,6 +118,41 @@ struct gr_light_ud {
   std::shared_ptr<Light> light;
 };
 
+// The "userdata" type for a buffer of points, allocated by Lua to hold
+// mesh vertices. Buffers are handed to the mesh commands without copying
+// so the vector is shared. Writing to a shared buffer gives it its own
+// copy first, so meshes never change after they are made.
+struct gr_vec3_buffer_ud {
+  std::shared_ptr< std::vector<Point3D> > data;
+};
+
+// The "userdata" type for a buffer of mesh indices. Shared in the same
+// way as gr_vec3_buffer_ud.
+struct gr_index_buffer_ud {
+  std::shared_ptr< std::vector<unsigned int> > data;
+};
+
+// Returns the buffer's vector, copying it first if a mesh is using it.
+template<typename T>
+std::vector<T>& get_writable(std::shared_ptr< std::vector<T> >& data)
+{
+  if (data.use_count() > 1) data = std::make_shared< std::vector<T> >(*data);
+  return *data;
+}
+
+// Like luaL_checkudata but returns 0 instead of raising an error if the
+// argument isn't userdata of the given type.
+template<typename T>
+T* test_udata(lua_State* L, int arg, const char* type)
+{
+  T* data = (T*)lua_touserdata(L, arg);
+  if (data == 0 || !lua_getmetatable(L, arg)) return 0;
+  luaL_getmetatable(L, type);
+  bool same = lua_rawequal(L, -1, -2);
+  lua_pop(L, 2);
+  return same ? data : 0;
+}
+
 // Useful function to retrieve and check an n-tuple of numbers.
 template<typename T>
 void get_tuple(lua_State* L, int arg, T* data, int n)
@@ -103,6 +166,159 @@ void get_tuple(lua_State* L, int arg, T* data, int n)
   }
 }
 
+// Read the optional table of options for a triangle mesh, e.g.
+// {weld=true, reorder=false}
+void get_mesh_options(lua_State* L, int arg, MeshOptions& options)
+{
+  if (lua_isnoneornil(L, arg)) return;
+  luaL_checktype(L, arg, LUA_TTABLE);
+
+  lua_getfield(L, arg, "weld");
+  options.weld = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, arg, "reorder");
+  if (!lua_isnil(L, -1)) options.reorder = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, arg, "compress");
+  options.compress = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, arg, "lod");
+  options.lod = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+}
+
+// Read the optional table of options for a render, e.g.
+// {adaptive=true, aa_threshold=0.005, sample_map="samples.png"}
+void get_render_options(lua_State* L, int arg, RenderOptions& options)
+{
+  if (lua_isnoneornil(L, arg)) return;
+  luaL_checktype(L, arg, LUA_TTABLE);
+
+  lua_getfield(L, arg, "adaptive");
+  options.adaptive = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, arg, "aa_threshold");
+  options.aa_threshold = luaL_optnumber(L, -1, options.aa_threshold);
+  lua_pop(L, 1);
+  luaL_argcheck(L, options.aa_threshold >= 0.0, arg, "aa_threshold must not be negative");
+
+  // Counts are checked while they are still numbers, converting a negative number to unsigned is undefined
+  lua_getfield(L, arg, "aa_base_samples");
+  double aa_base_samples = luaL_optnumber(L, -1, options.aa_base_samples);
+  lua_pop(L, 1);
+  luaL_argcheck(L, aa_base_samples >= 1 && aa_base_samples <= UINT_MAX, arg, "aa_base_samples must be at least 1");
+  options.aa_base_samples = aa_base_samples;
+
+  lua_getfield(L, arg, "subdivide");
+  options.subdivide = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, arg, "aa_contrast");
+  options.aa_contrast = luaL_optnumber(L, -1, options.aa_contrast);
+  lua_pop(L, 1);
+  luaL_argcheck(L, options.aa_contrast >= 0.0, arg, "aa_contrast must not be negative");
+
+  lua_getfield(L, arg, "progressive");
+  options.progressive = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, arg, "time_budget");
+  options.time_budget = luaL_optnumber(L, -1, options.time_budget);
+  lua_pop(L, 1);
+  luaL_argcheck(L, options.time_budget >= 0.0, arg, "time_budget must not be negative");
+
+  lua_getfield(L, arg, "snapshot_interval");
+  options.snapshot_interval = luaL_optnumber(L, -1, options.snapshot_interval);
+  lua_pop(L, 1);
+  luaL_argcheck(L, options.snapshot_interval >= 0.0, arg, "snapshot_interval must not be negative");
+
+  lua_getfield(L, arg, "noise_target");
+  options.noise_target = luaL_optnumber(L, -1, options.noise_target);
+  lua_pop(L, 1);
+  luaL_argcheck(L, options.noise_target >= 0.0, arg, "noise_target must not be negative");
+
+  lua_getfield(L, arg, "checkpoint");
+  options.checkpoint = luaL_optstring(L, -1, "");
+  lua_pop(L, 1);
+
+  lua_getfield(L, arg, "checkpoint_interval");
+  options.checkpoint_interval = luaL_optnumber(L, -1, options.checkpoint_interval);
+  lua_pop(L, 1);
+  luaL_argcheck(L, options.checkpoint_interval >= 0.0, arg, "checkpoint_interval must not be negative");
+
+  lua_getfield(L, arg, "resume");
+  options.resume = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, arg, "seed");
+  double seed = luaL_optnumber(L, -1, options.seed);
+  lua_pop(L, 1);
+  luaL_argcheck(L, seed >= 0 && seed < 18446744073709551616.0, arg, "seed can't be negative");
+  options.seed = seed;
+
+  lua_getfield(L, arg, "sampler");
+  const char* sampler = luaL_optstring(L, -1, "random");
+  luaL_argcheck(L, sampler_type(sampler, options.sampler), arg, "sampler must be random, halton, sobol or blue_noise");
+  lua_pop(L, 1);
+
+  lua_getfield(L, arg, "roulette_threshold");
+  options.roulette_threshold = luaL_optnumber(L, -1, options.roulette_threshold);
+  lua_pop(L, 1);
+  luaL_argcheck(L, options.roulette_threshold >= 0.0, arg, "roulette_threshold must not be negative");
+
+  lua_getfield(L, arg, "branch_bounces");
+  double branch_bounces = luaL_optnumber(L, -1, options.branch_bounces);
+  lua_pop(L, 1);
+  luaL_argcheck(L, branch_bounces >= 0 && branch_bounces <= UINT_MAX, arg, "branch_bounces can't be negative");
+  options.branch_bounces = branch_bounces;
+
+  lua_getfield(L, arg, "adaptive_shadows");
+  options.adaptive_shadows = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, arg, "shadow_probes");
+  double shadow_probes = luaL_optnumber(L, -1, options.shadow_probes);
+  lua_pop(L, 1);
+  luaL_argcheck(L, shadow_probes >= 1 && shadow_probes <= UINT_MAX, arg, "shadow_probes must be at least 1");
+  options.shadow_probes = shadow_probes;
+
+  lua_getfield(L, arg, "light_threshold");
+  options.light_threshold = luaL_optnumber(L, -1, options.light_threshold);
+  lua_pop(L, 1);
+  luaL_argcheck(L, options.light_threshold >= 0.0, arg, "light_threshold must not be negative");
+
+  lua_getfield(L, arg, "sample_map");
+  options.sample_map = luaL_optstring(L, -1, "");
+  lua_pop(L, 1);
+}
+
+// Meshes may be given as a gr.vec3_buffer of vertices and a
+// gr.index_buffer with three indices per triangle instead of tables.
+// Returns false if arguments 2 and 3 aren't buffers.
+bool get_mesh_buffers(lua_State* L, Buffer<Point3D>& verts, Buffer<unsigned int>& indices)
+{
+  gr_vec3_buffer_ud* vert_data = test_udata<gr_vec3_buffer_ud>(L, 2, "gr.vec3_buffer");
+  if (!vert_data) return false;
+
+  gr_index_buffer_ud* index_data = (gr_index_buffer_ud*)luaL_checkudata(L, 3, "gr.index_buffer");
+  luaL_argcheck(L, index_data != 0, 3, "Index buffer expected");
+
+  size_t vert_count = vert_data->data->size();
+  luaL_argcheck(L, vert_count >= 1, 2, "Vertices expected");
+  luaL_argcheck(L, index_data->data->size() >= 3 && index_data->data->size() % 3 == 0, 3, "Triangle indices expected");
+  for (unsigned int i : *index_data->data) {
+    luaL_argcheck(L, i < vert_count, 3, "Index out of range");
+  }
+
+  verts = Buffer<Point3D>(vert_data->data);
+  indices = Buffer<unsigned int>(index_data->data);
+  return true;
+}
+
 // Create a node
 extern "C"
 int gr_node_cmd(lua_State* L)
@@ -476,6 +692,74 @@ int gr_nh_disc_cmd(lua_State* L)
   return 1;
 }
 
+// Create a sphere cloud node. The radii may be given per sphere or as a single number shared by every sphere
+extern "C"
+int gr_sphere_cloud_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+  
+  gr_node_ud* data = (gr_node_ud*)lua_newuserdata(L, sizeof(gr_node_ud));
+  std::shared_ptr<SceneNode> temp;
+  memcpy(&data->node, &temp, sizeof(std::shared_ptr<SceneNode>));
+  data->node = nullptr;
+
+  const char* name = luaL_checkstring(L, 1);
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  int center_count = luaL_getn(L, 2);
+
+  luaL_argcheck(L, center_count >= 1, 2, "Tuple of centers expected");
+
+  std::vector<Point3D> centers(center_count);
+  for (int i = 1; i <= center_count; i++) {
+    lua_rawgeti(L, 2, i);
+    get_tuple(L, -1, &centers[i - 1][0], 3);
+    lua_pop(L, 1);
+  }
+
+  std::vector<double> radii;
+  if (lua_istable(L, 3)) {
+    luaL_argcheck(L, luaL_getn(L, 3) == center_count, 3, "One radius per center expected");
+    radii.resize(center_count);
+    get_tuple(L, 3, &radii[0], center_count);
+  } else {
+    radii.assign(center_count, luaL_checknumber(L, 3));
+  }
+
+  data->node = std::make_shared<GeometryNode>(name, std::make_shared<SphereCloud>(centers, radii));
+
+  luaL_getmetatable(L, "gr.node");
+  lua_setmetatable(L, -2);
+
+  return 1;
+}
+
+// Create a heightfield node from a grayscale png file
+extern "C"
+int gr_heightfield_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+  
+  gr_node_ud* data = (gr_node_ud*)lua_newuserdata(L, sizeof(gr_node_ud));
+  std::shared_ptr<SceneNode> temp;
+  memcpy(&data->node, &temp, sizeof(std::shared_ptr<SceneNode>));
+  data->node = nullptr;
+
+  const char* name = luaL_checkstring(L, 1);
+  const char* filename = luaL_checkstring(L, 2);
+
+  Image heights;
+  luaL_argcheck(L, heights.loadPng(filename), 2, "Failed to load png file");
+  fingerprint_file(filename);
+
+  data->node = std::make_shared<GeometryNode>(name, std::make_shared<Heightfield>(heights));
+
+  luaL_getmetatable(L, "gr.node");
+  lua_setmetatable(L, -2);
+
+  return 1;
+}
+
 // Create a CSG union node
 extern "C"
 int gr_csg_union_cmd(lua_State* L)
@@ -588,6 +872,16 @@ int gr_mesh_cmd(lua_State* L)
 
   const char* name = luaL_checkstring(L, 1);
 
+  Buffer<Point3D> vert_buffer;
+  Buffer<unsigned int> index_buffer;
+  if (get_mesh_buffers(L, vert_buffer, index_buffer)) {
+    data->node = std::make_shared<GeometryNode>(name, std::make_shared<Mesh>(vert_buffer, index_buffer));
+
+    luaL_getmetatable(L, "gr.node");
+    lua_setmetatable(L, -2);
+    return 1;
+  }
+
   std::vector<Point3D> verts;
   std::vector< std::vector<int> > faces;
 
@@ -642,6 +936,13 @@ extern "C"
 int gr_tri_mesh_cmd(lua_State* L)
 {
   GRLUA_DEBUG_CALL;
+
+  // This needs to be done before newuserdata pushes the userdata on to the stack.
+  // A vertex buffer is shared with the mesh unless it's asked to be reordered,
+  // which copies it
+  MeshOptions options;
+  if (test_udata<gr_vec3_buffer_ud>(L, 2, "gr.vec3_buffer")) options.reorder = false;
+  get_mesh_options(L, 4, options);
   
   gr_node_ud* data = (gr_node_ud*)lua_newuserdata(L, sizeof(gr_node_ud));
   std::shared_ptr<SceneNode> temp;
@@ -650,6 +951,16 @@ int gr_tri_mesh_cmd(lua_State* L)
 
   const char* name = luaL_checkstring(L, 1);
 
+  Buffer<Point3D> vert_buffer;
+  Buffer<unsigned int> index_buffer;
+  if (get_mesh_buffers(L, vert_buffer, index_buffer)) {
+    data->node = std::make_shared<GeometryNode>(name, std::make_shared<TriMesh>(vert_buffer, Buffer<Vector3D>(), Buffer<Point2D>(), index_buffer, options));
+
+    luaL_getmetatable(L, "gr.node");
+    lua_setmetatable(L, -2);
+    return 1;
+  }
+
   std::vector<Point3D> verts;
   std::vector< std::vector<int> > faces;
 
@@ -689,7 +1000,7 @@ int gr_tri_mesh_cmd(lua_State* L)
     lua_pop(L, 1);
   }
 
-  std::shared_ptr<TriMesh> tri_mesh(std::make_shared<TriMesh>(verts, faces));
+  std::shared_ptr<TriMesh> tri_mesh(std::make_shared<TriMesh>(verts, faces, options));
   GRLUA_DEBUG(mesh);
   data->node = std::make_shared<GeometryNode>(name, tri_mesh);
 
@@ -699,6 +1010,57 @@ int gr_tri_mesh_cmd(lua_State* L)
   return 1;
 }
 
+// Create a triangle mesh node from an obj file, optionally going through
+// a mesh cache directory
+extern "C"
+int gr_load_obj_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  // This needs to be done before newuserdata pushes the userdata on to the stack.
+  // The cache directory is optional, options may follow the filename
+  int options_arg = lua_istable(L, 3) ? 3 : 4;
+  const char* cache_directory = (options_arg == 3) ? "" : luaL_optstring(L, 3, "");
+
+  MeshOptions options;
+  get_mesh_options(L, options_arg, options);
+
+  // A page budget in megabytes keeps the mesh on disk in the cache directory
+  double page_budget = 0.0;
+  if (lua_istable(L, options_arg)) {
+    lua_getfield(L, options_arg, "page_budget");
+    page_budget = luaL_optnumber(L, -1, 0.0);
+    lua_pop(L, 1);
+  }
+  luaL_argcheck(L, page_budget == 0.0 || cache_directory[0] != 0, 3, "Paging needs a cache directory");
+  
+  gr_node_ud* data = (gr_node_ud*)lua_newuserdata(L, sizeof(gr_node_ud));
+  std::shared_ptr<SceneNode> temp;
+  memcpy(&data->node, &temp, sizeof(std::shared_ptr<SceneNode>));
+  data->node = nullptr;
+
+  const char* name = luaL_checkstring(L, 1);
+  const char* filename = luaL_checkstring(L, 2);
+
+  // The loaders already hash the file, so its key stands in for its contents
+  std::shared_ptr<Primitive> mesh;
+  uint64_t key = 0;
+  if (page_budget > 0.0) {
+    mesh = load_paged_obj(filename, cache_directory, (size_t)(page_budget * 1024.0 * 1024.0), options, &key);
+  } else {
+    mesh = load_obj(filename, cache_directory, options, &key);
+  }
+  luaL_argcheck(L, mesh != nullptr, 2, "Failed to load obj file");
+  fingerprint_hash(key);
+
+  data->node = std::make_shared<GeometryNode>(name, mesh);
+
+  luaL_getmetatable(L, "gr.node");
+  lua_setmetatable(L, -2);
+
+  return 1;
+}
+
 // Make a point light
 extern "C"
 int gr_light_cmd(lua_State* L)
@@ -806,13 +1168,25 @@ int gr_render_cmd(lua_State* L)
   unsigned int shadow_samples = luaL_optnumber(L, 14, 1);
   unsigned int glossy_samples = luaL_optnumber(L, 15, 1);
 
-  const char* bgfilename = luaL_optstring(L, 16, ""); 
+  // The background image is optional, options may follow the glossy samples
+  int options_arg = lua_istable(L, 16) ? 16 : 17;
+  const char* bgfilename = (options_arg == 16) ? "" : luaL_optstring(L, 16, ""); 
+
+  RenderOptions options;
+  get_render_options(L, options_arg, options);
+  if (bgfilename[0] != 0) fingerprint_file(bgfilename);
+  options.scene_fingerprint = scene_fingerprint;
+
+  // The scene holds everything it needs, so free whatever the script
+  // built to make it (e.g. mesh tables) before the memory is needed for
+  // rendering
+  lua_gc(L, LUA_GCCOLLECT, 0);
 
   a4_render(root->node, filename, width, height,
             eye, view, up, fov,
             ambient, lights,
             num_threads, recurse_level, aa_samples, shadow_samples, glossy_samples, 
-            std::string(bgfilename));
+            std::string(bgfilename), options);
   
   return 0;
 }
@@ -910,6 +1284,7 @@ int gr_node_set_texture_cmd(lua_State* L)
 
   Image texture;
   luaL_argcheck(L, texture.loadPng(filename), 2, "Failed to load png file");
+  fingerprint_file(filename);
 
   std::shared_ptr<PhongMaterial> new_material = std::make_shared<PhongMaterial>(material);
   new_material->set_texture(texture);
@@ -938,6 +1313,7 @@ int gr_node_set_bumpmap_cmd(lua_State* L)
 
   Image texture;
   luaL_argcheck(L, texture.loadPng(filename), 2, "Failed to load png file");
+  fingerprint_file(filename);
 
   double bumpscale = luaL_checknumber(L, 3);
 
@@ -1068,6 +1444,246 @@ int gr_node_gc_cmd(lua_State* L)
   return 0;
 }
 
+// Create a buffer of points for mesh vertices, optionally with a number
+// of points at the origin
+extern "C"
+int gr_vec3_buffer_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  gr_vec3_buffer_ud* data = (gr_vec3_buffer_ud*)lua_newuserdata(L, sizeof(gr_vec3_buffer_ud));
+  std::shared_ptr< std::vector<Point3D> > temp;
+  memcpy(&data->data, &temp, sizeof(std::shared_ptr< std::vector<Point3D> >));
+
+  int size = luaL_optint(L, 1, 0);
+  luaL_argcheck(L, size >= 0, 1, "Size must not be negative");
+  data->data = std::make_shared< std::vector<Point3D> >(size);
+
+  luaL_getmetatable(L, "gr.vec3_buffer");
+  lua_setmetatable(L, -2);
+
+  return 1;
+}
+
+// Create a buffer of mesh indices, optionally with a number of zeros
+extern "C"
+int gr_index_buffer_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  gr_index_buffer_ud* data = (gr_index_buffer_ud*)lua_newuserdata(L, sizeof(gr_index_buffer_ud));
+  std::shared_ptr< std::vector<unsigned int> > temp;
+  memcpy(&data->data, &temp, sizeof(std::shared_ptr< std::vector<unsigned int> >));
+
+  int size = luaL_optint(L, 1, 0);
+  luaL_argcheck(L, size >= 0, 1, "Size must not be negative");
+  data->data = std::make_shared< std::vector<unsigned int> >(size);
+
+  luaL_getmetatable(L, "gr.index_buffer");
+  lua_setmetatable(L, -2);
+
+  return 1;
+}
+
+// Garbage collection function for vec3 buffers, meshes made from the
+// buffer keep their own reference to the points
+extern "C"
+int gr_vec3_buffer_gc_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  gr_vec3_buffer_ud* data = (gr_vec3_buffer_ud*)luaL_checkudata(L, 1, "gr.vec3_buffer");
+  luaL_argcheck(L, data != 0, 1, "Vec3 buffer expected");
+
+  data->data = nullptr;
+
+  return 0;
+}
+
+// Number of points in a vec3 buffer
+extern "C"
+int gr_vec3_buffer_size_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  gr_vec3_buffer_ud* data = (gr_vec3_buffer_ud*)luaL_checkudata(L, 1, "gr.vec3_buffer");
+  luaL_argcheck(L, data != 0, 1, "Vec3 buffer expected");
+
+  lua_pushinteger(L, data->data->size());
+
+  return 1;
+}
+
+// Resize a vec3 buffer, new points are at the origin
+extern "C"
+int gr_vec3_buffer_resize_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  gr_vec3_buffer_ud* data = (gr_vec3_buffer_ud*)luaL_checkudata(L, 1, "gr.vec3_buffer");
+  luaL_argcheck(L, data != 0, 1, "Vec3 buffer expected");
+
+  int size = luaL_checkint(L, 2);
+  luaL_argcheck(L, size >= 0, 2, "Size must not be negative");
+  get_writable(data->data).resize(size);
+
+  return 0;
+}
+
+// Set point i (counting from 1) of a vec3 buffer to x, y, z
+extern "C"
+int gr_vec3_buffer_set_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  gr_vec3_buffer_ud* data = (gr_vec3_buffer_ud*)luaL_checkudata(L, 1, "gr.vec3_buffer");
+  luaL_argcheck(L, data != 0, 1, "Vec3 buffer expected");
+
+  int i = luaL_checkint(L, 2);
+  luaL_argcheck(L, i >= 1 && (size_t)i <= data->data->size(), 2, "Index out of range");
+
+  Point3D p(luaL_checknumber(L, 3), luaL_checknumber(L, 4), luaL_checknumber(L, 5));
+  get_writable(data->data)[i - 1] = p;
+
+  return 0;
+}
+
+// Append the point x, y, z to a vec3 buffer
+extern "C"
+int gr_vec3_buffer_push_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  gr_vec3_buffer_ud* data = (gr_vec3_buffer_ud*)luaL_checkudata(L, 1, "gr.vec3_buffer");
+  luaL_argcheck(L, data != 0, 1, "Vec3 buffer expected");
+
+  Point3D p(luaL_checknumber(L, 2), luaL_checknumber(L, 3), luaL_checknumber(L, 4));
+  get_writable(data->data).push_back(p);
+
+  return 0;
+}
+
+// Get point i (counting from 1) of a vec3 buffer as x, y, z
+extern "C"
+int gr_vec3_buffer_get_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  gr_vec3_buffer_ud* data = (gr_vec3_buffer_ud*)luaL_checkudata(L, 1, "gr.vec3_buffer");
+  luaL_argcheck(L, data != 0, 1, "Vec3 buffer expected");
+
+  int i = luaL_checkint(L, 2);
+  luaL_argcheck(L, i >= 1 && (size_t)i <= data->data->size(), 2, "Index out of range");
+
+  const Point3D& p = (*data->data)[i - 1];
+  lua_pushnumber(L, p[0]);
+  lua_pushnumber(L, p[1]);
+  lua_pushnumber(L, p[2]);
+
+  return 3;
+}
+
+// Garbage collection function for index buffers
+extern "C"
+int gr_index_buffer_gc_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  gr_index_buffer_ud* data = (gr_index_buffer_ud*)luaL_checkudata(L, 1, "gr.index_buffer");
+  luaL_argcheck(L, data != 0, 1, "Index buffer expected");
+
+  data->data = nullptr;
+
+  return 0;
+}
+
+// Number of indices in an index buffer
+extern "C"
+int gr_index_buffer_size_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  gr_index_buffer_ud* data = (gr_index_buffer_ud*)luaL_checkudata(L, 1, "gr.index_buffer");
+  luaL_argcheck(L, data != 0, 1, "Index buffer expected");
+
+  lua_pushinteger(L, data->data->size());
+
+  return 1;
+}
+
+// Resize an index buffer, new indices are 0
+extern "C"
+int gr_index_buffer_resize_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  gr_index_buffer_ud* data = (gr_index_buffer_ud*)luaL_checkudata(L, 1, "gr.index_buffer");
+  luaL_argcheck(L, data != 0, 1, "Index buffer expected");
+
+  int size = luaL_checkint(L, 2);
+  luaL_argcheck(L, size >= 0, 2, "Size must not be negative");
+  get_writable(data->data).resize(size);
+
+  return 0;
+}
+
+// Set entry i (counting from 1) of an index buffer. The indices
+// themselves count vertices from 0, like the faces of gr.mesh
+extern "C"
+int gr_index_buffer_set_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  gr_index_buffer_ud* data = (gr_index_buffer_ud*)luaL_checkudata(L, 1, "gr.index_buffer");
+  luaL_argcheck(L, data != 0, 1, "Index buffer expected");
+
+  int i = luaL_checkint(L, 2);
+  luaL_argcheck(L, i >= 1 && (size_t)i <= data->data->size(), 2, "Index out of range");
+
+  int index = luaL_checkint(L, 3);
+  luaL_argcheck(L, index >= 0, 3, "Indices must not be negative");
+  get_writable(data->data)[i - 1] = index;
+
+  return 0;
+}
+
+// Append any number of indices to an index buffer, e.g. push(a, b, c)
+// for a triangle
+extern "C"
+int gr_index_buffer_push_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  gr_index_buffer_ud* data = (gr_index_buffer_ud*)luaL_checkudata(L, 1, "gr.index_buffer");
+  luaL_argcheck(L, data != 0, 1, "Index buffer expected");
+
+  std::vector<unsigned int>& indices = get_writable(data->data);
+  for (int arg = 2; arg <= lua_gettop(L); arg++) {
+    int index = luaL_checkint(L, arg);
+    luaL_argcheck(L, index >= 0, arg, "Indices must not be negative");
+    indices.push_back(index);
+  }
+
+  return 0;
+}
+
+// Get entry i (counting from 1) of an index buffer
+extern "C"
+int gr_index_buffer_get_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  gr_index_buffer_ud* data = (gr_index_buffer_ud*)luaL_checkudata(L, 1, "gr.index_buffer");
+  luaL_argcheck(L, data != 0, 1, "Index buffer expected");
+
+  int i = luaL_checkint(L, 2);
+  luaL_argcheck(L, i >= 1 && (size_t)i <= data->data->size(), 2, "Index out of range");
+
+  lua_pushinteger(L, (*data->data)[i - 1]);
+
+  return 1;
+}
+
 // This is where all the "global" functions in our library are
 // declared.
 // If you want to add a new non-member function, add it here.
@@ -1082,6 +1698,7 @@ static const luaL_reg grlib_functions[] = {
   {"nh_box", gr_nh_box_cmd},
   {"mesh", gr_mesh_cmd},
   {"tri_mesh", gr_tri_mesh_cmd},
+  {"load_obj", gr_load_obj_cmd},
   {"light", gr_light_cmd},
   {"disc_light", gr_disc_light_cmd},
   {"render", gr_render_cmd},
@@ -1098,6 +1715,10 @@ static const luaL_reg grlib_functions[] = {
   {"csg_union", gr_csg_union_cmd},
   {"csg_intersection", gr_csg_intersection_cmd},
   {"csg_difference", gr_csg_difference_cmd},
+  {"sphere_cloud", gr_sphere_cloud_cmd},
+  {"heightfield", gr_heightfield_cmd},
+  {"vec3_buffer", gr_vec3_buffer_cmd},
+  {"index_buffer", gr_index_buffer_cmd},
   {0, 0}
 };
 
@@ -1127,6 +1748,29 @@ static const luaL_reg grlib_node_methods[] = {
   {0, 0}
 };
 
+// Member functions for "gr.vec3_buffer" and "gr.index_buffer" objects.
+static const luaL_reg grlib_vec3_buffer_methods[] = {
+  {"__gc", gr_vec3_buffer_gc_cmd},
+  {"__len", gr_vec3_buffer_size_cmd},
+  {"size", gr_vec3_buffer_size_cmd},
+  {"resize", gr_vec3_buffer_resize_cmd},
+  {"set", gr_vec3_buffer_set_cmd},
+  {"get", gr_vec3_buffer_get_cmd},
+  {"push", gr_vec3_buffer_push_cmd},
+  {0, 0}
+};
+
+static const luaL_reg grlib_index_buffer_methods[] = {
+  {"__gc", gr_index_buffer_gc_cmd},
+  {"__len", gr_index_buffer_size_cmd},
+  {"size", gr_index_buffer_size_cmd},
+  {"resize", gr_index_buffer_resize_cmd},
+  {"set", gr_index_buffer_set_cmd},
+  {"get", gr_index_buffer_get_cmd},
+  {"push", gr_index_buffer_push_cmd},
+  {0, 0}
+};
+
 // This function calls the lua interpreter to define the scene and
 // raytrace it as appropriate.
 bool run_lua(const std::string& filename)
@@ -1153,9 +1797,26 @@ bool run_lua(const std::string& filename)
   // Load the gr.node methods
   luaL_openlib(L, 0, grlib_node_methods, 0);
 
+  // Set up the metatables and methods for the buffers
+  luaL_newmetatable(L, "gr.vec3_buffer");
+  lua_pushstring(L, "__index");
+  lua_pushvalue(L, -2);
+  lua_settable(L, -3);
+  luaL_openlib(L, 0, grlib_vec3_buffer_methods, 0);
+
+  luaL_newmetatable(L, "gr.index_buffer");
+  lua_pushstring(L, "__index");
+  lua_pushvalue(L, -2);
+  lua_settable(L, -3);
+  luaL_openlib(L, 0, grlib_index_buffer_methods, 0);
+
   // Load the gr functions
   luaL_openlib(L, "gr", grlib_functions, 0);
 
+  // The script itself is the first input to the scene
+  scene_fingerprint = 0;
+  fingerprint_file(filename.c_str());
+
   GRLUA_DEBUG("Parsing the scene");
   // Now parse the actual scene
   if (luaL_loadfile(L, filename.c_str()) || lua_pcall(L, 0, 0, 0)) {
@@ -0,0 +1,92 @@
+#include "spherecloud.hpp"
+#include <cmath>
+#include <limits>
+
+SphereCloud::SphereCloud(const std::vector<Point3D>& centers, const std::vector<double>& radii)
+{
+  size_t n = std::min(centers.size(), radii.size());
+
+  std::vector<BoundingBox> bounds(n);
+  for(size_t i = 0; i < n; i++)
+  {
+    Vector3D r(radii[i], radii[i], radii[i]);
+    bounds[i] = BoundingBox(centers[i] - r, centers[i] + r);
+  }
+
+  // Leaves of 8 spheres are about as many as can be tested together before the loop stops paying for itself
+  m_bvh = BVH(bounds, 8);
+
+  // Store the spheres in the order the leaves reference them
+  m_x.resize(n);
+  m_y.resize(n);
+  m_z.resize(n);
+  m_r.resize(n);
+  for(size_t i = 0; i < n; i++)
+  {
+    unsigned int k = m_bvh.indices()[i];
+    m_x[i] = centers[k][0];
+    m_y[i] = centers[k][1];
+    m_z[i] = centers[k][2];
+    m_r[i] = radii[k];
+  }
+}
+
+SphereCloud::~SphereCloud()
+{
+}
+
+BoundingBox SphereCloud::bounds() const
+{
+  return m_bvh.bounds();
+}
+
+bool SphereCloud::intersect(const Ray& ray, Intersection& j) const
+{
+  Point3D o = ray.origin();
+  Vector3D d = ray.direction();
+
+  const double* x = m_x.data();
+  const double* y = m_y.data();
+  const double* z = m_z.data();
+  const double* r = m_r.data();
+
+  long hit = -1;
+
+  // Same test as NonhierSphere::intersect but since the direction is normalized A = 1 and the half B form is used:
+  // t = -b +/- sqrt(b^2 - c) with b = d . (o - p_c) and c = (o - p_c) . (o - p_c) - r^2
+  // There are no branches inside the loop so the compiler is free to vectorize it across the spheres in the leaf
+  auto visit = [&](unsigned int first, unsigned int count, double& tmax) -> bool {
+    double best = tmax;
+    long best_k = -1;
+    for(unsigned int k = first; k < first + count; k++)
+    {
+      double vx = o[0] - x[k];
+      double vy = o[1] - y[k];
+      double vz = o[2] - z[k];
+      double b = d[0]*vx + d[1]*vy + d[2]*vz;
+      double c = vx*vx + vy*vy + vz*vz - r[k]*r[k];
+      double disc = b*b - c;
+      double s = std::sqrt(std::max(disc, 0.0));
+
+      // If the ray originates inside the sphere the near root is negative and the far root is used instead
+      double t0 = -b - s;
+      double t1 = -b + s;
+      double t = (t0 > 0) ? t0 : t1;
+
+      bool closer = (disc >= 0) & (t > 0) & (t < best);
+      best = closer ? t : best;
+      best_k = closer ? (long)k : best_k;
+    }
+
+    if(best_k < 0) return false;
+    tmax = best;
+    hit = best_k;
+    return true;
+  };
+
+  if(!m_bvh.traverse(ray, std::numeric_limits<double>::infinity(), visit)) return false;
+
+  // Let the single sphere fill in the normal, parametric coordinates and tangents for the closest hit
+  NonhierSphere sphere(Point3D(x[hit], y[hit], z[hit]), r[hit]);
+  return sphere.intersect(ray, j);
+}
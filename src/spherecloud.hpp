@@ -0,0 +1,29 @@
+#ifndef CS488_SPHERECLOUD_HPP
+#define CS488_SPHERECLOUD_HPP
+
+#include <vector>
+#include "primitive.hpp"
+#include "bvh.hpp"
+
+// A large set of spheres (particles) sharing a single scene node. The centers and radii are kept in packed
+// structure of arrays form, sorted into the leaf order of a BVH built over the spheres, so that each leaf
+// is a contiguous run that can be tested in one branch free loop.
+class SphereCloud : public Primitive {
+public:
+  SphereCloud(const std::vector<Point3D>& centers, const std::vector<double>& radii);
+  virtual ~SphereCloud();
+
+  virtual bool intersect(const Ray& ray, Intersection& j) const;
+  virtual BoundingBox bounds() const;
+
+  size_t size() const
+  {
+    return m_r.size();
+  }
+
+private:
+  std::vector<double> m_x, m_y, m_z, m_r;
+  BVH m_bvh;
+};
+
+#endif